@@ -179,20 +179,10 @@ class LogMessageVoidify {
 
 // Potentially unaligned loads and stores.
 
-#if defined(__i386__) || defined(__x86_64__) || defined(__powerpc__)
-
-#define UNALIGNED_LOAD16(_p) (*reinterpret_cast<const uint16 *>(_p))
-#define UNALIGNED_LOAD32(_p) (*reinterpret_cast<const uint32 *>(_p))
-#define UNALIGNED_LOAD64(_p) (*reinterpret_cast<const uint64 *>(_p))
-
-#define UNALIGNED_STORE16(_p, _val) (*reinterpret_cast<uint16 *>(_p) = (_val))
-#define UNALIGNED_STORE32(_p, _val) (*reinterpret_cast<uint32 *>(_p) = (_val))
-#define UNALIGNED_STORE64(_p, _val) (*reinterpret_cast<uint64 *>(_p) = (_val))
-
-#else
-
-// These functions are provided for architectures that don't support
-// unaligned loads and stores.
+// Copying through memcpy is well defined for any alignment and compiles to a
+// single move where unaligned access is cheap. Casting the pointers breaks
+// strict aliasing, and optimizing compilers miscompile the overlapping copies
+// in IncrementalCopyFastPath.
 
 inline uint16 UNALIGNED_LOAD16(const void *p) {
   uint16 t;
@@ -224,7 +214,6 @@ inline void UNALIGNED_STORE64(void *p, uint64 v) {
   memcpy(p, &v, sizeof v);
 }
 
-#endif
 
 // The following guarantees declaration of the byte swap functions.
 #ifdef WORDS_BIGENDIAN
@@ -0,0 +1,86 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "alias_table.hpp"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
+
+alias_table_writer::alias_table_writer() : m_count(0) {}
+
+void alias_table_writer::add_file(const path_location& alias,
+                                  const path_location& target,
+                                  const std::string& name) {
+  write_varint(m_entries, alias.m_chunk);
+  write_varint(m_entries, alias.m_file);
+  write_varint(m_entries, target.m_chunk);
+  write_varint(m_entries, target.m_file);
+  m_entries += name;
+  m_entries += '\0';
+  ++m_count;
+}
+
+void alias_table_writer::write(const bfs::path& path,
+                               std::size_t chunk_count) const {
+  bfs::ofstream out(path, bfs::ofstream::binary);
+  if (!out.is_open())
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for writing");
+
+  // [chunk-count][count][{alias-chunk, alias-file, target-chunk, target-file,
+  // name, 0}]
+  out.write("ALS1", 4);
+  write_binary(out, static_cast<db_uint>(chunk_count));
+  write_binary(out, m_count);
+  out.write(m_entries.c_str(), m_entries.size());
+
+  if (!out) throw std::runtime_error("Unable to write " + path.string());
+}
+
+alias_table::alias_table(const bfs::path& path) {
+  bfs::ifstream in(path, bfs::ifstream::binary);
+  if (!in.is_open())
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for reading");
+
+  m_data.assign(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>());
+
+  const std::size_t header_size = 4 + sizeof(db_uint) * 2;
+  if (m_data.size() < header_size || m_data.compare(0, 4, "ALS1") != 0)
+    throw std::runtime_error("Alias table " + path.string() + " is not valid");
+
+  m_chunk_count = read_binary(m_data, 4);
+  const db_uint count = read_binary(m_data, 4 + sizeof(db_uint));
+
+  // The string's terminator stops a varint that runs past the end, which is
+  // caught before the next one is read.
+  const char* p = m_data.c_str() + header_size;
+  const char* end = m_data.c_str() + m_data.size();
+  auto next = [&]() -> db_uint {
+    if (p >= end)
+      throw std::runtime_error("Alias table " + path.string() +
+                               " is not valid");
+    return static_cast<db_uint>(read_varint(p));
+  };
+
+  for (db_uint i = 0; i != count; ++i) {
+    file_alias a;
+    a.m_alias.m_chunk = next();
+    a.m_alias.m_file = next();
+    a.m_target.m_chunk = next();
+    a.m_target.m_file = next();
+    a.m_name = p;
+
+    const char* terminator =
+        p < end ? static_cast<const char*>(std::memchr(p, '\0', end - p)) : 0;
+    if (!terminator)
+      throw std::runtime_error("Alias table " + path.string() +
+                               " is not valid");
+
+    p = terminator + 1;
+    m_aliases.push_back(a);
+  }
+}
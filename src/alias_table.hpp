@@ -0,0 +1,56 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_ALIAS_TABLE_HPP
+#define CODEDB_ALIAS_TABLE_HPP
+
+#include "nsalias.hpp"
+#include "serialization.hpp"
+#include "path_table.hpp"
+
+#include <boost/filesystem/path.hpp>
+
+#include <string>
+#include <vector>
+
+// A file with the same contents as an earlier file of the same blob. Only the
+// target has the contents, the alias is an empty file in its own chunk.
+struct file_alias {
+  path_location m_alias;
+  path_location m_target;
+  const char* m_name;
+};
+
+// Collects the aliases of a database as the files are added.
+class alias_table_writer {
+ public:
+  alias_table_writer();
+
+  void add_file(const path_location& alias, const path_location& target,
+                const std::string& name);
+
+  bool empty() const { return m_count == 0; }
+
+  void write(const bfs::path& path, std::size_t chunk_count) const;
+
+ private:
+  std::string m_entries;
+  db_uint m_count;
+};
+
+// The aliases of a blob in database order, read into memory when the blob is
+// opened.
+class alias_table {
+ public:
+  alias_table(const bfs::path& path);
+
+  std::size_t chunk_count() const { return m_chunk_count; }
+
+  const std::vector<file_alias>& aliases() const { return m_aliases; }
+
+ private:
+  std::string m_data;
+  db_uint m_chunk_count;
+  std::vector<file_alias> m_aliases;
+};
+
+#endif
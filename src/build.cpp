@@ -8,160 +8,2040 @@
 #include "profiler.hpp"
 #include "file_lock.hpp"
 #include "serialization.hpp"
+#include "trigram.hpp"
+#include "path_table.hpp"
+#include "suffix_array.hpp"
+#include "token_index.hpp"
+#include "alias_table.hpp"
+#include "database.hpp"
+#include "work_queue.hpp"
+#include "manifest.hpp"
+#include "git_index.hpp"
+#include "stats.hpp"
 
 #include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <unordered_map>
+#include <unordered_set>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
 
 #include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <exception>
+#include <memory>
+#include <algorithm>
 #include <iostream>
+#include <iomanip>
+#include <iterator>
 #include <cassert>
+#include <cstring>
+#include <ctime>
+#include <limits>
 
 namespace {
-const std::size_t max_chunk_size = 512 * 1024;
+// Snappy stores the uncompressed length with 32 bits. The file contents of a
+// chunk are compressed together, so every file has to fit in that.
+const std::uint64_t max_snappy_size = 0xffffffffu;
+const std::uint64_t max_file_size = max_snappy_size - 64 * 1024 * 1024;
+
+// The files that make up a database, by what is appended to the name of the
+// blob.
+const char* const blob_files[] = {"",       ".tri", ".paths", ".tok",
+                                  ".sa",     ".files", ".del", ".alias",
+                                  ".excluded", 0};
+
+// Every this many lines, the offset of the line start is stored.
+const db_uint line_sample_interval = 64;
+
+// Files with a NUL byte in this many first bytes are taken to be binary, as
+// git does.
+const std::size_t binary_sniff_size = 8000;
+
+// The time a stage of the build took, summed over the threads that run it,
+// and how much went through it. The profilers count the ticks of one thread,
+// so the stages keep counters of their own.
+struct build_stage {
+  build_stage(const char* name, const char* unit)
+      : m_name(name), m_unit(unit), m_count(0), m_bytes(0), m_nanoseconds(0) {}
+
+  void add(std::uint64_t bytes) {
+    ++m_count;
+    m_bytes += bytes;
+  }
+
+  const char* m_name;
+  const char* m_unit;
+  std::atomic<std::uint64_t> m_count;
+  std::atomic<std::uint64_t> m_bytes;
+  std::atomic<std::uint64_t> m_nanoseconds;
+};
+
+build_stage s_walk_stage("walk", "dirs");
+build_stage s_hash_stage("hash", "files");
+build_stage s_read_stage("read", "files");
+build_stage s_compress_stage("compress", "chunks");
+build_stage s_write_stage("write", "chunks");
+
+build_stage* const build_stages[] = {&s_walk_stage, &s_hash_stage,
+                                     &s_read_stage, &s_compress_stage,
+                                     &s_write_stage, 0};
+
+// Adds the time until it goes out of scope to a stage.
+class stage_scope {
+ public:
+  explicit stage_scope(build_stage& stage)
+      : m_stage(stage), m_start(std::chrono::steady_clock::now()) {}
+
+  ~stage_scope() {
+    m_stage.m_nanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - m_start).count();
+  }
+
+ private:
+  build_stage& m_stage;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+// Starts the counters of every stage over, for a process such as watch that
+// builds more than once.
+void reset_stages() {
+  for (build_stage* const* i = build_stages; *i; ++i) {
+    (*i)->m_count = 0;
+    (*i)->m_bytes = 0;
+    (*i)->m_nanoseconds = 0;
+  }
+}
+
+// Prints the throughput of the stages that ran. A stage's seconds are summed
+// over its threads, so the rate is that of a single thread.
+void report_stages() {
+  std::cout << "stage          count          MiB   seconds     MiB/s\n";
+  for (build_stage* const* i = build_stages; *i; ++i) {
+    const build_stage& stage = **i;
+    if (stage.m_count == 0) continue;
+
+    const double mib = stage.m_bytes / (1024.0 * 1024.0);
+    const double seconds = stage.m_nanoseconds / 1e9;
+    std::cout << std::left << std::setw(9) << stage.m_name << std::right
+              << std::setw(8) << stage.m_count << ' ' << std::left
+              << std::setw(6) << stage.m_unit << std::right << std::fixed
+              << std::setprecision(1) << std::setw(8) << mib
+              << std::setprecision(3) << std::setw(10) << seconds;
+    if (stage.m_bytes != 0 && seconds > 0)
+      std::cout << std::setprecision(1) << std::setw(10) << mib / seconds;
+    std::cout << '\n';
+  }
+}
+
+// Hands out a resource at a steady rate, with up to a second of it saved up.
+// Taking more than there is goes into debt, which the taker sleeps off, so
+// the rate holds however many threads take from it. A rate of zero is no
+// limit.
+class token_bucket {
+ public:
+  token_bucket() : m_rate(0), m_tokens(0) {}
+
+  void set_rate(double rate) {
+    m_rate = rate;
+    m_tokens = rate;
+    m_last = std::chrono::steady_clock::now();
+  }
+
+  // Returns true if it had to wait.
+  bool take(double amount) {
+    if (m_rate == 0) return false;
+
+    double wait;
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      const auto now = std::chrono::steady_clock::now();
+      const std::chrono::duration<double> elapsed = now - m_last;
+      m_tokens = std::min(m_rate, m_tokens + elapsed.count() * m_rate);
+      m_tokens -= amount;
+      m_last = now;
+      wait = m_tokens < 0 ? -m_tokens / m_rate : 0;
+    }
+
+    if (wait <= 0) return false;
+
+    std::this_thread::sleep_for(
+        std::chrono::microseconds(static_cast<std::int64_t>(wait * 1e6)));
+    return true;
+  }
+
+ private:
+  boost::mutex m_mutex;
+  double m_rate;
+  double m_tokens;
+  std::chrono::steady_clock::time_point m_last;
+};
+
+// How often a build that yields to serve looks at the serve lock, unless it
+// was made to wait.
+const std::chrono::milliseconds serve_check_interval(10);
+
+// Paces a build that shares the host with serve. The readers take the bytes
+// they read from one bucket, and the readers and compressors take the
+// seconds they worked from another. If the build yields to serve, they also
+// wait while serve handles a request, which it does with a sharable lock on
+// the serve lock held. The lock is opened once, and only looked at after a
+// bucket made the build wait or once the check interval is over.
+class build_throttle {
+ public:
+  build_throttle() : m_waited(false) {}
+
+  void configure(const config& cfg, const bfs::path& cdb_path) {
+    m_read.set_rate(
+        boost::lexical_cast<double>(cfg.get_value("build-read-rate")));
+
+    // The share is of every core of the host.
+    const double share =
+        boost::lexical_cast<double>(cfg.get_value("build-cpu-share"));
+    const unsigned cores = std::max(boost::thread::hardware_concurrency(), 1u);
+    m_cpu.set_rate(share < 100 ? share / 100 * cores : 0);
+
+    m_serve_lock.reset();
+    if (cfg.get_value("build-yield-to-serve") == "on")
+      m_serve_lock.reset(new file_lock(cdb_path / "serve.lock"));
+    m_next_check = std::chrono::steady_clock::time_point();
+    m_waited = false;
+  }
+
+  void wait_for_serve() {
+    if (!m_serve_lock) return;
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (!m_waited && std::chrono::steady_clock::now() < m_next_check) return;
+
+    while (!m_serve_lock->try_lock_exclusive())
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    m_serve_lock->unlock();
+
+    m_waited = false;
+    m_next_check = std::chrono::steady_clock::now() + serve_check_interval;
+  }
+
+  // Accounts for work that started at start and read a number of bytes.
+  void pace(std::uint64_t bytes, std::chrono::steady_clock::time_point start) {
+    const std::chrono::duration<double> worked =
+        std::chrono::steady_clock::now() - start;
+    const bool read_wait = m_read.take(static_cast<double>(bytes));
+    const bool cpu_wait = m_cpu.take(worked.count());
+    if (read_wait || cpu_wait) m_waited = true;
+  }
+
+ private:
+  token_bucket m_read;
+  token_bucket m_cpu;
+  std::unique_ptr<file_lock> m_serve_lock;
+  boost::mutex m_mutex;
+  std::atomic<bool> m_waited;
+  std::chrono::steady_clock::time_point m_next_check;
+};
+
+
+build_throttle s_throttle;
+
+// How files are read and stored: whether whitespace is trimmed, which files
+// are left out, where long lines are cut and how much text goes in a chunk.
+// Zero turns the line length limits off.
+struct read_options {
+  bool m_trim_ws;
+  std::uint64_t m_max_file_size;
+  bool m_skip_binary;
+  std::uint64_t m_minified_line_length;
+  std::size_t m_max_line_length;
+  std::size_t m_chunk_size;
+
+  // Everything but the trimming, as the manifest records it.
+  std::string limits() const {
+    return "size=" + std::to_string(m_max_file_size) +
+           " binary=" + (m_skip_binary ? "on" : "off") +
+           " minified=" + std::to_string(m_minified_line_length) +
+           " line=" + std::to_string(m_max_line_length) +
+           " chunk=" + std::to_string(m_chunk_size);
+  }
+};
+
+// Identifies the contents of a file, to find files that are the same. The
+// size and hash of the file as it is on disk are combined with a second,
+// unrelated hash of the contents as they are stored.
+struct body_key {
+  std::uint64_t m_size;
+  std::uint64_t m_hash;
+  std::uint64_t m_contents_hash;
+
+  bool operator==(const body_key& other) const {
+    return m_size == other.m_size && m_hash == other.m_hash &&
+           m_contents_hash == other.m_contents_hash;
+  }
+};
+
+struct body_key_hash {
+  std::size_t operator()(const body_key& key) const {
+    return static_cast<std::size_t>(key.m_hash);
+  }
+};
+
+body_key make_body_key(const manifest_entry& entry, const char* begin,
+                       const char* end) {
+  body_key key;
+  key.m_size = entry.m_size;
+  key.m_hash = entry.m_hash;
+
+  // Eight bytes at a time, each step multiplied and folded.
+  std::uint64_t h = 0x9e3779b97f4a7c15ull ^ std::uint64_t(end - begin);
+  const char* p = begin;
+  for (; end - p >= 8; p += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    h = (h ^ word) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  for (; p != end; ++p) {
+    h = (h ^ static_cast<unsigned char>(*p)) * 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 29;
+  }
+
+  key.m_contents_hash = h;
+  return key;
+}
 
 void trim(const char*& b, const char*& e) {
   while (b != e && (*b == ' ' || *b == '\t' || *b == '\r')) ++b;
   while (e != b && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r')) --e;
 }
 
+// A file read into memory, with whitespace trimmed if configured, and what can
+// be computed from it without knowing about the other files.
+struct loaded_file {
+  bfs::path m_path;
+  manifest_entry m_entry;
+  std::string m_contents;
+  std::string m_excluded;
+  db_uint m_lines;
+  std::vector<db_uint> m_line_samples;
+  std::vector<trigram> m_trigrams;
+  body_key m_body;
+};
+
+// Reads a file, unless it is too large. Binary and minified files are read but
+// not kept. m_excluded says why a file was left out, and is empty otherwise.
+void load_file(const bfs::path& path, std::size_t prefix_size,
+               const read_options& ro, loaded_file& result) {
+  // The file is looked at before it's read, so that a change made while it's
+  // read shows up in the next build.
+  manifest_entry& entry = result.m_entry;
+  entry.m_name = path.generic_string().substr(prefix_size);
+  entry.m_size = bfs::file_size(path);
+  entry.m_mtime = bfs::last_write_time(path);
+  entry.m_hash = hash_seed;
+
+  result.m_path = path;
+  result.m_lines = 0;
+  result.m_line_samples.clear();
+  result.m_trigrams.clear();
+
+  result.m_contents.clear();
+  result.m_excluded.clear();
+
+  if (entry.m_size > ro.m_max_file_size) {
+    result.m_excluded =
+        "larger than " + std::to_string(ro.m_max_file_size) + " bytes";
+    return;
+  }
+
+  bfs::ifstream input(path, bfs::ifstream::binary);
+  if (!input.is_open())
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for reading");
+
+  // The file is read with a single call and its lines are trimmed in place,
+  // which never makes them longer. The extra byte is room for a newline after
+  // the last line.
+  std::string& contents = result.m_contents;
+  contents.resize(static_cast<std::size_t>(entry.m_size) + 1);
+  input.read(&contents[0], static_cast<std::streamsize>(entry.m_size));
+
+  char* const begin = &contents[0];
+  const char* const end = begin + input.gcount();
+  entry.m_hash = hash_bytes(entry.m_hash, begin, end);
+
+  if (ro.m_skip_binary &&
+      std::memchr(begin, '\0',
+                  std::min<std::size_t>(end - begin, binary_sniff_size))) {
+    result.m_excluded = "binary";
+    contents.clear();
+    return;
+  }
+
+  char* out = begin;
+  for (const char* p = begin; p != end;) {
+    const char* eol =
+        static_cast<const char*>(std::memchr(p, '\n', end - p));
+    const char* b = p;
+    const char* e = eol ? eol : end;
+    p = eol ? eol + 1 : end;
+
+    if (ro.m_trim_ws) trim(b, e);
+    if (ro.m_max_line_length && std::size_t(e - b) > ro.m_max_line_length)
+      e = b + ro.m_max_line_length;
+
+    if (result.m_lines != 0 && result.m_lines % line_sample_interval == 0)
+      result.m_line_samples.push_back(static_cast<db_uint>(out - begin));
+    result.m_lines++;
+
+    std::memmove(out, b, e - b);
+    out += e - b;
+    *out++ = '\n';
+  }
+
+  contents.resize(out - begin);
+
+  // Minified and generated files have few, very long lines.
+  if (ro.m_minified_line_length && result.m_lines != 0 &&
+      std::uint64_t(end - begin) / result.m_lines > ro.m_minified_line_length) {
+    result.m_excluded = "lines average " +
+                        std::to_string(std::uint64_t(end - begin) /
+                                       result.m_lines) +
+                        " bytes";
+    contents.clear();
+    return;
+  }
+
+  const char* stored = result.m_contents.c_str();
+  const char* stored_end = stored + result.m_contents.size();
+  extract_trigrams(stored, stored_end, result.m_trigrams);
+  result.m_body = make_body_key(entry, stored, stored_end);
+}
+
+std::uint64_t hash_file(const bfs::path& path) {
+  bfs::ifstream input(path, bfs::ifstream::binary);
+  if (!input.is_open())
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for reading");
+
+  std::uint64_t hash = hash_seed;
+  char buffer[64 * 1024];
+  while (input.read(buffer, sizeof(buffer)) || input.gcount())
+    hash = hash_bytes(hash, buffer, buffer + input.gcount());
+
+  return hash;
+}
+
+// Counts and samples the lines of contents that are already stored, and
+// extracts their trigrams.
+void index_contents(loaded_file& result) {
+  const char* begin = result.m_contents.c_str();
+  const char* end = begin + result.m_contents.size();
+
+  result.m_lines = 0;
+  result.m_line_samples.clear();
+  result.m_trigrams.clear();
+
+  for (const char* p = begin; p != end;) {
+    if (result.m_lines != 0 && result.m_lines % line_sample_interval == 0)
+      result.m_line_samples.push_back(static_cast<db_uint>(p - begin));
+    result.m_lines++;
+
+    const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    p = eol ? eol + 1 : end;
+  }
+
+  extract_trigrams(begin, end, result.m_trigrams);
+}
+
+// Takes a file from a database rather than from the disk. The contents are
+// used as they were stored, which is already trimmed if the database was.
+void load_stored(const db_file& file, const manifest_entry& entry,
+                 loaded_file& result) {
+  result.m_path = entry.m_name;
+  result.m_entry = entry;
+  result.m_contents.assign(file.m_start, file.m_end);
+  result.m_excluded.clear();
+
+  index_contents(result);
+  result.m_body = make_body_key(entry, file.m_start, file.m_end);
+}
+
+// Writes a database with a pipeline. Files are added in order, and the indexes
+// and chunks are built in the calling thread. Full chunks are compressed by a
+// pool of workers, and a writer thread stores them in the order they were
+// made, so the output doesn't depend on the number of threads.
 class builder {
  public:
-  builder(const bfs::path& packed, bool trim)
-      : m_packed(packed, bfs::ofstream::binary),
-        m_trim(trim),
+  builder(const bfs::path& packed, const read_options& ro, bool suffixes,
+          bool tokens, unsigned threads)
+      : m_path(packed),
+        m_packed(packed, bfs::ofstream::binary),
+        m_trigram_path(packed.string() + ".tri"),
+        m_path_table_path(packed.string() + ".paths"),
+        m_token_index_path(packed.string() + ".tok"),
+        m_suffix_array_path(packed.string() + ".sa"),
+        m_alias_table_path(packed.string() + ".alias"),
+        m_report_path(packed.string() + ".excluded"),
         m_process_file_prof(make_profiler("process_file")),
-        m_compress_prof(make_profiler("compress")) {
+        m_index_prof(make_profiler("index")),
+        m_chunk_size(ro.m_chunk_size),
+        m_chunk_count(0),
+        m_jobs(threads * 2),
+        m_results(threads * 2) {
     if (!m_packed.is_open())
       throw std::runtime_error("Unable to open " + packed.string() +
                                " for writing");
 
     // Database magic
-    m_packed.write("CDB1", 4);
+    m_packed.write("CDB5", 4);
+    m_offset = 4;
+
+    if (suffixes) m_suffixes.reset(new suffix_array_writer);
+    if (tokens) m_tokens.reset(new token_index_writer);
+
+    m_manifest.m_trimmed = ro.m_trim_ws;
+    m_manifest.m_limits = ro.limits();
+    m_manifest.m_created = std::time(0);
+
+    for (unsigned i = 0; i != threads; ++i)
+      m_compressors.create_thread([this] { compress_chunks(); });
+    m_writer = boost::thread([this] { write_chunks(); });
+  }
+
+  ~builder() { stop(); }
+
+  // Files changed after this time are hashed by the next build, even if their
+  // size and modification time are the same. Defaults to the current time.
+  void set_created(std::int64_t time) { m_manifest.m_created = time; }
+
+  // Flushes the last chunk and writes the table of contents, the trigram index,
+  // the path table, the token index, the suffix array, the alias table, the
+  // manifest and the list of excluded files.
+  void finish() {
+    if (!m_chunk_files.empty()) end_chunk();
+
+    stop();
+    check_error();
+
+    write_toc(m_packed, m_toc, m_offset);
+
+    profile_scope prof(m_index_prof);
+    m_trigrams.write(m_trigram_path);
+    m_paths.write(m_path_table_path);
+
+    bfs::remove(m_token_index_path);
+    if (m_tokens) m_tokens->write(m_token_index_path);
+
+    bfs::remove(m_suffix_array_path);
+    if (m_suffixes && !m_suffixes->write(m_suffix_array_path))
+      std::cerr << "Skipping the suffix array, the database is too large\n";
+
+    bfs::remove(m_alias_table_path);
+    if (!m_aliases.empty()) m_aliases.write(m_alias_table_path, m_chunk_count);
+
+    write_report();
+    write_manifest(m_path, m_manifest);
   }
 
-  ~builder() {
-    if (!m_chunk_files.empty()) compress_chunk();
+  // Records a file that was left out without being read again.
+  void add_excluded(const excluded_file& file) {
+    m_manifest.m_excluded.push_back(file);
+  }
+
+  void add_file(loaded_file& file) {
+    if (!file.m_excluded.empty()) {
+      excluded_file e;
+      e.m_entry = file.m_entry;
+      e.m_reason = file.m_excluded;
+      add_excluded(e);
+      return;
+    }
+
+    // Files with the same contents as an earlier file become aliases of it.
+    const bool has_contents = !file.m_contents.empty();
+    if (has_contents) {
+      auto earlier = m_bodies.find(file.m_body);
+      if (earlier != m_bodies.end()) {
+        add_alias(file, earlier->second);
+        return;
+      }
+    }
+
+    if (file.m_contents.size() > m_chunk_size) {
+      add_parts(file);
+      return;
+    }
+
+    // The file starts a new chunk if it would take this one further past the
+    // chunk size than the chunk is short of it, so that chunks take about as
+    // long to search. It also does if snappy couldn't compress them together.
+    const std::size_t size = m_chunk_data.size() + file.m_contents.size();
+    if (!m_chunk_files.empty() &&
+        (size + m_chunk_data.size() > 2 * m_chunk_size || size > max_file_size))
+      end_chunk();
+
+    if (has_contents) m_bodies[file.m_body] = next_location();
+    store_file(file, 1);
+
+    if (m_chunk_data.size() > m_chunk_size) end_chunk();
   }
 
-  void process_file(const bfs::path& path, std::size_t prefix_size) {
-    profile_start(m_process_file_prof);
+  // Copies a chunk of an earlier build as it is stored. The files are
+  // decompressed for the indexes, but not compressed again. The entries
+  // describe the files as they are now. If the trigrams of the files are
+  // known from the earlier trigram index, they are taken from there.
+  void copy_chunk(database& db, std::size_t index,
+                  std::vector<manifest_entry>& entries,
+                  const std::vector<trigram>* trigrams) {
+    if (!m_chunk_files.empty()) end_chunk();
+    check_error();
 
-    bfs::ifstream input(path);
-    if (!input.is_open())
-      throw std::runtime_error("Unable to open " + path.string() +
-                               " for reading");
+    profile_scope prof(m_process_file_prof);
 
-    std::string line;
-    std::size_t bytes = 0;
-    while (getline(input, line)) {
-      const char* b = line.c_str();
-      const char* e = b + line.size();
+    compressed_chunk compressed;
+    db.get_chunk(index, compressed);
 
-      if (m_trim) trim(b, e);
+    chunk_record record;
+    record.m_filter.assign(compressed.m_filter.data(),
+                           compressed.m_filter.size());
+    record.m_meta.assign(compressed.m_meta_start, compressed.m_meta_end);
+    record.m_contents.assign(compressed.m_start, compressed.m_end);
+    record.m_info = db.get_chunk_info(index);
 
-      m_chunk_data.append(b, e - b);
-      m_chunk_data += '\n';
+    db_chunk chunk(compressed, m_storage);
+    chunk.load_contents();
 
-      bytes += (e - b) + 1;
+    // Later files can be aliases of the copied ones.
+    db_file file;
+    for (std::size_t i = 0; chunk.next_file(file); ++i) {
+      if (file.m_start != file.m_end) {
+        path_location location;
+        location.m_chunk = static_cast<db_uint>(m_chunk_count);
+        location.m_file = static_cast<db_uint>(i);
+        m_bodies.insert(std::make_pair(
+            make_body_key(entries[i], file.m_start, file.m_end), location));
+      }
+
+      m_paths.add_file(file.m_name_start);
+      if (trigrams)
+        m_trigrams.add_file(trigrams[i]);
+      else
+        m_trigrams.add_file(file.m_start, file.m_end);
+      if (m_tokens) m_tokens->add_file(file.m_start, file.m_end);
+      if (m_suffixes)
+        m_suffixes->add_file(file.m_name_start, file.m_start, file.m_end);
     }
 
+    m_results.put(m_chunk_count++, record);
+
+    m_chunk_entries.swap(entries);
+    end_indexes();
+  }
+
+ private:
+  // Where the next file added to the current chunk goes.
+  path_location next_location() const {
+    path_location location;
+    location.m_chunk = static_cast<db_uint>(m_chunk_count);
+    location.m_file = static_cast<db_uint>(m_chunk_files.size());
+    return location;
+  }
+
+  // Splits a file larger than a chunk at line boundaries, into parts of about
+  // the same size that each fill a chunk. Every part is listed in the
+  // manifest, but only the first in the path table. Split files don't take
+  // part in finding files with the same contents.
+  void add_parts(loaded_file& file) {
+    if (!m_chunk_files.empty()) end_chunk();
+
+    const std::string& contents = file.m_contents;
+    const std::size_t parts =
+        (contents.size() + m_chunk_size - 1) / m_chunk_size;
+    const std::size_t part_size = contents.size() / parts;
+
+    loaded_file part;
+    part.m_entry = file.m_entry;
+
+    db_uint first_line = 1;
+    for (std::size_t start = 0, k = 1; start != contents.size(); ++k) {
+      std::size_t end = contents.size();
+      if (k < parts) {
+        const std::size_t eol =
+            contents.find('\n', std::max(start, k * part_size - 1));
+        if (eol != std::string::npos) end = eol + 1;
+      }
+
+      part.m_contents.assign(contents, start, end - start);
+      index_contents(part);
+      store_file(part, first_line);
+      end_chunk();
+
+      first_line += part.m_lines;
+      start = end;
+    }
+  }
+
+  // Appends a file, or a part of one that starts at a later line, to the
+  // current chunk and indexes it.
+  void store_file(loaded_file& file, db_uint first_line) {
+    profile_scope prof(m_process_file_prof);
+
+    // The first file of a chunk is taken over rather than copied.
+    const std::size_t start = m_chunk_data.size();
+    if (start == 0)
+      m_chunk_data.swap(file.m_contents);
+    else
+      m_chunk_data += file.m_contents;
+
     file_entry fe;
-    fe.m_size = static_cast<db_uint>(bytes);
-    fe.m_name = path.generic_string().substr(prefix_size);
+    fe.m_size = m_chunk_data.size() - start;
+    fe.m_name = file.m_entry.m_name;
+    fe.m_lines = file.m_lines;
+    fe.m_line_samples.swap(file.m_line_samples);
+    fe.m_first_line = first_line;
 
     m_chunk_files.push_back(fe);
+    m_chunk_entries.push_back(file.m_entry);
+    if (first_line == 1)
+      m_paths.add_file(fe.m_name);
+    else
+      m_paths.skip_file();
 
-    profile_stop(m_process_file_prof);
+    const char* begin = m_chunk_data.c_str() + start;
+    const char* end = m_chunk_data.c_str() + m_chunk_data.size();
+    m_trigrams.add_file(file.m_trigrams);
+    if (m_tokens) m_tokens->add_file(begin, end, first_line);
+    if (m_suffixes) {
+      if (first_line == 1)
+        m_suffixes->add_file(fe.m_name, begin, end);
+      else
+        m_suffixes->extend_file(begin, end);
+    }
+  }
 
-    if (m_chunk_data.size() > max_chunk_size) compress_chunk();
+  // Adds an empty file in place of the contents, and indexes the contents as
+  // if they were there. The suffix array leaves the alias out, its matches
+  // are found through the target.
+  void add_alias(loaded_file& file, const path_location& target) {
+    profile_scope prof(m_process_file_prof);
+
+    file_entry fe;
+    fe.m_size = 0;
+    fe.m_name = file.m_entry.m_name;
+    fe.m_lines = 0;
+    fe.m_first_line = 1;
+
+    m_aliases.add_file(next_location(), target, fe.m_name);
+    m_chunk_files.push_back(fe);
+    m_chunk_entries.push_back(file.m_entry);
+    m_paths.add_file(fe.m_name);
+
+    m_trigrams.add_file(file.m_trigrams);
+    if (m_tokens)
+      m_tokens->add_file(file.m_contents.c_str(),
+                         file.m_contents.c_str() + file.m_contents.size());
   }
 
- private:
-  void compress_chunk() {
-    profile_scope prof(m_compress_prof);
+  struct file_entry {
+    std::uint64_t m_size;
+    std::string m_name;
+    db_uint m_lines;
+    std::vector<db_uint> m_line_samples;
+    db_uint m_first_line;
+  };
 
-    std::string chunk;
+  // The files of a chunk, on their way to a compression worker.
+  struct chunk_job {
+    std::size_t m_index;
+    std::string m_data;
+    std::vector<file_entry> m_files;
+  };
+
+  // A compressed chunk, on its way to the writer. The offset is filled in
+  // when it's written.
+  struct chunk_record {
+    std::string m_filter;
+    std::string m_meta;
+    std::string m_contents;
+    chunk_info m_info;
+  };
 
-    // file content offset (placeholder)
-    write_binary(chunk, 0);
+  // Hands the current chunk over to the compression workers.
+  void end_chunk() {
+    check_error();
 
-    // file count
-    write_binary(chunk, static_cast<db_uint>(m_chunk_files.size()));
+    chunk_job job;
+    job.m_index = m_chunk_count++;
+    job.m_data.swap(m_chunk_data);
+    job.m_files.swap(m_chunk_files);
+    m_jobs.put(job);
+
+    end_indexes();
+  }
+
+  void end_indexes() {
+    m_manifest.m_chunks.push_back(std::vector<manifest_entry>());
+    m_manifest.m_chunks.back().swap(m_chunk_entries);
 
-    // [{file-size, name-offset}]
-    db_uint name_offset = 0;
-    for (auto i = m_chunk_files.begin(); i != m_chunk_files.end(); ++i) {
-      write_binary(chunk, i->m_size);
-      write_binary(chunk, name_offset);
+    m_trigrams.end_chunk();
+    m_paths.end_chunk();
+    if (m_tokens) m_tokens->end_chunk();
+    if (m_suffixes) m_suffixes->end_chunk();
+  }
+
+  void compress_chunks() {
+    try {
+      chunk_job job;
+      while (m_jobs.get(job)) {
+        s_throttle.wait_for_serve();
+        const auto start = std::chrono::steady_clock::now();
 
-      name_offset += static_cast<db_uint>(i->m_name.size()) + 1;
+        chunk_record record;
+        {
+          stage_scope stage(s_compress_stage);
+          compress_chunk(job, record);
+          s_compress_stage.add(record.m_info.m_uncompressed_size);
+        }
+        s_throttle.pace(0, start);
+        m_results.put(job.m_index, record);
+      }
     }
+    catch (...) {
+      fail(std::current_exception());
+    }
+  }
+
+  static void compress_chunk(const chunk_job& job, chunk_record& record) {
+    // The metadata and the file contents are compressed separately, so that
+    // the file names can be read without decompressing the contents.
+    std::string meta;
+
+    // file count
+    write_varint(meta, job.m_files.size());
+
+    // [{file-size}]
+    for (auto i = job.m_files.begin(); i != job.m_files.end(); ++i)
+      write_varint(meta, i->m_size);
 
     // [{filename, 0}]
-    for (auto i = m_chunk_files.begin(); i != m_chunk_files.end(); ++i) {
-      chunk += i->m_name;
-      chunk += '\0';
+    for (auto i = job.m_files.begin(); i != job.m_files.end(); ++i) {
+      meta += i->m_name;
+      meta += '\0';
+    }
+
+    // [line-interval, {line-count, sample-count, {sample}}]
+    write_binary(meta, line_sample_interval);
+    for (auto i = job.m_files.begin(); i != job.m_files.end(); ++i) {
+      write_binary(meta, i->m_lines);
+      write_binary(meta, static_cast<db_uint>(i->m_line_samples.size()));
+      for (auto j = i->m_line_samples.begin(); j != i->m_line_samples.end();
+           ++j)
+        write_binary(meta, *j);
     }
 
-    // now we can write the file content offset
-    write_binary_at(chunk, 0, static_cast<db_uint>(chunk.size()));
+    // [{first-line}], only in chunks with a later part of a split file.
+    auto later_part = [](const file_entry& f) { return f.m_first_line != 1; };
+    if (std::any_of(job.m_files.begin(), job.m_files.end(), later_part))
+      for (auto i = job.m_files.begin(); i != job.m_files.end(); ++i)
+        write_varint(meta, i->m_first_line);
 
-    // finally, the actual file contents
-    chunk += m_chunk_data;
+    if (meta.size() > max_snappy_size || job.m_data.size() > max_snappy_size)
+      throw std::runtime_error("Chunk of " + std::to_string(job.m_data.size()) +
+                               " bytes is too large to compress");
 
-    std::string compressed_chunk;
-    snappy_compress(chunk, compressed_chunk);
+    snappy_compress(meta, record.m_meta);
+    snappy_compress(job.m_data, record.m_contents);
 
-    write_binary(m_packed, static_cast<db_uint>(compressed_chunk.size()));
-    m_packed.write(compressed_chunk.c_str(), compressed_chunk.size());
+    // The trigram filter is stored uncompressed in front of the chunk.
+    chunk_filter::build(job.m_data.c_str(),
+                        job.m_data.c_str() + job.m_data.size(),
+                        record.m_filter);
 
-    m_chunk_data.clear();
-    m_chunk_files.clear();
+    chunk_info& info = record.m_info;
+    info.m_size = sizeof(db_uint) + record.m_filter.size() +
+                  sizeof(std::uint64_t) + record.m_meta.size() +
+                  record.m_contents.size();
+    info.m_uncompressed_size = meta.size() + job.m_data.size();
+    info.m_file_count = static_cast<db_uint>(job.m_files.size());
+    info.m_first_path = job.m_files.front().m_name;
+    info.m_last_path = job.m_files.back().m_name;
   }
 
-  struct file_entry {
-    db_uint m_size;
-    std::string m_name;
-  };
+  void write_chunks() {
+    try {
+      chunk_record record;
+      while (m_results.get(record)) {
+        stage_scope stage(s_write_stage);
+        chunk_info& info = record.m_info;
+        info.m_offset = m_offset;
+
+        write_binary64(m_packed, info.m_size);
+        write_binary(m_packed, static_cast<db_uint>(record.m_filter.size()));
+        m_packed.write(record.m_filter.c_str(), record.m_filter.size());
+        write_binary64(m_packed, record.m_meta.size());
+        m_packed.write(record.m_meta.c_str(), record.m_meta.size());
+        m_packed.write(record.m_contents.c_str(), record.m_contents.size());
+
+        if (!m_packed)
+          throw std::runtime_error("Unable to write the database");
+
+        m_offset += sizeof(std::uint64_t) + info.m_size;
+        m_toc.push_back(info);
+        s_write_stage.add(sizeof(std::uint64_t) + info.m_size);
+      }
+    }
+    catch (...) {
+      fail(std::current_exception());
+    }
+  }
+
+  // Waits for the queued chunks to be written and stops the threads.
+  void stop() {
+    m_jobs.close();
+    m_compressors.join_all();
+    m_results.close();
+    if (m_writer.joinable()) m_writer.join();
+  }
+
+  // Stops the pipeline after an error in one of its threads. The error is
+  // rethrown in the thread that adds the files.
+  void fail(std::exception_ptr error) {
+    {
+      boost::mutex::scoped_lock lock(m_error_mutex);
+      if (!m_error) m_error = error;
+    }
+
+    m_jobs.close();
+    m_results.close();
+  }
+
+  void check_error() {
+    boost::mutex::scoped_lock lock(m_error_mutex);
+    if (m_error) std::rethrow_exception(m_error);
+  }
+
+  // One "path: reason" line per excluded file, in database order.
+  void write_report() {
+    std::vector<excluded_file>& excluded = m_manifest.m_excluded;
+
+    bfs::remove(m_report_path);
+    if (excluded.empty()) return;
+
+    std::sort(excluded.begin(), excluded.end(),
+              [](const excluded_file& a, const excluded_file& b) {
+      return path_less(a.m_entry.m_name, b.m_entry.m_name);
+    });
 
+    bfs::ofstream out(m_report_path);
+    if (!out.is_open())
+      throw std::runtime_error("Unable to open " + m_report_path.string() +
+                               " for writing");
+
+    for (auto i = excluded.begin(); i != excluded.end(); ++i)
+      out << i->m_entry.m_name << ": " << i->m_reason << '\n';
+  }
+
+  bfs::path m_path;
   std::string m_chunk_data;
   bfs::ofstream m_packed;
-  bool m_trim;
+  bfs::path m_trigram_path;
+  bfs::path m_path_table_path;
+  bfs::path m_token_index_path;
+  bfs::path m_suffix_array_path;
+  bfs::path m_alias_table_path;
+  bfs::path m_report_path;
   profiler& m_process_file_prof;
-  profiler& m_compress_prof;
+  profiler& m_index_prof;
   std::vector<file_entry> m_chunk_files;
+  std::vector<manifest_entry> m_chunk_entries;
+  manifest m_manifest;
+  chunk_storage m_storage;
+  std::vector<chunk_info> m_toc;
+  std::uint64_t m_offset;
+  std::size_t m_chunk_size;
+  std::size_t m_chunk_count;
+  trigram_index_writer m_trigrams;
+  path_table_writer m_paths;
+  std::unique_ptr<token_index_writer> m_tokens;
+  std::unique_ptr<suffix_array_writer> m_suffixes;
+  alias_table_writer m_aliases;
+  std::unordered_map<body_key, path_location, body_key_hash> m_bodies;
+  work_queue<chunk_job> m_jobs;
+  ordered_queue<chunk_record> m_results;
+  boost::thread_group m_compressors;
+  boost::thread m_writer;
+  boost::mutex m_error_mutex;
+  std::exception_ptr m_error;
 };
 
+// Reads the files in [first, last) with a pool of threads and adds them to the
+// builder in order.
+void add_files(builder& b, const std::vector<bfs::path>& files,
+               std::size_t first, std::size_t last, std::size_t prefix_size,
+               const read_options& ro, unsigned threads) {
+  ordered_queue<loaded_file> loaded(threads * 4);
+  std::atomic<std::size_t> next(first);
+  std::exception_ptr error;
+  boost::mutex error_mutex;
+
+  boost::thread_group readers;
+  for (unsigned t = 0; t != threads; ++t) {
+    readers.create_thread([&] {
+      try {
+        loaded_file file;
+        for (std::size_t i; (i = next++) < last;) {
+          s_throttle.wait_for_serve();
+          const auto start = std::chrono::steady_clock::now();
+          {
+            stage_scope stage(s_read_stage);
+            load_file(files[i], prefix_size, ro, file);
+            s_read_stage.add(file.m_entry.m_size);
+          }
+
+          // Files that are too large aren't read.
+          const std::uint64_t size = file.m_entry.m_size;
+          s_throttle.pace(size <= ro.m_max_file_size ? size : 0, start);
+          loaded.put(i - first, file);
+        }
+      }
+      catch (...) {
+        boost::mutex::scoped_lock lock(error_mutex);
+        if (!error) error = std::current_exception();
+        loaded.close();
+      }
+    });
+  }
+
+  try {
+    loaded_file file;
+    for (std::size_t i = first; i != last && loaded.get(file); ++i)
+      b.add_file(file);
+  }
+  catch (...) {
+    loaded.close();
+    readers.join_all();
+    throw;
+  }
+
+  readers.join_all();
+  if (error) std::rethrow_exception(error);
+}
+
+// A part of a build: either the files in [m_first, m_last) are indexed, or
+// chunk m_chunk of the previous build is copied.
+struct build_step {
+  std::size_t m_first;
+  std::size_t m_last;
+  std::size_t m_chunk;
+  std::vector<manifest_entry> m_entries;
+};
+
+const std::size_t no_chunk = std::size_t(-1);
+
+void add_step(std::vector<build_step>& steps, std::size_t first,
+              std::size_t last) {
+  if (first == last) return;
+
+  build_step step;
+  step.m_first = first;
+  step.m_last = last;
+  step.m_chunk = no_chunk;
+  steps.push_back(step);
+}
+
+// Hashes the files at the given indexes in parallel, and marks the ones that
+// still have the hash of their entry as unchanged. Files that can't be read
+// are indexed again, which reports the error.
+void check_hashes(const std::vector<bfs::path>& files,
+                  const std::vector<std::size_t>& indexes,
+                  const std::vector<manifest_entry>& entries,
+                  std::vector<char>& unchanged, unsigned threads) {
+  std::atomic<std::size_t> next(0);
+  boost::thread_group hashers;
+  for (unsigned t = 0; t != threads; ++t) {
+    hashers.create_thread([&] {
+      for (std::size_t i; (i = next++) < indexes.size();) {
+        const std::size_t file = indexes[i];
+        try {
+          s_throttle.wait_for_serve();
+          const auto start = std::chrono::steady_clock::now();
+          {
+            stage_scope stage(s_hash_stage);
+            unchanged[file] = hash_file(files[file]) == entries[file].m_hash;
+            s_hash_stage.add(entries[file].m_size);
+          }
+          s_throttle.pace(entries[file].m_size, start);
+        }
+        catch (const std::exception&) {
+        }
+      }
+    });
+  }
+  hashers.join_all();
+}
+
+// Whether a chunk has aliases. They point at their targets by where they are,
+// which changes when the chunks before them are built again, so such chunks
+// are never copied.
+bool has_aliases(const alias_map& aliases, std::size_t chunk) {
+  const std::vector<file_alias>& all = aliases.aliases();
+  auto i = std::lower_bound(all.begin(), all.end(), chunk,
+                            [](const file_alias& a, std::size_t c) {
+    return a.m_alias.m_chunk < c;
+  });
+  return i != all.end() && i->m_alias.m_chunk == chunk;
+}
+
+// Decides which chunks of the previous build can be copied. A chunk is copied
+// if its files are still there, with the same contents and no new files in
+// between. Files with the same size and modification time as in the manifest
+// are assumed to be unchanged, other files of the same size are hashed.
+// Unchanged files that the previous build excluded are moved from files to
+// excluded, the steps refer to the files that are left.
+std::vector<build_step> plan_build(database& db, const manifest& old,
+                                   std::vector<bfs::path>& files,
+                                   std::vector<excluded_file>& excluded,
+                                   std::size_t prefix_size, unsigned threads) {
+  std::vector<build_step> steps;
+  if (db.chunk_count() != old.m_chunks.size()) {
+    add_step(steps, 0, files.size());
+    return steps;
+  }
+
+  std::unordered_map<std::string, const manifest_entry*> known;
+  for (auto i = old.m_chunks.begin(); i != old.m_chunks.end(); ++i)
+    for (auto j = i->begin(); j != i->end(); ++j) known[j->m_name] = &*j;
+
+  std::unordered_map<std::string, const excluded_file*> was_excluded;
+  for (auto i = old.m_excluded.begin(); i != old.m_excluded.end(); ++i) {
+    known[i->m_entry.m_name] = &i->m_entry;
+    was_excluded[i->m_entry.m_name] = &*i;
+  }
+
+  std::vector<manifest_entry> current(files.size());
+  std::vector<char> unchanged(files.size(), 0);
+  std::vector<std::size_t> changed;
+  for (std::size_t i = 0; i != files.size(); ++i) {
+    manifest_entry& entry = current[i];
+    entry.m_name = files[i].generic_string().substr(prefix_size);
+    entry.m_size = bfs::file_size(files[i]);
+    entry.m_mtime = bfs::last_write_time(files[i]);
+
+    auto k = known.find(entry.m_name);
+    if (k == known.end() || k->second->m_size != entry.m_size) continue;
+
+    entry.m_hash = k->second->m_hash;
+    if (entry.m_mtime == k->second->m_mtime && entry.m_mtime < old.m_created)
+      unchanged[i] = 1;
+    else
+      changed.push_back(i);
+  }
+
+  check_hashes(files, changed, current, unchanged, threads);
+
+  std::size_t kept = 0;
+  for (std::size_t i = 0; i != files.size(); ++i) {
+    auto e = was_excluded.find(current[i].m_name);
+    if (unchanged[i] && e != was_excluded.end()) {
+      excluded.push_back(*e->second);
+      excluded.back().m_entry = current[i];
+      continue;
+    }
+
+    files[kept] = files[i];
+    current[kept] = current[i];
+    unchanged[kept] = unchanged[i];
+    ++kept;
+  }
+  files.resize(kept);
+  current.resize(kept);
+  unchanged.resize(kept);
+
+  const alias_map aliases(db);
+
+  std::size_t pos = 0, pending = 0;
+  compressed_chunk compressed;
+  for (std::size_t k = 0; k != old.m_chunks.size(); ++k) {
+    const std::vector<manifest_entry>& chunk = old.m_chunks[k];
+    // The parts of a split file are stored again with the file.
+    if (chunk.empty() || db.get_chunk_info(k).m_file_count != chunk.size() ||
+        has_aliases(aliases, k) || has_parts(db, k))
+      continue;
+
+    // Chunks written before the metadata was compressed separately are
+    // never copied.
+    db.get_chunk(k, compressed);
+    if (!compressed.m_meta_start) continue;
+
+    while (pos != files.size() &&
+           path_less(current[pos].m_name, chunk.front().m_name))
+      ++pos;
+
+    bool same = chunk.size() <= files.size() - pos;
+    for (std::size_t i = 0; same && i != chunk.size(); ++i)
+      same = unchanged[pos + i] && current[pos + i].m_name == chunk[i].m_name;
+
+    if (!same) continue;
+
+    add_step(steps, pending, pos);
+
+    build_step step;
+    step.m_first = step.m_last = pos;
+    step.m_chunk = k;
+    step.m_entries.assign(current.begin() + pos,
+                          current.begin() + pos + chunk.size());
+    steps.push_back(step);
+
+    pos += chunk.size();
+    pending = pos;
+  }
+
+  add_step(steps, pending, files.size());
+  return steps;
+}
+
 struct build_options {
   regex_ptr m_file_inc_re;
   regex_ptr m_dir_excl_re;
   bool m_verbose;
 };
 
-void process_directory(builder& b, build_options& o, const bfs::path& root) {
-  if (!bfs::exists(root))
-    throw std::runtime_error(root.string() + " does not exist");
+// The paths, relative to the root, that an update is limited to. A directory
+// stands for everything under it.
+class path_scope {
+ public:
+  explicit path_scope(const std::vector<std::string>& paths)
+      : m_paths(paths.begin(), paths.end()) {}
+
+  const std::unordered_set<std::string>& paths() const { return m_paths; }
+
+  bool contains(const std::string& name) const {
+    if (m_paths.count(name)) return true;
 
-  std::size_t prefix_size = root.string().size() + 1;
+    for (std::size_t slash = name.find('/'); slash != std::string::npos;
+         slash = name.find('/', slash + 1))
+      if (m_paths.count(name.substr(0, slash))) return true;
+    return false;
+  }
 
-  for (bfs::recursive_directory_iterator i(root), end; i != end; ++i) {
-    const bfs::path& f = *i;
-    const bool is_dir = bfs::is_directory(f);
+ private:
+  std::unordered_set<std::string> m_paths;
+};
 
-    if (is_dir && o.m_dir_excl_re->match(f.filename().string())) {
-      i.no_push();
+// Whether any of the directories on a path relative to the root is excluded.
+bool in_excluded_dir(const build_options& o, const std::string& name) {
+  std::size_t start = 0;
+  for (std::size_t slash;
+       (slash = name.find('/', start)) != std::string::npos; start = slash + 1)
+    if (o.m_dir_excl_re->match(name.substr(start, slash - start)))
+      return true;
+  return false;
+}
+
+// A directory entry, and for directories what the walker found in them.
+struct walk_entry {
+  std::string m_name;
+  bool m_is_dir;
+  std::vector<walk_entry> m_entries;
+};
+
+// Lists the entries of a directory, and whether they are directories that
+// should be walked. Like a recursive_directory_iterator, directory links
+// aren't followed. The file type comes with the entry on most file systems,
+// so only links and entries of unknown type cost a stat.
+void read_dir(const bfs::path& dir, std::vector<walk_entry>& entries) {
+#ifdef _WIN32
+  for (bfs::directory_iterator i(dir), end; i != end; ++i) {
+    walk_entry e;
+    e.m_name = i->path().filename().string();
+    e.m_is_dir = bfs::is_directory(i->symlink_status());
+    entries.push_back(e);
+  }
+#else
+  DIR* d = opendir(dir.string().c_str());
+  if (!d)
+    throw std::runtime_error("Unable to read directory " + dir.string());
+
+  while (dirent* ent = readdir(d)) {
+    if (std::strcmp(ent->d_name, ".") == 0 ||
+        std::strcmp(ent->d_name, "..") == 0)
       continue;
+
+    walk_entry e;
+    e.m_name = ent->d_name;
+    e.m_is_dir = ent->d_type == DT_DIR;
+
+    // Links to directories are neither walked nor indexed.
+    if (ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) {
+      const bfs::path p = dir / e.m_name;
+      boost::system::error_code ec;
+      if (bfs::is_directory(bfs::status(p, ec))) {
+        if (ent->d_type == DT_LNK || bfs::is_symlink(bfs::symlink_status(p)))
+          continue;
+        e.m_is_dir = true;
+      }
+    }
+
+    entries.push_back(e);
+  }
+
+  closedir(d);
+#endif
+}
+
+// Walks the tree with a pool of threads, each taking the next directory that
+// is waiting to be read. The directories are read in any order, but the
+// entries are sorted by name, so that the files can be listed depth first in
+// the same order every time.
+class tree_walker {
+ public:
+  tree_walker(const build_options& o, unsigned threads)
+      : m_options(o), m_threads(threads), m_pending(0) {}
+
+  void walk(const bfs::path& root, std::vector<bfs::path>& files) {
+    walk_entry top;
+    top.m_is_dir = true;
+    m_waiting.push_back(std::make_pair(root, &top));
+    m_pending = 1;
+
+    boost::thread_group workers;
+    for (unsigned i = 0; i != m_threads; ++i)
+      workers.create_thread([this] { work(); });
+    workers.join_all();
+
+    if (m_error) std::rethrow_exception(m_error);
+
+    list_files(root, top, files);
+  }
+
+ private:
+  void work() {
+    std::vector<walk_entry> entries;
+
+    for (;;) {
+      std::pair<bfs::path, walk_entry*> dir;
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        while (m_waiting.empty() && m_pending != 0) m_ready.wait(lock);
+        if (m_waiting.empty()) return;
+
+        dir = m_waiting.back();
+        m_waiting.pop_back();
+      }
+
+      entries.clear();
+      try {
+        stage_scope stage(s_walk_stage);
+        read_dir(dir.first, entries);
+        s_walk_stage.add(0);
+      }
+      catch (...) {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (!m_error) m_error = std::current_exception();
+        entries.clear();
+      }
+
+      // Excluded directories and files that aren't included are left out
+      // before they are sorted.
+      auto last = std::remove_if(entries.begin(), entries.end(),
+                                 [this](const walk_entry& e) {
+        return e.m_is_dir ? m_options.m_dir_excl_re->match(e.m_name)
+                          : !m_options.m_file_inc_re->match(e.m_name);
+      });
+      entries.erase(last, entries.end());
+
+      std::sort(entries.begin(), entries.end(),
+                [](const walk_entry& a, const walk_entry& b) {
+        return a.m_name < b.m_name;
+      });
+
+      dir.second->m_entries.swap(entries);
+
+      boost::mutex::scoped_lock lock(m_mutex);
+      for (auto i = dir.second->m_entries.begin();
+           i != dir.second->m_entries.end(); ++i) {
+        if (!i->m_is_dir) continue;
+
+        m_waiting.push_back(std::make_pair(dir.first / i->m_name, &*i));
+        ++m_pending;
+      }
+
+      if (--m_pending == 0 || !m_waiting.empty()) m_ready.notify_all();
+    }
+  }
+
+  void list_files(const bfs::path& dir, const walk_entry& entry,
+                  std::vector<bfs::path>& files) {
+    for (auto i = entry.m_entries.begin(); i != entry.m_entries.end(); ++i) {
+      const bfs::path path = dir / i->m_name;
+      if (i->m_is_dir) {
+        list_files(path, *i, files);
+      } else {
+        files.push_back(path);
+        if (m_options.m_verbose) std::cout << path << std::endl;
+      }
+    }
+  }
+
+  const build_options& m_options;
+  unsigned m_threads;
+  std::vector<std::pair<bfs::path, walk_entry*>> m_waiting;
+  std::size_t m_pending;
+  std::exception_ptr m_error;
+  boost::mutex m_mutex;
+  boost::condition m_ready;
+};
+
+// Lists the files that git tracks in the checkout at root instead of walking
+// the tree, with the same filters and in the same order as the walker. The
+// files are looked at, as git's index may list files that have since been
+// deleted. With a scope, only the files in it are listed. Returns false if
+// the index can't be used.
+bool list_git_files(const build_options& o, const bfs::path& root,
+                    const path_scope* scope, std::vector<bfs::path>& files) {
+  std::vector<std::string> names;
+  if (!read_git_index(root, names)) return false;
+
+  auto included = [&](const std::string& name) {
+    return (!scope || scope->contains(name)) && !in_excluded_dir(o, name) &&
+           o.m_file_inc_re->match(name.substr(name.rfind('/') + 1));
+  };
+
+  auto last = std::remove_if(names.begin(), names.end(),
+                             [&](const std::string& name) {
+    boost::system::error_code ec;
+    return !included(name) ||
+           !bfs::is_regular_file(bfs::status(root / name, ec));
+  });
+  names.erase(last, names.end());
+  std::sort(names.begin(), names.end(), path_less);
+
+  for (auto i = names.begin(); i != names.end(); ++i) {
+    files.push_back(root / *i);
+    if (o.m_verbose) std::cout << files.back() << std::endl;
+  }
+
+  return true;
+}
+
+// Walks only the files and directories in the scope, and lists what the
+// walker would find of them, in the same order.
+void walk_scope(const build_options& o, unsigned threads,
+                const bfs::path& root, const path_scope& scope,
+                std::vector<bfs::path>& files) {
+  const std::size_t first = files.size();
+
+  for (auto i = scope.paths().begin(); i != scope.paths().end(); ++i) {
+    if (in_excluded_dir(o, *i)) continue;
+
+    const bfs::path path = root / *i;
+    const std::string leaf = path.filename().string();
+    boost::system::error_code ec;
+    if (bfs::is_directory(bfs::symlink_status(path, ec))) {
+      if (!o.m_dir_excl_re->match(leaf))
+        tree_walker(o, threads).walk(path, files);
+    } else if (bfs::is_regular_file(bfs::status(path, ec)) &&
+               o.m_file_inc_re->match(leaf)) {
+      files.push_back(path);
+      if (o.m_verbose) std::cout << path << std::endl;
     }
+  }
+
+  // A file can be in the scope both by itself and with its directory.
+  auto less = [](const bfs::path& a, const bfs::path& b) {
+    return path_less(a.generic_string(), b.generic_string());
+  };
+  std::sort(files.begin() + first, files.end(), less);
+  files.erase(std::unique(files.begin() + first, files.end()), files.end());
+}
+
+// Lists the files to index, from git's index if that is the source, or by
+// walking the tree.
+void list_files(const build_options& o, const config& cfg, unsigned threads,
+                const bfs::path& root, const path_scope* scope,
+                std::vector<bfs::path>& files) {
+  // Git checkouts can be listed from git's index, which leaves out the
+  // files that git doesn't track.
+  if (cfg.get_value("build-source") == "git") {
+    if (list_git_files(o, root, scope, files)) return;
+    if (o.m_verbose)
+      std::cout << "No usable git index, walking the tree" << std::endl;
+  }
+
+  if (scope)
+    walk_scope(o, threads, root, *scope, files);
+  else
+    tree_walker(o, threads).walk(root, files);
+}
+
+unsigned get_thread_count(const std::string& spec) {
+  unsigned threads = 0;
 
-    if (!is_dir && o.m_file_inc_re->match(f.filename().string())) {
-      b.process_file(f, prefix_size);
-      if (o.m_verbose) std::cout << f << std::endl;
+  if (spec == "default")
+    threads = boost::thread::hardware_concurrency();
+  else
+    threads = boost::lexical_cast<unsigned>(spec);
+
+  return std::max(threads, 1u);
+}
+
+// A limit of 0 turns the minified and long line checks off.
+read_options get_read_options(const config& cfg) {
+  read_options ro;
+  ro.m_trim_ws = cfg.get_value("build-trim-ws") == "on";
+  ro.m_max_file_size = std::min(
+      boost::lexical_cast<std::uint64_t>(cfg.get_value("build-max-file-size")),
+      max_file_size);
+  ro.m_skip_binary = cfg.get_value("build-skip-binary") == "on";
+  ro.m_minified_line_length = boost::lexical_cast<std::uint64_t>(
+      cfg.get_value("build-minified-line-length"));
+  ro.m_max_line_length = boost::lexical_cast<std::size_t>(
+      cfg.get_value("build-max-line-length"));
+  ro.m_chunk_size = static_cast<std::size_t>(std::min(
+      boost::lexical_cast<std::uint64_t>(cfg.get_value("build-chunk-size")),
+      max_file_size));
+  return ro;
+}
+
+void remove_blob(const bfs::path& blob) {
+  for (const char* const* i = blob_files; *i; ++i)
+    bfs::remove(blob.string() + *i);
+}
+
+// Flushes the files of a blob to the disk, before anything refers to it.
+void sync_blob(const bfs::path& blob) {
+  for (const char* const* i = blob_files; *i; ++i) {
+    const bfs::path path = blob.string() + *i;
+    if (bfs::exists(path)) sync_file(path);
+  }
+}
+
+// Points at the list of files that a finished blob left out, if there are any.
+void report_excluded(const bfs::path& blob) {
+  const bfs::path report = blob.string() + ".excluded";
+  bfs::ifstream in(report);
+  if (!in.is_open()) return;
+
+  const std::ptrdiff_t count =
+      std::count(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>(), '\n');
+  std::cerr << "Excluded " << count << " files, see " << report.string()
+            << '\n';
+}
+
+// Removes a generation with its shards and segments. Readers that have it
+// open keep their mappings of the files.
+void remove_generation(const bfs::path& generation) {
+  if (bfs::exists(shard_list_path(generation))) {
+    std::vector<bfs::path> shards = read_shard_list(generation);
+    for (auto i = shards.begin(); i != shards.end(); ++i) remove_blob(*i);
+    bfs::remove(shard_list_path(generation));
+  }
+
+  if (bfs::exists(segment_list_path(generation))) {
+    std::vector<bfs::path> segments = read_segment_list(generation);
+    for (auto i = segments.begin(); i != segments.end(); ++i) remove_blob(*i);
+    bfs::remove(segment_list_path(generation));
+  }
+
+  remove_blob(generation);
+}
+
+// Removes the generations that the current one replaced. On Windows, the
+// files of a generation that a search still has mapped can't be removed, so
+// it is left for a later build or compaction to remove.
+void remove_old_generations(const bfs::path& blob) {
+  std::vector<bfs::path> old = old_generations(blob);
+  for (auto i = old.begin(); i != old.end(); ++i) {
+    try {
+      remove_generation(*i);
+    }
+    catch (const bfs::filesystem_error&) {
     }
   }
 }
+
+// The directories to spread shards over, separated by ';'. Defaults to the
+// code db directory.
+std::vector<bfs::path> shard_dirs(const bfs::path& cdb_path,
+                                  const std::string& spec) {
+  std::vector<bfs::path> dirs;
+
+  std::size_t start = 0;
+  while (start <= spec.size()) {
+    std::size_t end = std::min(spec.find(';', start), spec.size());
+    if (end != start) dirs.push_back(spec.substr(start, end - start));
+    start = end + 1;
+  }
+
+  if (dirs.empty()) dirs.push_back(cdb_path);
+
+  return dirs;
 }
 
-void build(const bfs::path& cdb_path, const options& opt) {
+// Builds an unsharded database into next. If the previous build left a
+// manifest and used the same settings, its unchanged chunks are copied.
+void build_blob(const bfs::path& blob, const bfs::path& next,
+                const read_options& ro, bool suffixes, bool tokens,
+                unsigned threads, bool verbose,
+                const std::vector<bfs::path>& all_files,
+                std::size_t prefix_size) {
+  {
+    database_ptr old;
+    std::vector<build_step> steps;
+    std::vector<bfs::path> files(all_files);
+    std::vector<excluded_file> excluded;
+
+    manifest m;
+    if (bfs::exists(blob) && read_manifest(blob, m) &&
+        m.m_trimmed == ro.m_trim_ws && m.m_limits == ro.limits()) {
+      try {
+        old = open_blob(blob);
+        steps = plan_build(*old, m, files, excluded, prefix_size, threads);
+      }
+      catch (const std::runtime_error&) {
+        old.reset();
+        steps.clear();
+        files = all_files;
+        excluded.clear();
+      }
+    }
+
+    if (!old) add_step(steps, 0, files.size());
+
+    // The trigrams of the copied files are looked up in the old index rather
+    // than extracted again. Nothing is copied without an old database.
+    std::vector<std::vector<trigram>> old_trigrams;
+    std::unique_ptr<trigram_index> old_index;
+    const bfs::path trigram_path = blob.string() + ".tri";
+    if (old && steps.size() != 1 && bfs::exists(trigram_path)) {
+      old_index.reset(new trigram_index(trigram_path));
+      if (old_index->chunk_count() == old->chunk_count())
+        old_index->file_trigrams(old_trigrams);
+      else
+        old_index.reset();
+    }
+
+    builder b(next, ro, suffixes, tokens, threads);
+    for (auto i = excluded.begin(); i != excluded.end(); ++i)
+      b.add_excluded(*i);
+
+    std::size_t copied = 0;
+    for (auto i = steps.begin(); i != steps.end(); ++i) {
+      if (i->m_chunk == no_chunk) {
+        add_files(b, files, i->m_first, i->m_last, prefix_size, ro, threads);
+      } else {
+        b.copy_chunk(*old, i->m_chunk, i->m_entries,
+                     old_index ? &old_trigrams[old_index->first_file(
+                                     i->m_chunk)]
+                               : 0);
+        ++copied;
+      }
+    }
+
+    b.finish();
+
+    if (verbose && old)
+      std::cout << "Copied " << copied << " of " << old->chunk_count()
+                << " chunks from the previous build" << std::endl;
+  }
+
+  report_excluded(next);
+}
+
+// A file as the database and its segments have it, and when the layer it is
+// in was built.
+struct indexed_file {
+  manifest_entry m_entry;
+  std::int64_t m_created;
+};
+
+// Excluded files count as indexed, so that they are only read again once they
+// change.
+void add_indexed(std::unordered_map<std::string, indexed_file>& indexed,
+                 const manifest& m) {
+  for (auto i = m.m_chunks.begin(); i != m.m_chunks.end(); ++i) {
+    for (auto j = i->begin(); j != i->end(); ++j) {
+      indexed_file& f = indexed[j->m_name];
+      f.m_entry = *j;
+      f.m_created = m.m_created;
+    }
+  }
+
+  for (auto i = m.m_excluded.begin(); i != m.m_excluded.end(); ++i) {
+    indexed_file& f = indexed[i->m_entry.m_name];
+    f.m_entry = i->m_entry;
+    f.m_created = m.m_created;
+  }
+}
+
+// Adds a segment with the files that changed since the database and its
+// segments were built, and the names of the files that are gone. With a scope,
+// files only count as gone if they are in it. Returns false if there is no
+// unsharded database with a manifest to update.
+bool update_blob(const bfs::path& blob, const read_options& ro, bool suffixes,
+                 bool tokens, unsigned threads, bool verbose,
+                 const std::vector<bfs::path>& files, std::size_t prefix_size,
+                 const path_scope* scope) {
+  const std::string limits = ro.limits();
+
+  manifest m;
+  if (bfs::exists(shard_list_path(blob)) || !bfs::exists(blob) ||
+      !read_manifest(blob, m) || m.m_trimmed != ro.m_trim_ws ||
+      m.m_limits != limits)
+    return false;
+
+  std::unordered_map<std::string, indexed_file> indexed;
+  add_indexed(indexed, m);
+
+  std::vector<bfs::path> segments;
+  if (bfs::exists(segment_list_path(blob))) segments = read_segment_list(blob);
+
+  for (auto i = segments.begin(); i != segments.end(); ++i) {
+    if (!read_manifest(*i, m) || m.m_trimmed != ro.m_trim_ws ||
+        m.m_limits != limits)
+      return false;
+    add_indexed(indexed, m);
+
+    std::vector<std::string> deleted = read_tombstones(*i);
+    for (auto j = deleted.begin(); j != deleted.end(); ++j) indexed.erase(*j);
+  }
+
+  std::vector<manifest_entry> current(files.size());
+  std::vector<char> unchanged(files.size(), 0);
+  std::vector<std::size_t> same_size;
+  for (std::size_t i = 0; i != files.size(); ++i) {
+    manifest_entry& entry = current[i];
+    entry.m_name = files[i].generic_string().substr(prefix_size);
+    entry.m_size = bfs::file_size(files[i]);
+    entry.m_mtime = bfs::last_write_time(files[i]);
+
+    auto k = indexed.find(entry.m_name);
+    if (k == indexed.end()) continue;
+
+    const indexed_file& f = k->second;
+    indexed.erase(k);
+    if (f.m_entry.m_size != entry.m_size) continue;
+
+    entry.m_hash = f.m_entry.m_hash;
+    if (entry.m_mtime == f.m_entry.m_mtime && entry.m_mtime < f.m_created)
+      unchanged[i] = 1;
+    else
+      same_size.push_back(i);
+  }
+
+  check_hashes(files, same_size, current, unchanged, threads);
+
+  // What is left of the indexed files is no longer there.
+  std::vector<std::string> deleted;
+  for (auto i = indexed.begin(); i != indexed.end(); ++i)
+    if (!scope || scope->contains(i->first)) deleted.push_back(i->first);
+  std::sort(deleted.begin(), deleted.end(), path_less);
+
+  std::vector<bfs::path> changed;
+  for (std::size_t i = 0; i != files.size(); ++i)
+    if (!unchanged[i]) changed.push_back(files[i]);
+
+  if (verbose)
+    std::cout << changed.size() << " files changed and " << deleted.size()
+              << " deleted" << std::endl;
+
+  if (changed.empty() && deleted.empty()) return true;
+
+  const bfs::path segment =
+      blob.string() + ".seg." +
+      boost::lexical_cast<std::string>(segments.size() + 1);
+  remove_blob(segment);
+
+  {
+    builder b(segment, ro, suffixes, tokens, threads);
+    add_files(b, changed, 0, changed.size(), prefix_size, ro, threads);
+    b.finish();
+  }
+
+  if (!deleted.empty()) write_tombstones(segment, deleted);
+  sync_blob(segment);
+
+  // The segment is only used once it's in the list.
+  segments.push_back(segment);
+  write_segment_list(blob, segments);
+  report_excluded(segment);
+
+  return true;
+}
+
+// A file that is still visible once the segments are merged, and where it is
+// stored.
+struct layer_file {
+  std::size_t m_layer;
+  std::size_t m_chunk;
+  std::size_t m_file;
+  const manifest_entry* m_entry;
+};
+
+// Merges a database and its segments into next, without reading any files
+// from the disk. Chunks that still hold the same files are copied, the other
+// files are taken out of their chunks and added one by one.
+void compact_blob(const bfs::path& blob,
+                  const std::vector<bfs::path>& segments,
+                  const bfs::path& next, const read_options& ro,
+                  bool suffixes, bool tokens, unsigned threads,
+                  bool verbose) {
+  {
+    std::vector<bfs::path> paths(1, blob);
+    paths.insert(paths.end(), segments.begin(), segments.end());
+
+    std::vector<database_ptr> layers;
+    std::vector<manifest> manifests(paths.size());
+    std::int64_t created = std::numeric_limits<std::int64_t>::max();
+    for (std::size_t i = 0; i != paths.size(); ++i) {
+      layers.push_back(open_blob(paths[i]));
+      if (!read_manifest(paths[i], manifests[i]) ||
+          manifests[i].m_chunks.size() != layers[i]->chunk_count() ||
+          manifests[i].m_trimmed != ro.m_trim_ws ||
+          manifests[i].m_limits != ro.limits())
+        throw std::runtime_error(paths[i].string() +
+                                 " can't be compacted, run build instead");
+
+      created = std::min(created, manifests[i].m_created);
+    }
+
+    // Go from the newest layer down, a file is visible unless a later layer
+    // has, excluded or deleted a file with the same name.
+    std::vector<layer_file> visible;
+    std::vector<excluded_file> excluded;
+    std::unordered_set<std::string> newer;
+    for (std::size_t l = paths.size(); l-- != 0;) {
+      const manifest& m = manifests[l];
+      for (std::size_t c = 0; c != m.m_chunks.size(); ++c) {
+        for (std::size_t f = 0; f != m.m_chunks[c].size(); ++f) {
+          const manifest_entry& entry = m.m_chunks[c][f];
+          if (newer.count(entry.m_name)) continue;
+
+          // The later parts of a split file are read with the first one.
+          if (c != 0 && f == 0 && !m.m_chunks[c - 1].empty() &&
+              m.m_chunks[c - 1].back().m_name == entry.m_name)
+            continue;
+
+          layer_file lf = {l, c, f, &entry};
+          visible.push_back(lf);
+        }
+      }
+
+      for (auto i = m.m_excluded.begin(); i != m.m_excluded.end(); ++i)
+        if (!newer.count(i->m_entry.m_name)) excluded.push_back(*i);
+
+      for (auto c = m.m_chunks.begin(); c != m.m_chunks.end(); ++c)
+        for (auto f = c->begin(); f != c->end(); ++f) newer.insert(f->m_name);
+      for (auto i = m.m_excluded.begin(); i != m.m_excluded.end(); ++i)
+        newer.insert(i->m_entry.m_name);
+
+      if (l != 0) {
+        std::vector<std::string> deleted = read_tombstones(paths[l]);
+        newer.insert(deleted.begin(), deleted.end());
+      }
+    }
+
+    std::sort(visible.begin(), visible.end(),
+              [](const layer_file& a, const layer_file& b) {
+      return path_less(a.m_entry->m_name, b.m_entry->m_name);
+    });
+
+    // The trigrams of copied chunks are looked up in the old indexes.
+    std::vector<std::unique_ptr<trigram_index>> indexes(paths.size());
+    std::vector<std::vector<std::vector<trigram>>> trigrams(paths.size());
+    for (std::size_t i = 0; i != paths.size(); ++i) {
+      const bfs::path path = paths[i].string() + ".tri";
+      if (!bfs::exists(path)) continue;
+
+      indexes[i].reset(new trigram_index(path));
+      if (indexes[i]->chunk_count() == layers[i]->chunk_count())
+        indexes[i]->file_trigrams(trigrams[i]);
+      else
+        indexes[i].reset();
+    }
+
+    std::vector<alias_map> aliases;
+    for (auto l = layers.begin(); l != layers.end(); ++l)
+      aliases.push_back(alias_map(**l));
+
+    builder b(next, ro, suffixes, tokens, threads);
+    b.set_created(created);
+    for (auto i = excluded.begin(); i != excluded.end(); ++i)
+      b.add_excluded(*i);
+
+    chunk_storage storage, target_storage;
+    compressed_chunk compressed;
+    std::unique_ptr<db_chunk> chunk;
+    std::size_t chunk_layer = no_chunk, chunk_index = no_chunk, position = 0;
+    std::size_t copied = 0, total = 0;
+    db_file file, target;
+    loaded_file loaded;
+
+    for (auto l = layers.begin(); l != layers.end(); ++l)
+      total += (*l)->chunk_count();
+
+    for (std::size_t i = 0; i != visible.size();) {
+      const layer_file& f = visible[i];
+      database& layer = *layers[f.m_layer];
+      const std::vector<manifest_entry>& entries =
+          manifests[f.m_layer].m_chunks[f.m_chunk];
+
+      // Files of a chunk are in order, so a chunk is whole if its first file
+      // is followed by all of the others.
+      bool whole = f.m_file == 0 && entries.size() <= visible.size() - i;
+      for (std::size_t j = 1; whole && j != entries.size(); ++j)
+        whole = visible[i + j].m_layer == f.m_layer &&
+                visible[i + j].m_chunk == f.m_chunk;
+
+      // Chunks written before the metadata was compressed separately are
+      // never copied.
+      if (whole) {
+        compressed_chunk stored;
+        layer.get_chunk(f.m_chunk, stored);
+        whole = stored.m_meta_start != 0 &&
+                !has_aliases(aliases[f.m_layer], f.m_chunk) &&
+                !has_parts(layer, f.m_chunk);
+      }
+
+      if (whole) {
+        std::vector<manifest_entry> copy(entries);
+        const trigram_index* index = indexes[f.m_layer].get();
+        b.copy_chunk(
+            layer, f.m_chunk, copy,
+            index ? &trigrams[f.m_layer][index->first_file(f.m_chunk)] : 0);
+
+        i += entries.size();
+        ++copied;
+        continue;
+      }
+
+      if (f.m_layer != chunk_layer || f.m_chunk != chunk_index ||
+          f.m_file < position) {
+        chunk.reset();
+        layer.get_chunk(f.m_chunk, compressed);
+        chunk.reset(new db_chunk(compressed, storage));
+        chunk->load_contents();
+
+        chunk_layer = f.m_layer;
+        chunk_index = f.m_chunk;
+        position = 0;
+      }
+
+      while (position <= f.m_file) {
+        if (!chunk->next_file(file))
+          throw std::runtime_error(paths[f.m_layer].string() +
+                                   " doesn't match its manifest");
+        ++position;
+      }
+
+      // The contents of an alias are in the same layer, even if its target is
+      // hidden by a later one.
+      if (const file_alias* alias =
+              aliases[f.m_layer].find(f.m_chunk, f.m_file)) {
+        if (!read_file(layer, alias->m_target, target_storage, target))
+          throw std::runtime_error(paths[f.m_layer].string() +
+                                   " has an alias of a missing file");
+        load_stored(target, *f.m_entry, loaded);
+      } else if (f.m_file + 1 == entries.size() &&
+                 continues(layer, f.m_chunk)) {
+        path_location location;
+        location.m_chunk = static_cast<db_uint>(f.m_chunk);
+        location.m_file = static_cast<db_uint>(f.m_file);
+        read_file(layer, location, target_storage, target);
+        load_stored(target, *f.m_entry, loaded);
+      } else {
+        load_stored(file, *f.m_entry, loaded);
+      }
+
+      b.add_file(loaded);
+      ++i;
+    }
+
+    chunk.reset();
+    b.finish();
+
+    if (verbose)
+      std::cout << "Merged " << segments.size() << " segments, copied "
+                << copied << " of " << total << " chunks" << std::endl;
+  }
+
+  report_excluded(next);
+}
+
+// Splits the files into contiguous ranges of roughly the same size and builds
+// one shard from each range, in parallel.
+void build_shards(const std::vector<bfs::path>& shards, const read_options& ro,
+                  bool suffixes, bool tokens, unsigned threads,
+                  const std::vector<bfs::path>& files,
+                  std::size_t prefix_size) {
+  std::vector<std::uint64_t> sizes;
+  std::uint64_t total = 0;
+  for (auto i = files.begin(); i != files.end(); ++i) {
+    sizes.push_back(bfs::file_size(*i));
+    total += sizes.back();
+  }
+
+  std::vector<std::size_t> bounds(1, 0);
+  std::uint64_t bytes = 0;
+  for (std::size_t i = 0; i != files.size(); ++i) {
+    if (bounds.size() < shards.size() &&
+        bytes >= total / shards.size() * bounds.size())
+      bounds.push_back(i);
+    bytes += sizes[i];
+  }
+  while (bounds.size() <= shards.size()) bounds.push_back(files.size());
+
+  // The threads are shared between the shards. The builders are created up
+  // front so that any errors opening the shard files are reported before the
+  // threads start.
+  const unsigned shard_threads =
+      std::max(threads / static_cast<unsigned>(shards.size()), 1u);
+
+  std::vector<std::unique_ptr<builder>> builders;
+  for (auto i = shards.begin(); i != shards.end(); ++i) {
+    bfs::create_directories(i->parent_path());
+    builders.push_back(std::unique_ptr<builder>(
+        new builder(*i, ro, suffixes, tokens, shard_threads)));
+  }
+
+  std::vector<std::exception_ptr> errors(shards.size());
+
+  boost::thread_group workers;
+  for (std::size_t s = 0; s != shards.size(); ++s) {
+    workers.create_thread([&, s] {
+      try {
+        add_files(*builders[s], files, bounds[s], bounds[s + 1], prefix_size,
+                  ro, shard_threads);
+        builders[s]->finish();
+      }
+      catch (...) {
+        errors[s] = std::current_exception();
+      }
+    });
+  }
+
+  workers.join_all();
+
+  for (auto i = errors.begin(); i != errors.end(); ++i)
+    if (*i) std::rethrow_exception(*i);
+}
+
+// Builds a new database, or with -u or a scope adds a segment to the current
+// one.
+void build_db(const bfs::path& cdb_path, const options& opt,
+              const path_scope* scope) {
   config cfg = load_config(cdb_path / "config");
+  s_throttle.configure(cfg, cdb_path);
+  reset_stages();
 
   build_options bo;
 
@@ -170,10 +2050,131 @@ void build(const bfs::path& cdb_path, const options& opt) {
 
   bo.m_verbose = opt.m_options.count("-v") == 1;
 
+  const read_options ro = get_read_options(cfg);
+  const bool suffixes = cfg.get_value("build-suffix-array") == "on";
+  const bool tokens = cfg.get_value("build-token-index") == "on";
+  const unsigned shard_count =
+      boost::lexical_cast<unsigned>(cfg.get_value("build-shards"));
+  const unsigned threads = get_thread_count(cfg.get_value("build-threads"));
+
+  // Readers don't lock, the lock only keeps builds from running at once.
   file_lock lock(cdb_path / "lock");
   lock.lock_exclusive();
 
-  builder b(cdb_path / "db", cfg.get_value("build-trim-ws") == "on");
+  const bfs::path root = cdb_path.parent_path();
+  const std::size_t prefix_size = root.string().size() + 1;
+
+  // Only the files in the scope are listed, unless the whole tree has to be
+  // built anyway.
+  if (shard_count != 1) scope = 0;
+
+  std::vector<bfs::path> files;
+  list_files(bo, cfg, threads, root, scope, files);
+
+  const bfs::path blob = cdb_path / "db";
+  const bfs::path current = current_generation(blob);
+
+  // Updates are added as a segment of the current generation, unless there is
+  // nothing to update. Sharded databases have no segments and are rebuilt.
+  if (scope || opt.m_options.count("-u")) {
+    if (shard_count != 1) {
+      std::cerr << "Sharded databases can't be updated, building a new one"
+                << std::endl;
+    } else if (update_blob(current, ro, suffixes, tokens, threads,
+                           bo.m_verbose, files, prefix_size, scope)) {
+      if (bo.m_verbose) report_stages();
+      return;
+    } else {
+      std::cerr << "No database to update, building a new one" << std::endl;
+      if (scope) {
+        files.clear();
+        list_files(bo, cfg, threads, root, 0, files);
+      }
+    }
+  }
+
+  // A full build writes a new generation, without segments, which replaces
+  // the current one once it's on the disk. A failed build may have left parts
+  // of it behind.
+  const bfs::path next = next_generation(blob);
+  remove_generation(next);
+
+  if (shard_count == 1) {
+    build_blob(current, next, ro, suffixes, tokens, threads, bo.m_verbose,
+               files, prefix_size);
+    sync_blob(next);
+  } else {
+    std::vector<bfs::path> dirs =
+        shard_dirs(cdb_path, cfg.get_value("shard-dirs"));
+
+    std::vector<bfs::path> shards;
+    for (unsigned i = 0; i != shard_count; ++i)
+      shards.push_back(bfs::absolute(dirs[i % dirs.size()], cdb_path) /
+                       (next.filename().string() + "." +
+                        boost::lexical_cast<std::string>(i)));
+
+    build_shards(shards, ro, suffixes, tokens, threads, files,
+                 prefix_size);
+    for (auto i = shards.begin(); i != shards.end(); ++i) sync_blob(*i);
+    write_shard_list(next, shards);
+    for (auto i = shards.begin(); i != shards.end(); ++i) report_excluded(*i);
+  }
+
+  publish_generation(blob, next);
+  remove_old_generations(blob);
+
+  if (bo.m_verbose) {
+    report_stages();
+    print_chunk_sizes(*open_database(blob));
+  }
+}
+}
+
+void build(const bfs::path& cdb_path, const options& opt) {
+  build_db(cdb_path, opt, 0);
+}
+
+void update_paths(const bfs::path& cdb_path, const options& opt,
+                  const std::vector<std::string>& paths) {
+  const path_scope scope(paths);
+  build_db(cdb_path, opt, &scope);
+}
+
+void compact(const bfs::path& cdb_path, const options& opt) {
+  config cfg = load_config(cdb_path / "config");
+  s_throttle.configure(cfg, cdb_path);
+  reset_stages();
+
+  const bool verbose = opt.m_options.count("-v") == 1;
+  const read_options ro = get_read_options(cfg);
+  const bool suffixes = cfg.get_value("build-suffix-array") == "on";
+  const bool tokens = cfg.get_value("build-token-index") == "on";
+  const unsigned threads = get_thread_count(cfg.get_value("build-threads"));
+
+  file_lock lock(cdb_path / "lock");
+  lock.lock_exclusive();
+
+  const bfs::path blob = cdb_path / "db";
+  const bfs::path current = current_generation(blob);
+  if (!bfs::exists(segment_list_path(current))) {
+    if (verbose) std::cout << "There are no segments to compact" << std::endl;
+    return;
+  }
+
+  if (bfs::exists(shard_list_path(current)))
+    throw std::runtime_error("Sharded databases can't be compacted");
+
+  // The merged database is the next generation, which leaves the segments
+  // behind.
+  const bfs::path next = next_generation(blob);
+  remove_generation(next);
+
+  compact_blob(current, read_segment_list(current), next, ro, suffixes,
+               tokens, threads, verbose);
+  sync_blob(next);
+
+  publish_generation(blob, next);
+  remove_old_generations(blob);
 
-  process_directory(b, bo, cdb_path.parent_path());
+  if (verbose) report_stages();
 }
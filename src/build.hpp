@@ -7,8 +7,20 @@
 
 #include <boost/filesystem.hpp>
 
+#include <string>
+#include <vector>
+
 struct options;
 
 void build(const bfs::path& cdb_path, const options& opt);
 
+// Like 'build -u', but only looks at the given paths, relative to the root of
+// the tree. A directory stands for everything under it, and indexed files in
+// it that are gone are removed.
+void update_paths(const bfs::path& cdb_path, const options& opt,
+                  const std::vector<std::string>& paths);
+
+// Merges the segments added by updates into the database.
+void compact(const bfs::path& cdb_path, const options& opt);
+
 #endif
@@ -9,6 +9,9 @@
 #include "serve.hpp"
 #include "init.hpp"
 #include "find.hpp"
+#include "show.hpp"
+#include "stats.hpp"
+#include "watch.hpp"
 #include "help.hpp"
 
 #include <boost/filesystem.hpp>
@@ -55,12 +58,24 @@ int main(int argc, char** argv) {
       case options::build:
         build(require_codedb_path(opt), opt);
         break;
+      case options::compact:
+        compact(require_codedb_path(opt), opt);
+        break;
       case options::find:
         find(require_codedb_path(opt), opt);
         break;
+      case options::show:
+        show(require_codedb_path(opt), opt);
+        break;
+      case options::stats:
+        stats(require_codedb_path(opt), opt);
+        break;
       case options::serve:
         serve(require_codedb_path(opt), opt);
         break;
+      case options::watch:
+        watch(require_codedb_path(opt), opt);
+        break;
       case options::undefined:
         std::cout << "cdb: '" << opt.m_args[0]
                   << "' is not a cdb-command. See 'cdb --help'.\n";
@@ -40,6 +40,57 @@ void validate_threads(const std::string& value) {
         "'" + value + "' is not valid, expected 'default' or an integer");
 }
 
+void validate_shards(const std::string& value) {
+  auto re = compile_regex("\\d{1,4}");
+
+  if (!re->match(value) || boost::lexical_cast<int>(value) == 0)
+    throw std::runtime_error("'" + value +
+                             "' is not valid, expected a positive integer");
+}
+
+void validate_count(const std::string& value) {
+  auto re = compile_regex("\\d{1,6}");
+
+  if (!re->match(value))
+    throw std::runtime_error("'" + value +
+                             "' is not valid, expected a number");
+}
+
+void validate_size(const std::string& value) {
+  auto re = compile_regex("\\d{1,12}");
+
+  if (!re->match(value))
+    throw std::runtime_error("'" + value +
+                             "' is not valid, expected a number of bytes");
+}
+
+// Smaller chunks would make the per chunk overhead dominate.
+void validate_chunk_size(const std::string& value) {
+  auto re = compile_regex("\\d{1,12}");
+
+  if (!re->match(value) || boost::lexical_cast<std::uint64_t>(value) < 4096)
+    throw std::runtime_error("'" + value +
+                             "' is not valid, expected at least 4096 bytes");
+}
+
+void validate_source(const std::string& value) {
+  if (value != "walk" && value != "git")
+    throw std::runtime_error("'" + value +
+                             "' is not valid, expected 'walk' or 'git'");
+}
+
+void validate_percent(const std::string& value) {
+  auto re = compile_regex("\\d{1,3}");
+
+  if (!re->match(value) || boost::lexical_cast<int>(value) == 0 ||
+      boost::lexical_cast<int>(value) > 100)
+    throw std::runtime_error("'" + value +
+                             "' is not valid, expected a percentage");
+}
+
+// Any list of directories is accepted, they are created by the build.
+void validate_dirs(const std::string&) {}
+
 struct cfg_key {
   typedef void (*validator)(const std::string&);
 
@@ -63,10 +114,41 @@ const config_keys& get_config_map() {
     keys.insert(
         std::make_pair("nocase-file-match", cfg_key("off", &validate_bool)));
     keys.insert(std::make_pair("build-trim-ws", cfg_key("on", &validate_bool)));
+    keys.insert(
+        std::make_pair("build-shards", cfg_key("1", &validate_shards)));
+    keys.insert(std::make_pair("shard-dirs", cfg_key("", &validate_dirs)));
+    keys.insert(
+        std::make_pair("build-suffix-array", cfg_key("off", &validate_bool)));
+    keys.insert(
+        std::make_pair("build-token-index", cfg_key("off", &validate_bool)));
     keys.insert(std::make_pair("find-trim-ws", cfg_key("off", &validate_bool)));
     keys.insert(std::make_pair("serve-port", cfg_key("8080", &validate_port)));
     keys.insert(
         std::make_pair("find-threads", cfg_key("default", &validate_threads)));
+    keys.insert(std::make_pair("build-threads",
+                               cfg_key("default", &validate_threads)));
+    keys.insert(std::make_pair("build-max-file-size",
+                               cfg_key("16777216", &validate_size)));
+    keys.insert(
+        std::make_pair("build-skip-binary", cfg_key("on", &validate_bool)));
+    keys.insert(std::make_pair("build-minified-line-length",
+                               cfg_key("1000", &validate_count)));
+    keys.insert(std::make_pair("build-max-line-length",
+                               cfg_key("0", &validate_count)));
+    keys.insert(std::make_pair("build-read-rate",
+                               cfg_key("0", &validate_size)));
+    keys.insert(std::make_pair("build-cpu-share",
+                               cfg_key("100", &validate_percent)));
+    keys.insert(std::make_pair("build-yield-to-serve",
+                               cfg_key("off", &validate_bool)));
+    keys.insert(
+        std::make_pair("build-source", cfg_key("walk", &validate_source)));
+    keys.insert(std::make_pair("build-chunk-size",
+                               cfg_key("524288", &validate_chunk_size)));
+    keys.insert(
+        std::make_pair("watch-delay", cfg_key("500", &validate_count)));
+    keys.insert(
+        std::make_pair("watch-compact", cfg_key("8", &validate_count)));
   }
 
   return keys;
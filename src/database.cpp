@@ -4,48 +4,269 @@
 #include "serialization.hpp"
 #include "profiler.hpp"
 #include "config.hpp"
+#include "trigram.hpp"
+#include "compress.hpp"
+#include "manifest.hpp"
+#include "search.hpp"
+#include "regex.hpp"
 
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <unordered_set>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
 
 database::~database() {}
 
-db_chunk::db_chunk(const std::string& data) : m_data(data) {
-  // A chunk starts with an offset to the file data and the file count.
-  m_data_offset = read_binary(m_data, 0);
-  m_count = read_binary(m_data, sizeof(db_uint));
+namespace {
+// Size of a file entry in chunks that use fixed size fields.
+const std::size_t fixed_entry_size = sizeof(db_uint) * 2;
+}
+
+db_chunk::db_chunk(const compressed_chunk& compressed, chunk_storage& storage)
+    : m_compressed(compressed), m_storage(storage), m_contents(0) {
+  if (compressed.m_meta_start) {
+    snappy_uncompress(compressed.m_meta_start, compressed.m_meta_end,
+                      storage.m_meta);
+    parse_meta(storage.m_meta);
+  } else {
+    snappy_uncompress(compressed.m_start, compressed.m_end, storage.m_contents);
+    parse_single(storage.m_contents);
+  }
+
+  rewind();
+}
+
+void db_chunk::parse_meta(const std::string& meta) {
+  // [count][{file-size}][{filename, 0}][line tables]
+  const char* p = meta.c_str();
+  const char* end = p + meta.size();
+
+  m_varint_sizes = true;
+  m_count = static_cast<std::size_t>(read_varint(p));
+  m_sizes_start = p;
+
+  for (std::size_t i = 0; i != m_count; ++i) read_varint(p);
+
+  m_names_start = p;
+  for (std::size_t i = 0; i != m_count; ++i) p += std::strlen(p) + 1;
+
+  m_first_lines_start = 0;
+  if (p + sizeof(db_uint) <= end) {
+    m_line_interval = read_binary(p);
+    m_lines_start = p + sizeof(db_uint);
+
+    // [{first-line}] follows the line tables in chunks with a part of a split
+    // file.
+    p = m_lines_start;
+    for (std::size_t i = 0; i != m_count && p < end; ++i)
+      p += (read_binary(p + sizeof(db_uint)) + 2) * sizeof(db_uint);
+    if (p < end) m_first_lines_start = p;
+  } else {
+    m_line_interval = 0;
+    m_lines_start = 0;
+  }
+}
+
+void db_chunk::parse_single(const std::string& data) {
+  const char* p = data.c_str();
+  std::uint64_t total_size = 0;
+  m_first_lines_start = 0;
+
+  // Chunks used to start with the offset of the file data, which is never
+  // zero. Zero marks chunks where the file count and sizes are varints.
+  m_varint_sizes = read_binary(p) == 0;
+
+  if (m_varint_sizes) {
+    // [0][count][{file-size}][{filename, 0}][file data]
+    p += sizeof(db_uint);
+    m_count = static_cast<std::size_t>(read_varint(p));
+    m_sizes_start = p;
+
+    for (std::size_t i = 0; i != m_count; ++i) total_size += read_varint(p);
+
+    m_names_start = p;
+    for (std::size_t i = 0; i != m_count; ++i) p += std::strlen(p) + 1;
+
+    m_contents = p;
+  } else {
+    // [data-offset][count][{file-size, name-offset}][{filename, 0}][file data]
+    m_count = read_binary(p + sizeof(db_uint));
+    m_sizes_start = p + sizeof(db_uint) * 2;
+    m_names_start = m_sizes_start + m_count * fixed_entry_size;
+    m_contents = p + read_binary(p);
+
+    for (std::size_t i = 0; i != m_count; ++i)
+      total_size += read_binary(m_sizes_start + i * fixed_entry_size);
+  }
+
+  // Line tables may follow the file data, starting with the line sample
+  // interval.
+  const char* data_end = m_contents + total_size;
+  if (data_end + sizeof(db_uint) <= data.c_str() + data.size()) {
+    m_line_interval = read_binary(data_end);
+    m_lines_start = data_end + sizeof(db_uint);
+  } else {
+    m_line_interval = 0;
+    m_lines_start = 0;
+  }
+}
+
+void db_chunk::load_contents() {
+  if (m_contents) return;
+
+  snappy_uncompress(m_compressed.m_start, m_compressed.m_end,
+                    m_storage.m_contents);
+  m_contents = m_storage.m_contents.c_str();
+}
+
+void db_chunk::rewind() {
   m_current = 0;
+  m_sizes = m_sizes_start;
+  m_names = m_names_start;
+  m_lines = m_lines_start;
+  m_first_lines = m_first_lines_start;
+  m_offset = 0;
 }
 
 bool db_chunk::next_file(db_file& file) {
-  static const auto header_size = sizeof(db_uint) * 2;
-  static const auto entry_size = sizeof(db_uint) * 2;
-
   if (m_current == m_count) return false;
 
-  // Each file entry is represented by two db_uints that tell us the size of
-  // the file and an offset where the null terminated filename is stored.
-  auto entry_offset = header_size + m_current * entry_size;
+  std::uint64_t file_size;
+  if (m_varint_sizes) {
+    file_size = read_varint(m_sizes);
+  } else {
+    file_size = read_binary(m_sizes);
+    m_sizes += fixed_entry_size;
+  }
+
+  // The filenames are stored in the same order as the files.
+  file.m_name_start = m_names;
+  file.m_name_end = m_names + std::strlen(m_names);
+  m_names = file.m_name_end + 1;
+
+  if (m_contents) {
+    file.m_start = m_contents + m_offset;
+    file.m_end = file.m_start + file_size;
+  } else {
+    file.m_start = file.m_end = 0;
+  }
 
-  db_uint file_size = read_binary(m_data, entry_offset);
-  db_uint name_offset = read_binary(m_data, entry_offset + sizeof(db_uint));
+  m_offset += file_size;
 
-  // Filenames come after all the file variables.
-  auto names_base = header_size + m_count * entry_size;
+  // [line-count, sample-count, {sample}]
+  if (m_lines) {
+    db_uint line_count = read_binary(m_lines);
+    db_uint sample_count = read_binary(m_lines + sizeof(db_uint));
+    m_lines += sizeof(db_uint) * 2;
+    file.m_lines =
+        line_index(m_line_interval, line_count, sample_count, m_lines);
+    m_lines += sample_count * sizeof(db_uint);
+  } else {
+    file.m_lines = line_index();
+  }
 
-  file.m_name_start = m_data.c_str() + names_base + name_offset;
-  file.m_name_end = file.m_name_start + std::strlen(file.m_name_start);
-  file.m_start = m_data.c_str() + m_data_offset;
-  file.m_end = file.m_start + file_size;
+  file.m_first_line =
+      m_first_lines ? static_cast<std::size_t>(read_varint(m_first_lines)) : 1;
 
-  // Advance the data offset so that it points to the next file.
-  m_data_offset += file_size;
   m_current++;
 
   return true;
 }
 
 namespace {
+// Reads a length prefixed string from the table of contents.
+bool read_string(const char*& p, const char* end, std::string& result) {
+  if (end - p < std::ptrdiff_t(sizeof(db_uint))) return false;
+
+  db_uint size = read_binary(p);
+  p += sizeof(db_uint);
+  if (std::size_t(end - p) < size) return false;
+
+  result.assign(p, size);
+  p += size;
+  return true;
+}
+
+// Reports the matches of a file for the file and for each of its aliases,
+// once the matches of the file are complete. Only the names that match
+// file_re are reported.
+class alias_receiver : public match_receiver {
+ public:
+  alias_receiver(const alias_map& aliases, const path_table& paths,
+                 regex& file_re, std::size_t prefix_size,
+                 match_receiver& receiver)
+      : m_aliases(aliases), m_paths(paths), m_file_re(file_re),
+        m_prefix_size(prefix_size), m_receiver(receiver) {}
+
+  void flush() {
+    if (m_matches.empty()) return;
+
+    const char* name = m_matches.front().m_full_file;
+    report(name);
+
+    path_location location;
+    if (m_paths.find(name, location)) {
+      auto range = m_aliases.aliases_of(location.m_chunk, location.m_file);
+      for (const file_alias* i = range.first; i != range.second; ++i)
+        report(i->m_name);
+    }
+
+    m_matches.clear();
+  }
+
+ private:
+  const char* on_match(const match_info& match) {
+    if (!m_matches.empty() &&
+        m_matches.front().m_full_file != match.m_full_file)
+      flush();
+
+    m_matches.push_back(match);
+    return match.m_line_end;
+  }
+
+  void report(const char* name) {
+    if (!m_file_re.search(name, name + std::strlen(name))) return;
+
+    for (auto i = m_matches.begin(); i != m_matches.end(); ++i) {
+      match_info match = *i;
+      match.m_full_file = name;
+      match.m_file = name + m_prefix_size;
+      m_receiver.on_match(match);
+    }
+  }
+
+  const alias_map& m_aliases;
+  const path_table& m_paths;
+  regex& m_file_re;
+  std::size_t m_prefix_size;
+  match_receiver& m_receiver;
+  std::vector<match_info> m_matches;
+};
+
+// Moves the chunks of the aliases from first on up by offset.
+void move_aliases(std::vector<file_alias>& aliases, std::size_t first,
+                  std::size_t offset) {
+  for (auto i = aliases.begin() + first; i != aliases.end(); ++i) {
+    i->m_alias.m_chunk += static_cast<db_uint>(offset);
+    i->m_target.m_chunk += static_cast<db_uint>(offset);
+  }
+}
+
 class compressed_database : public database {
  public:
   compressed_database(const bfs::path& packed)
@@ -53,47 +274,976 @@ class compressed_database : public database {
         m_region(m_mapping, bip::read_only),
         m_data(static_cast<const char*>(m_region.get_address())),
         m_data_end(m_data + m_region.get_size()),
-        m_load_profiler(make_profiler("load")) {
+        m_next(0),
+        m_load_profiler(make_profiler("load")),
+        m_select_profiler(make_profiler("select")) {
+    // CDB1 chunks are only snappy data, later versions start each chunk with
+    // a filter. CDB3 ends with a table of contents, CDB4 stores chunk offsets
+    // and sizes with 64 bits and CDB5 compresses the chunk metadata and file
+    // contents separately.
     if (m_data + 4 > m_data_end || m_data[0] != 'C' || m_data[1] != 'D' ||
-        m_data[2] != 'B' || m_data[3] != '1')
+        m_data[2] != 'B' || m_data[3] < '1' || m_data[3] > '5')
       throw std::runtime_error("Blob " + packed.string() + " is not valid");
 
-    m_data += 4;
+    m_filtered = m_data[3] != '1';
+    m_size_bytes = m_data[3] >= '4' ? 8 : 4;
+    m_split = m_data[3] >= '5';
+
+    if (m_data[3] >= '3') {
+      if (!read_toc())
+        throw std::runtime_error("Blob " + packed.string() + " is not valid");
+    } else {
+      walk_chunks();
+    }
+
+    // The trigram index is optional, and only used if it was built together
+    // with this database.
+    bfs::path trigrams = packed.string() + ".tri";
+    if (bfs::exists(trigrams)) {
+      m_trigrams.reset(new trigram_index(trigrams));
+      if (m_trigrams->chunk_count() != m_chunks.size()) m_trigrams.reset();
+    }
+
+    bfs::path paths = packed.string() + ".paths";
+    if (bfs::exists(paths)) {
+      m_paths.reset(new path_table(paths));
+      if (m_paths->chunk_count() != m_chunks.size()) m_paths.reset();
+    }
+
+    bfs::path tokens = packed.string() + ".tok";
+    if (bfs::exists(tokens)) {
+      m_tokens.reset(new token_index(tokens));
+      if (m_tokens->chunk_count() != m_chunks.size()) m_tokens.reset();
+    }
+
+    bfs::path suffixes = packed.string() + ".sa";
+    if (bfs::exists(suffixes)) {
+      m_suffixes.reset(new suffix_array(suffixes));
+      if (m_suffixes->chunk_count() != m_chunks.size()) m_suffixes.reset();
+    }
+
+    bfs::path aliases = packed.string() + ".alias";
+    if (bfs::exists(aliases)) {
+      m_alias_table.reset(new alias_table(aliases));
+      if (m_alias_table->chunk_count() == m_chunks.size())
+        m_aliases = alias_map(m_alias_table->aliases());
+      else
+        m_alias_table.reset();
+    }
   }
 
  private:
-  void rewind() {
-    m_data = static_cast<const char*>(m_region.get_address()) + 4;
+  void rewind() { m_next = 0; }
+
+  bool next_chunk(compressed_chunk& chunk) {
+    if (m_next == m_chunks.size()) return false;
+
+    get_chunk(m_next++, chunk);
+    return true;
+  }
+
+  std::size_t chunk_count() { return m_chunks.size(); }
+
+  const chunk_info& get_chunk_info(std::size_t index) {
+    return m_chunks.at(index);
   }
 
-  bool next_chunk(std::pair<const char*, const char*>& data) {
+  void get_chunk(std::size_t index, compressed_chunk& chunk) {
     profile_scope prof(m_load_profiler);
 
-    if (m_data + sizeof(db_uint) > m_data_end) return false;
+    const chunk_info& info = m_chunks.at(index);
+
+    const char* chunk_start = m_data + info.m_offset + m_size_bytes;
+    const char* chunk_end = chunk_start + info.m_size;
+
+    if (m_filtered) {
+      db_uint filter_size = read_binary(chunk_start);
+      chunk_start += sizeof(db_uint);
+      chunk.m_filter = chunk_filter(chunk_start, filter_size);
+      chunk_start += filter_size;
+    } else {
+      chunk.m_filter = chunk_filter();
+    }
+
+    if (m_split) {
+      std::uint64_t meta_size = read_binary64(chunk_start);
+      chunk.m_meta_start = chunk_start + sizeof(std::uint64_t);
+      chunk.m_meta_end = chunk.m_meta_start + meta_size;
+      chunk_start = chunk.m_meta_end;
+    } else {
+      chunk.m_meta_start = chunk.m_meta_end = 0;
+    }
+
+    chunk.m_start = chunk_start;
+    chunk.m_end = chunk_end;
+  }
+
+  file_set select_files(const trigram_query& query) {
+    if (!m_trigrams) return file_set();
+
+    profile_scope prof(m_select_profiler);
+    return m_trigrams->select_files(query);
+  }
+
+  bool locate_file(const std::string& name, path_location& result) {
+    if (m_paths)
+      return m_paths->find(name, result) && result.m_chunk < m_chunks.size();
 
-    db_uint chunk_size;
-    std::memcpy(&chunk_size, m_data, sizeof(db_uint));
+    // Without a path table the names of every chunk have to be searched.
+    compressed_chunk compressed;
+    chunk_storage storage;
+    db_file file;
+    for (std::size_t i = 0; i != m_chunks.size(); ++i) {
+      get_chunk(i, compressed);
+      db_chunk chunk(compressed, storage);
 
-    const char* chunk_end = m_data + sizeof(db_uint) + chunk_size;
+      for (std::size_t index = 0; chunk.next_file(file); ++index) {
+        if (name == file.m_name_start) {
+          result.m_chunk = static_cast<db_uint>(i);
+          result.m_file = static_cast<db_uint>(index);
+          return true;
+        }
+      }
+    }
 
-    if (chunk_end > m_data_end) return false;
+    return false;
+  }
+
+  bool find_file(const std::string& name, chunk_storage& storage,
+                 db_file& result) {
+    path_location location;
+    if (!locate_file(name, location)) return false;
+
+    // An alias is read from the file that has its contents.
+    if (const file_alias* alias =
+            m_aliases.find(location.m_chunk, location.m_file))
+      location = alias->m_target;
+
+    return read_file(*this, location, storage, result);
+  }
+
+  // The matches of aliases are found through their targets, which takes the
+  // path table.
+  bool has_suffix_array() {
+    return m_suffixes && (m_aliases.empty() || m_paths);
+  }
+
+  void search_literal(const std::string& literal, regex& file_re,
+                      std::size_t prefix_size, match_receiver& receiver) {
+    if (!has_suffix_array()) throw std::logic_error("No suffix array");
+
+    if (m_aliases.empty()) {
+      m_suffixes->search(literal, file_re, prefix_size, receiver);
+      return;
+    }
+
+    // Aliases have no text of their own, so the names are matched after the
+    // matches of each file are found.
+    regex_ptr any = compile_regex("");
+    alias_receiver aliases(m_aliases, *m_paths, file_re, prefix_size,
+                           receiver);
+    m_suffixes->search(literal, *any, prefix_size, aliases);
+    aliases.flush();
+  }
+
+  bool has_token_index() { return bool(m_tokens); }
+
+  void find_token(const std::string& token, bool whole_word,
+                  std::vector<token_hit>& hits) {
+    if (!m_tokens) throw std::logic_error("No token index");
+    m_tokens->find(token, whole_word, hits);
+  }
+
+  void get_aliases(std::vector<file_alias>& aliases) {
+    aliases.insert(aliases.end(), m_aliases.aliases().begin(),
+                   m_aliases.aliases().end());
+  }
+
+  // Reads an offset or size, which is 64 bits wide from CDB4 on.
+  std::uint64_t read_size(const char*& p) const {
+    std::uint64_t result =
+        m_size_bytes == 8 ? read_binary64(p) : std::uint64_t(read_binary(p));
+    p += m_size_bytes;
+    return result;
+  }
+
+  // Loads the table of contents that a CDB3 file ends with:
+  // [{offset, size, uncompressed-size, file-count, first-path, last-path}]
+  // followed by the chunk count and the offset of the table.
+  bool read_toc() {
+    const std::size_t size = m_data_end - m_data;
+    const std::size_t trailer_size = sizeof(db_uint) + m_size_bytes;
+    const std::size_t entry_size = m_size_bytes * 3 + sizeof(db_uint) * 3;
+    if (size < 4 + trailer_size) return false;
+
+    const char* end = m_data_end - trailer_size;
+    const char* p = end;
+    db_uint count = read_binary(p);
+    p += sizeof(db_uint);
+    std::uint64_t toc_offset = read_size(p);
+
+    if (toc_offset < 4 || toc_offset > size - trailer_size) return false;
 
-    data.first = m_data + sizeof(db_uint);
-    data.second = chunk_end;
+    p = m_data + toc_offset;
+    if (count > std::size_t(end - p) / entry_size) return false;
 
-    m_data = chunk_end;
+    m_chunks.resize(count);
+    for (auto i = m_chunks.begin(); i != m_chunks.end(); ++i) {
+      if (std::size_t(end - p) < entry_size) return false;
+
+      i->m_offset = read_size(p);
+      i->m_size = read_size(p);
+      i->m_uncompressed_size = read_size(p);
+      i->m_file_count = read_binary(p);
+      p += sizeof(db_uint);
+      if (!read_string(p, end, i->m_first_path) ||
+          !read_string(p, end, i->m_last_path))
+        return false;
+
+      if (i->m_offset + m_size_bytes > toc_offset ||
+          i->m_size > toc_offset - i->m_offset - m_size_bytes)
+        return false;
+    }
 
     return true;
   }
 
+  // Older databases have no table of contents. The chunks are found by
+  // following their size prefixes, but what they contain is unknown.
+  void walk_chunks() {
+    const char* p = m_data + 4;
+    while (p + sizeof(db_uint) <= m_data_end) {
+      chunk_info info;
+      info.m_offset = p - m_data;
+      info.m_size = read_binary(p);
+      info.m_uncompressed_size = 0;
+      info.m_file_count = 0;
+
+      p += sizeof(db_uint) + info.m_size;
+      if (p > m_data_end) break;
+
+      m_chunks.push_back(info);
+    }
+  }
+
   bip::file_mapping m_mapping;
   bip::mapped_region m_region;
   const char* m_data;
   const char* m_data_end;
+  bool m_filtered;
+  bool m_split;
+  std::size_t m_size_bytes;
+  std::vector<chunk_info> m_chunks;
+  std::size_t m_next;
   profiler& m_load_profiler;
+  profiler& m_select_profiler;
+  std::unique_ptr<trigram_index> m_trigrams;
+  std::unique_ptr<path_table> m_paths;
+  std::unique_ptr<token_index> m_tokens;
+  std::unique_ptr<suffix_array> m_suffixes;
+  std::unique_ptr<alias_table> m_alias_table;
+  alias_map m_aliases;
 };
+
+// Presents several databases as one. The chunks of each shard are numbered
+// after the chunks of the shards before it.
+class sharded_database : public database {
+ public:
+  sharded_database(const std::vector<bfs::path>& shards) : m_next(0) {
+    m_first_chunk.push_back(0);
+    for (auto i = shards.begin(); i != shards.end(); ++i) {
+      m_shards.push_back(database_ptr(new compressed_database(*i)));
+      m_first_chunk.push_back(m_first_chunk.back() +
+                              m_shards.back()->chunk_count());
+    }
+  }
+
+ private:
+  void rewind() { m_next = 0; }
+
+  bool next_chunk(compressed_chunk& chunk) {
+    if (m_next == chunk_count()) return false;
+
+    get_chunk(m_next++, chunk);
+    return true;
+  }
+
+  std::size_t chunk_count() { return m_first_chunk.back(); }
+
+  const chunk_info& get_chunk_info(std::size_t index) {
+    std::size_t shard = find_shard(index);
+    return m_shards[shard]->get_chunk_info(index - m_first_chunk[shard]);
+  }
+
+  void get_chunk(std::size_t index, compressed_chunk& chunk) {
+    std::size_t shard = find_shard(index);
+    m_shards[shard]->get_chunk(index - m_first_chunk[shard], chunk);
+  }
+
+  file_set select_files(const trigram_query& query) {
+    file_set result = file_set::none();
+    for (std::size_t i = 0; i != m_shards.size(); ++i) {
+      file_set files = m_shards[i]->select_files(query);
+      if (files.everything()) return files;
+
+      result.append(files, m_first_chunk[i]);
+    }
+
+    return result;
+  }
+
+  bool locate_file(const std::string& name, path_location& result) {
+    for (std::size_t i = 0; i != m_shards.size(); ++i) {
+      if (m_shards[i]->locate_file(name, result)) {
+        result.m_chunk += static_cast<db_uint>(m_first_chunk[i]);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool find_file(const std::string& name, chunk_storage& storage,
+                 db_file& result) {
+    for (auto i = m_shards.begin(); i != m_shards.end(); ++i)
+      if ((*i)->find_file(name, storage, result)) return true;
+
+    return false;
+  }
+
+  bool has_suffix_array() {
+    for (auto i = m_shards.begin(); i != m_shards.end(); ++i)
+      if (!(*i)->has_suffix_array()) return false;
+
+    return true;
+  }
+
+  void search_literal(const std::string& literal, regex& file_re,
+                      std::size_t prefix_size, match_receiver& receiver) {
+    for (auto i = m_shards.begin(); i != m_shards.end(); ++i)
+      (*i)->search_literal(literal, file_re, prefix_size, receiver);
+  }
+
+  bool has_token_index() {
+    for (auto i = m_shards.begin(); i != m_shards.end(); ++i)
+      if (!(*i)->has_token_index()) return false;
+
+    return true;
+  }
+
+  void find_token(const std::string& token, bool whole_word,
+                  std::vector<token_hit>& hits) {
+    for (std::size_t i = 0; i != m_shards.size(); ++i) {
+      std::size_t first = hits.size();
+      m_shards[i]->find_token(token, whole_word, hits);
+      for (std::size_t j = first; j != hits.size(); ++j)
+        hits[j].m_chunk += static_cast<db_uint>(m_first_chunk[i]);
+    }
+  }
+
+  void get_aliases(std::vector<file_alias>& aliases) {
+    for (std::size_t i = 0; i != m_shards.size(); ++i) {
+      std::size_t first = aliases.size();
+      m_shards[i]->get_aliases(aliases);
+      move_aliases(aliases, first, m_first_chunk[i]);
+    }
+  }
+
+  std::size_t find_shard(std::size_t index) const {
+    if (index >= m_first_chunk.back())
+      throw std::out_of_range("Chunk index out of range");
+
+    return std::upper_bound(m_first_chunk.begin(), m_first_chunk.end(),
+                            index) -
+           m_first_chunk.begin() - 1;
+  }
+
+  std::vector<database_ptr> m_shards;
+  std::vector<std::size_t> m_first_chunk;
+  std::size_t m_next;
+};
+
+// Only passes on the matches in files that aren't hidden.
+class visible_receiver : public match_receiver {
+ public:
+  visible_receiver(const std::unordered_set<std::string>& hidden,
+                   match_receiver& receiver)
+      : m_hidden(hidden), m_receiver(receiver) {}
+
+ private:
+  const char* on_match(const match_info& match) {
+    if (m_hidden.count(match.m_full_file)) return match.m_file_end;
+    return m_receiver.on_match(match);
+  }
+
+  const std::unordered_set<std::string>& m_hidden;
+  match_receiver& m_receiver;
+};
+
+// A database with segments of updates on top of it. Each segment holds the
+// files that changed after the layers below it were built, and a list of the
+// files that were deleted. A file is hidden if a later segment has a file
+// with the same name or deleted it. The chunks of each layer are numbered
+// after the chunks of the layers below it.
+class segmented_database : public database {
+ public:
+  segmented_database(database_ptr base, const std::vector<bfs::path>& segments)
+      : m_next(0) {
+    m_layers.push_back(std::move(base));
+    for (auto i = segments.begin(); i != segments.end(); ++i)
+      m_layers.push_back(database_ptr(new compressed_database(*i)));
+
+    m_first_chunk.push_back(0);
+    for (auto i = m_layers.begin(); i != m_layers.end(); ++i) {
+      // Without a table of contents the files of a chunk can't be counted,
+      // which select_files needs to leave out the hidden ones.
+      for (std::size_t j = 0; j != (*i)->chunk_count(); ++j)
+        if ((*i)->get_chunk_info(j).m_file_count == 0)
+          throw std::runtime_error("The database is too old for segments");
+
+      m_first_chunk.push_back(m_first_chunk.back() + (*i)->chunk_count());
+    }
+
+    // Go from the newest layer down, collecting the names that hide files in
+    // the layers below.
+    m_hidden_names.resize(m_layers.size());
+    std::unordered_set<std::string> newer;
+    for (std::size_t i = m_layers.size() - 1;; --i) {
+      path_location location;
+      for (auto name = newer.begin(); name != newer.end(); ++name) {
+        if (!m_layers[i]->locate_file(*name, location)) continue;
+
+        m_hidden.push_back(
+            key(m_first_chunk[i] + location.m_chunk, location.m_file));
+        m_hidden_names[i].insert(*name);
+
+        // The later parts of a split file are hidden with it.
+        database& layer = *m_layers[i];
+        for (std::size_t c = location.m_chunk; continues(layer, c); ++c) {
+          if (layer.get_chunk_info(c).m_last_path != *name) break;
+          m_hidden.push_back(key(m_first_chunk[i] + c + 1, 0));
+        }
+      }
+
+      if (i == 0) break;
+
+      const bfs::path& segment = segments[i - 1];
+      manifest m;
+      if (!read_manifest(segment, m))
+        throw std::runtime_error("Segment " + segment.string() +
+                                 " has no manifest");
+
+      for (auto c = m.m_chunks.begin(); c != m.m_chunks.end(); ++c)
+        for (auto f = c->begin(); f != c->end(); ++f) newer.insert(f->m_name);
+      for (auto e = m.m_excluded.begin(); e != m.m_excluded.end(); ++e)
+        newer.insert(e->m_entry.m_name);
+
+      std::vector<std::string> deleted = read_tombstones(segment);
+      newer.insert(deleted.begin(), deleted.end());
+    }
+
+    std::sort(m_hidden.begin(), m_hidden.end());
+  }
+
+ private:
+  void rewind() { m_next = 0; }
+
+  bool next_chunk(compressed_chunk& chunk) {
+    if (m_next == chunk_count()) return false;
+
+    get_chunk(m_next++, chunk);
+    return true;
+  }
+
+  std::size_t chunk_count() { return m_first_chunk.back(); }
+
+  const chunk_info& get_chunk_info(std::size_t index) {
+    std::size_t layer = find_layer(index);
+    return m_layers[layer]->get_chunk_info(index - m_first_chunk[layer]);
+  }
+
+  void get_chunk(std::size_t index, compressed_chunk& chunk) {
+    std::size_t layer = find_layer(index);
+    m_layers[layer]->get_chunk(index - m_first_chunk[layer], chunk);
+  }
+
+  // The selected files of every layer, except the hidden ones. The result
+  // always lists the files, so that searches skip the hidden files.
+  file_set select_files(const trigram_query& query) {
+    file_set result = file_set::none();
+    for (std::size_t i = 0; i != m_layers.size(); ++i) {
+      database& layer = *m_layers[i];
+      file_set files = layer.select_files(query);
+
+      for (std::size_t c = 0; c != layer.chunk_count(); ++c) {
+        if (!files.has_chunk(c)) continue;
+
+        const std::size_t chunk = m_first_chunk[i] + c;
+        const std::size_t count = layer.get_chunk_info(c).m_file_count;
+        for (std::size_t f = 0; f != count; ++f)
+          if (files.has_file(c, f) && !hidden(chunk, f)) result.add(chunk, f);
+      }
+    }
+
+    return result;
+  }
+
+  bool locate_file(const std::string& name, path_location& result) {
+    for (std::size_t i = m_layers.size(); i-- != 0;) {
+      if (m_hidden_names[i].count(name)) return false;
+
+      if (m_layers[i]->locate_file(name, result)) {
+        result.m_chunk += static_cast<db_uint>(m_first_chunk[i]);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool find_file(const std::string& name, chunk_storage& storage,
+                 db_file& result) {
+    for (std::size_t i = m_layers.size(); i-- != 0;) {
+      if (m_hidden_names[i].count(name)) return false;
+      if (m_layers[i]->find_file(name, storage, result)) return true;
+    }
+
+    return false;
+  }
+
+  bool has_suffix_array() {
+    for (auto i = m_layers.begin(); i != m_layers.end(); ++i)
+      if (!(*i)->has_suffix_array()) return false;
+
+    return true;
+  }
+
+  void search_literal(const std::string& literal, regex& file_re,
+                      std::size_t prefix_size, match_receiver& receiver) {
+    for (std::size_t i = 0; i != m_layers.size(); ++i) {
+      visible_receiver visible(m_hidden_names[i], receiver);
+      m_layers[i]->search_literal(literal, file_re, prefix_size, visible);
+    }
+  }
+
+  bool has_token_index() {
+    for (auto i = m_layers.begin(); i != m_layers.end(); ++i)
+      if (!(*i)->has_token_index()) return false;
+
+    return true;
+  }
+
+  void find_token(const std::string& token, bool whole_word,
+                  std::vector<token_hit>& hits) {
+    std::vector<token_hit> layer_hits;
+    for (std::size_t i = 0; i != m_layers.size(); ++i) {
+      layer_hits.clear();
+      m_layers[i]->find_token(token, whole_word, layer_hits);
+
+      for (auto j = layer_hits.begin(); j != layer_hits.end(); ++j) {
+        j->m_chunk += static_cast<db_uint>(m_first_chunk[i]);
+        if (!hidden(j->m_chunk, j->m_file)) hits.push_back(*j);
+      }
+    }
+  }
+
+  void get_aliases(std::vector<file_alias>& aliases) {
+    for (std::size_t i = 0; i != m_layers.size(); ++i) {
+      std::size_t first = aliases.size();
+      m_layers[i]->get_aliases(aliases);
+      move_aliases(aliases, first, m_first_chunk[i]);
+    }
+  }
+
+  static std::uint64_t key(std::size_t chunk, std::size_t file) {
+    return static_cast<std::uint64_t>(chunk) << 32 | file;
+  }
+
+  bool hidden(std::size_t chunk, std::size_t file) const {
+    return std::binary_search(m_hidden.begin(), m_hidden.end(),
+                              key(chunk, file));
+  }
+
+  std::size_t find_layer(std::size_t index) const {
+    if (index >= m_first_chunk.back())
+      throw std::out_of_range("Chunk index out of range");
+
+    return std::upper_bound(m_first_chunk.begin(), m_first_chunk.end(),
+                            index) -
+           m_first_chunk.begin() - 1;
+  }
+
+  std::vector<database_ptr> m_layers;
+  std::vector<std::size_t> m_first_chunk;
+  std::vector<std::uint64_t> m_hidden;
+  std::vector<std::unordered_set<std::string>> m_hidden_names;
+  std::size_t m_next;
+};
+
+// Reads a text file with one entry per line.
+std::vector<std::string> read_lines(const bfs::path& path) {
+  bfs::ifstream in(path);
+  if (!in.is_open())
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for reading");
+
+  std::vector<std::string> lines;
+  std::string line;
+  while (getline(in, line))
+    if (!line.empty()) lines.push_back(line);
+
+  return lines;
 }
 
-database_ptr open_database(const bfs::path& blob) {
+// The lines are written to a new file which then replaces the old one, so
+// readers see either the old or the new list.
+template <class T>
+void write_lines(const bfs::path& path, const std::vector<T>& lines) {
+  const bfs::path next = path.string() + ".new";
+
+  {
+    bfs::ofstream out(next);
+    if (!out.is_open())
+      throw std::runtime_error("Unable to open " + next.string() +
+                               " for writing");
+
+    for (auto i = lines.begin(); i != lines.end(); ++i) out << *i << '\n';
+
+    out.close();
+    if (!out) throw std::runtime_error("Unable to write " + next.string());
+  }
+
+  sync_file(next);
+  bfs::rename(next, path);
+}
+
+const char generation_tag[] = ".g";
+}
+
+namespace {
+bool location_less(const path_location& a, const path_location& b) {
+  return a.m_chunk != b.m_chunk ? a.m_chunk < b.m_chunk : a.m_file < b.m_file;
+}
+}
+
+alias_map::alias_map(database& db) {
+  db.get_aliases(m_by_alias);
+  sort_targets();
+}
+
+alias_map::alias_map(const std::vector<file_alias>& aliases)
+    : m_by_alias(aliases) {
+  sort_targets();
+}
+
+void alias_map::sort_targets() {
+  m_by_target = m_by_alias;
+  std::stable_sort(m_by_target.begin(), m_by_target.end(),
+                   [](const file_alias& a, const file_alias& b) {
+    return location_less(a.m_target, b.m_target);
+  });
+}
+
+const file_alias* alias_map::find(std::size_t chunk, std::size_t file) const {
+  const path_location location = {static_cast<db_uint>(chunk),
+                                   static_cast<db_uint>(file)};
+  auto i = std::lower_bound(m_by_alias.begin(), m_by_alias.end(), location,
+                            [](const file_alias& a, const path_location& l) {
+    return location_less(a.m_alias, l);
+  });
+
+  if (i == m_by_alias.end() || location_less(location, i->m_alias))
+    return 0;
+  return &*i;
+}
+
+std::pair<const file_alias*, const file_alias*> alias_map::aliases_of(
+    std::size_t chunk, std::size_t file) const {
+  const path_location location = {static_cast<db_uint>(chunk),
+                                  static_cast<db_uint>(file)};
+  auto first =
+      std::lower_bound(m_by_target.begin(), m_by_target.end(), location,
+                       [](const file_alias& a, const path_location& l) {
+        return location_less(a.m_target, l);
+      });
+  auto last = first;
+  while (last != m_by_target.end() && !location_less(location, last->m_target))
+    ++last;
+
+  const file_alias* base = m_by_target.data();
+  return std::make_pair(base + (first - m_by_target.begin()),
+                        base + (last - m_by_target.begin()));
+}
+
+bool read_file(database& db, const path_location& location,
+               chunk_storage& storage, db_file& result) {
+  if (location.m_chunk >= db.chunk_count()) return false;
+
+  compressed_chunk compressed;
+  db.get_chunk(location.m_chunk, compressed);
+  db_chunk chunk(compressed, storage);
+  chunk.load_contents();
+
+  for (std::size_t i = 0; i <= location.m_file; ++i)
+    if (!chunk.next_file(result)) return false;
+
+  // The parts are read with storage of their own, which keeps the name of
+  // the first part.
+  const std::string name(result.m_name_start, result.m_name_end);
+  chunk_storage part_storage;
+  db_file part;
+  for (std::size_t c = location.m_chunk;
+       continues(db, c) && db.get_chunk_info(c).m_last_path == name; ++c) {
+    db.get_chunk(c + 1, compressed);
+    db_chunk next(compressed, part_storage);
+    next.load_contents();
+    if (!next.next_file(part) || part.m_first_line == 1) break;
+
+    if (c == location.m_chunk)
+      storage.m_joined.assign(result.m_start, result.m_end);
+    storage.m_joined.append(part.m_start, part.m_end);
+
+    result.m_start = storage.m_joined.c_str();
+    result.m_end = result.m_start + storage.m_joined.size();
+    result.m_lines = line_index();
+  }
+
+  return true;
+}
+
+bool continues(database& db, std::size_t chunk) {
+  if (chunk + 1 >= db.chunk_count()) return false;
+
+  const std::string& last = db.get_chunk_info(chunk).m_last_path;
+  return !last.empty() && last == db.get_chunk_info(chunk + 1).m_first_path;
+}
+
+bool has_parts(database& db, std::size_t chunk) {
+  return continues(db, chunk) || (chunk != 0 && continues(db, chunk - 1));
+}
+
+database_ptr open_blob(const bfs::path& blob) {
+  if (bfs::exists(shard_list_path(blob)))
+    return database_ptr(new sharded_database(read_shard_list(blob)));
+
   return database_ptr(new compressed_database(blob));
 }
+
+database_ptr open_database(const bfs::path& blob) {
+  // A build removes the previous generation once it has switched to the next
+  // one, which may be while it's opened here.
+  for (;;) {
+    const bfs::path generation = current_generation(blob);
+    try {
+      database_ptr base = open_blob(generation);
+      if (!bfs::exists(segment_list_path(generation))) return base;
+
+      return database_ptr(new segmented_database(
+          std::move(base), read_segment_list(generation)));
+    }
+    catch (const std::exception&) {
+      if (current_generation(blob) == generation) throw;
+    }
+  }
+}
+
+// [{offset, size, uncompressed-size, file-count, first-path, last-path}]
+// [chunk-count][toc-offset]
+void write_toc(std::ostream& out, const std::vector<chunk_info>& chunks,
+               std::uint64_t offset) {
+  for (auto i = chunks.begin(); i != chunks.end(); ++i) {
+    write_binary64(out, i->m_offset);
+    write_binary64(out, i->m_size);
+    write_binary64(out, i->m_uncompressed_size);
+    write_binary(out, i->m_file_count);
+    write_binary(out, static_cast<db_uint>(i->m_first_path.size()));
+    out.write(i->m_first_path.c_str(), i->m_first_path.size());
+    write_binary(out, static_cast<db_uint>(i->m_last_path.size()));
+    out.write(i->m_last_path.c_str(), i->m_last_path.size());
+  }
+
+  write_binary(out, static_cast<db_uint>(chunks.size()));
+  write_binary64(out, offset);
+}
+
+bfs::path generation_path(const bfs::path& blob) {
+  return blob.string() + ".current";
+}
+
+bfs::path current_generation(const bfs::path& blob) {
+  if (!bfs::exists(generation_path(blob))) return blob;
+
+  std::vector<std::string> lines = read_lines(generation_path(blob));
+  if (lines.size() != 1)
+    throw std::runtime_error(generation_path(blob).string() +
+                             " is not valid");
+
+  return blob.parent_path() / lines[0];
+}
+
+bfs::path next_generation(const bfs::path& blob) {
+  const std::string current = current_generation(blob).string();
+  const std::string prefix = blob.string() + generation_tag;
+
+  unsigned number = 0;
+  if (current.compare(0, prefix.size(), prefix) == 0)
+    number = boost::lexical_cast<unsigned>(current.substr(prefix.size()));
+
+  return prefix + boost::lexical_cast<std::string>(number + 1);
+}
+
+std::vector<bfs::path> old_generations(const bfs::path& blob) {
+  const bfs::path current = current_generation(blob);
+  if (current == blob) return std::vector<bfs::path>();
+
+  const std::string prefix = blob.filename().string() + generation_tag;
+  const unsigned number = boost::lexical_cast<unsigned>(
+      current.filename().string().substr(prefix.size()));
+
+  // A generation is found by its blob, or by its shard list if it's sharded.
+  // The blob itself is the generation before the first one.
+  std::vector<unsigned> numbers;
+  for (bfs::directory_iterator i(blob.parent_path()), end; i != end; ++i) {
+    const std::string name = i->path().filename().string();
+    if (name.compare(0, prefix.size(), prefix) != 0) continue;
+
+    const std::size_t digits =
+        name.find_first_not_of("0123456789", prefix.size());
+    if (digits == prefix.size() ||
+        (digits != std::string::npos &&
+         name.compare(digits, std::string::npos, ".shards") != 0))
+      continue;
+
+    const unsigned n = boost::lexical_cast<unsigned>(
+        name.substr(prefix.size(), digits - prefix.size()));
+    if (n < number) numbers.push_back(n);
+  }
+
+  std::sort(numbers.begin(), numbers.end());
+  numbers.erase(std::unique(numbers.begin(), numbers.end()), numbers.end());
+
+  std::vector<bfs::path> result;
+  if (bfs::exists(blob) || bfs::exists(shard_list_path(blob)))
+    result.push_back(blob);
+  for (auto i = numbers.begin(); i != numbers.end(); ++i)
+    result.push_back(blob.string() + generation_tag +
+                     boost::lexical_cast<std::string>(*i));
+  return result;
+}
+
+void publish_generation(const bfs::path& blob, const bfs::path& generation) {
+  write_lines(generation_path(blob),
+              std::vector<std::string>(1, generation.filename().string()));
+
+#ifndef _WIN32
+  // The rename is only durable once the directory is.
+  sync_file(blob.parent_path());
+#endif
+}
+
+void sync_file(const bfs::path& path) {
+#ifdef _WIN32
+  int fd = _open(path.string().c_str(), _O_RDWR | _O_BINARY);
+  if (fd == -1)
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for syncing");
+
+  int result = _commit(fd);
+  _close(fd);
+#else
+  int fd = open(path.string().c_str(), O_RDONLY);
+  if (fd == -1)
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for syncing");
+
+  int result = fsync(fd);
+  close(fd);
+#endif
+
+  if (result != 0)
+    throw std::runtime_error("Unable to sync " + path.string());
+}
+
+bfs::path shard_list_path(const bfs::path& blob) {
+  return blob.string() + ".shards";
+}
+
+std::vector<bfs::path> read_shard_list(const bfs::path& blob) {
+  std::vector<std::string> lines = read_lines(shard_list_path(blob));
+  return std::vector<bfs::path>(lines.begin(), lines.end());
+}
+
+void write_shard_list(const bfs::path& blob,
+                      const std::vector<bfs::path>& shards) {
+  std::vector<std::string> lines;
+  for (auto i = shards.begin(); i != shards.end(); ++i)
+    lines.push_back(i->string());
+
+  write_lines(shard_list_path(blob), lines);
+}
+
+bfs::path segment_list_path(const bfs::path& blob) {
+  return blob.string() + ".segments";
+}
+
+std::vector<bfs::path> read_segment_list(const bfs::path& blob) {
+  std::vector<std::string> lines = read_lines(segment_list_path(blob));
+  return std::vector<bfs::path>(lines.begin(), lines.end());
+}
+
+void write_segment_list(const bfs::path& blob,
+                        const std::vector<bfs::path>& segments) {
+  std::vector<std::string> lines;
+  for (auto i = segments.begin(); i != segments.end(); ++i)
+    lines.push_back(i->string());
+
+  write_lines(segment_list_path(blob), lines);
+}
+
+bfs::path tombstone_path(const bfs::path& segment) {
+  return segment.string() + ".del";
+}
+
+std::vector<std::string> read_tombstones(const bfs::path& segment) {
+  if (!bfs::exists(tombstone_path(segment))) return std::vector<std::string>();
+  return read_lines(tombstone_path(segment));
+}
+
+void write_tombstones(const bfs::path& segment,
+                      const std::vector<std::string>& names) {
+  write_lines(tombstone_path(segment), names);
+}
+
+bool path_less(const std::string& a, const std::string& b) {
+  // Sorting '/' before every other character compares the paths component
+  // by component.
+  auto rank = [](char c) { return c == '/' ? 0 : unsigned(c) % 256 + 1; };
+
+  std::size_t size = std::min(a.size(), b.size());
+  for (std::size_t i = 0; i != size; ++i)
+    if (a[i] != b[i]) return rank(a[i]) < rank(b[i]);
+
+  return a.size() < b.size();
+}
+
+std::pair<std::size_t, std::size_t> chunk_range(database& db,
+                                                const std::string& prefix) {
+  const std::size_t count = db.chunk_count();
+
+  // Chunks without paths come from databases that predate the table of
+  // contents, they are never skipped.
+  std::size_t first = count, last = count;
+  for (std::size_t i = 0; i != count; ++i) {
+    const chunk_info& info = db.get_chunk_info(i);
+    if (!info.m_last_path.empty() && path_less(info.m_last_path, prefix))
+      continue;
+    if (!info.m_first_path.empty() && !path_less(info.m_first_path, prefix) &&
+        info.m_first_path.compare(0, prefix.size(), prefix) != 0)
+      continue;
+
+    if (first == count) first = i;
+    last = i + 1;
+  }
+
+  return std::make_pair(first, last);
+}
@@ -5,45 +5,255 @@
 
 #include "nsalias.hpp"
 #include "serialization.hpp"
+#include "file_set.hpp"
+#include "trigram.hpp"
+#include "path_table.hpp"
+#include "alias_table.hpp"
+#include "line_index.hpp"
+#include "suffix_array.hpp"
+#include "token_index.hpp"
 
 #include <boost/filesystem/path.hpp>
 
 #include <cstdint>
+#include <iosfwd>
 #include <string>
 #include <memory>
+#include <utility>
+#include <vector>
 
 class config;
+class regex;
+class match_receiver;
 
+// A file of a chunk. Files larger than a chunk are split at line boundaries,
+// the later parts have the same name and start at a later line.
 struct db_file {
   const char* m_name_start;
   const char* m_name_end;
   const char* m_start;
   const char* m_end;
+  line_index m_lines;
+  std::size_t m_first_line;
 };
 
+// A chunk as stored in the database: the snappy compressed data and a filter
+// of the trigrams it contains. Newer chunks compress the file names and other
+// metadata separately from the file contents, older chunks have no metadata
+// stream and everything is in [m_start, m_end).
+struct compressed_chunk {
+  const char* m_meta_start;
+  const char* m_meta_end;
+  const char* m_start;
+  const char* m_end;
+  chunk_filter m_filter;
+};
+
+// Buffers for decompressed chunks, which can be reused between chunks. The
+// parts of a split file are joined in m_joined.
+struct chunk_storage {
+  std::string m_meta;
+  std::string m_contents;
+  std::string m_joined;
+};
+
+// A decompressed chunk. Only the metadata is decompressed up front, so that
+// the file names can be looked at before paying for the file contents.
 class db_chunk {
  public:
-  db_chunk(const std::string& data);
+  db_chunk(const compressed_chunk& compressed, chunk_storage& storage);
+
+  // Decompresses the file contents, which next_file returns null pointers for
+  // until this is called.
+  void load_contents();
+
+  // Starts over from the first file.
+  void rewind();
 
   bool next_file(db_file&);
 
  private:
-  const std::string& m_data;
-  db_uint m_data_offset;
-  db_uint m_count;
-  db_uint m_current;
+  void parse_meta(const std::string& meta);
+  void parse_single(const std::string& data);
+
+  const compressed_chunk& m_compressed;
+  chunk_storage& m_storage;
+  bool m_varint_sizes;
+  std::size_t m_count;
+  const char* m_sizes_start;
+  const char* m_names_start;
+  const char* m_lines_start;
+  const char* m_first_lines_start;
+  const char* m_contents;
+  db_uint m_line_interval;
+
+  // The position of the next file
+  std::size_t m_current;
+  const char* m_sizes;
+  const char* m_names;
+  const char* m_lines;
+  const char* m_first_lines;
+  std::uint64_t m_offset;
+};
+
+// Where a chunk is stored and what it contains. Databases written before the
+// table of contents was added only know where their chunks are, the other
+// fields are zero or empty.
+struct chunk_info {
+  std::uint64_t m_offset;
+  std::uint64_t m_size;
+  std::uint64_t m_uncompressed_size;
+  db_uint m_file_count;
+  std::string m_first_path;
+  std::string m_last_path;
 };
 
+// Writes the table of contents that a database ends with, after the chunks.
+// The table starts at offset.
+void write_toc(std::ostream& out, const std::vector<chunk_info>& chunks,
+               std::uint64_t offset);
+
 class database {
  public:
   virtual ~database();
 
   virtual void rewind() = 0;
-  virtual bool next_chunk(std::pair<const char*, const char*>&) = 0;
+  virtual bool next_chunk(compressed_chunk&) = 0;
+
+  // Random access to the chunks.
+  virtual std::size_t chunk_count() = 0;
+  virtual const chunk_info& get_chunk_info(std::size_t index) = 0;
+  virtual void get_chunk(std::size_t index, compressed_chunk&) = 0;
+
+  // Narrows down the files that may contain a match for the query. Chunks are
+  // numbered in the order next_chunk returns them.
+  virtual file_set select_files(const trigram_query& query) = 0;
+
+  // Finds the chunk and index of a file without decompressing anything but
+  // file names.
+  virtual bool locate_file(const std::string& name,
+                           path_location& result) = 0;
+
+  // Looks up a file by its name in the database. The file contents are
+  // decompressed into storage, which must outlive the result.
+  virtual bool find_file(const std::string& name, chunk_storage& storage,
+                         db_file& result) = 0;
+
+  // Whether the database has a suffix array that search_literal can use.
+  virtual bool has_suffix_array() = 0;
+
+  // Reports every line that contains the literal, in database order, for the
+  // files whose names match file_re. Requires a suffix array.
+  virtual void search_literal(const std::string& literal, regex& file_re,
+                              std::size_t prefix_size,
+                              match_receiver& receiver) = 0;
+
+  // Whether the database has a token index that find_token can use.
+  virtual bool has_token_index() = 0;
+
+  // Finds the lines that contain the token, or with whole_word false, any
+  // token that contains it. Requires a token index.
+  virtual void find_token(const std::string& token, bool whole_word,
+                          std::vector<token_hit>& hits) = 0;
+
+  // Appends the files that are stored as aliases of other files, in database
+  // order. An alias and its target are always in the same blob.
+  virtual void get_aliases(std::vector<file_alias>& aliases) = 0;
 };
 
 typedef std::unique_ptr<database> database_ptr;
 
+// The aliases of a database, looked up by where they are or by where their
+// contents are.
+class alias_map {
+ public:
+  alias_map() {}
+  explicit alias_map(database& db);
+  explicit alias_map(const std::vector<file_alias>& aliases);
+
+  bool empty() const { return m_by_alias.empty(); }
+
+  // The alias at a location, or null if the file there has its own contents.
+  const file_alias* find(std::size_t chunk, std::size_t file) const;
+
+  // The aliases whose contents are those of the file at a location.
+  std::pair<const file_alias*, const file_alias*> aliases_of(
+      std::size_t chunk, std::size_t file) const;
+
+  const std::vector<file_alias>& aliases() const { return m_by_alias; }
+
+ private:
+  void sort_targets();
+
+  std::vector<file_alias> m_by_alias;
+  std::vector<file_alias> m_by_target;
+};
+
+// Decompresses the file at a location into storage, which must outlive the
+// result. An alias is an empty file here, its contents are at its target. The
+// parts of a split file are joined, and the result has no line index.
+bool read_file(database& db, const path_location& location,
+               chunk_storage& storage, db_file& result);
+
+// Whether the last file of a chunk continues in the first file of the next
+// one. The table of contents tells, as names are unique within a blob.
+bool continues(database& db, std::size_t chunk);
+
+// Whether a chunk holds a part of a split file.
+bool has_parts(database& db, std::size_t chunk);
+
+// Opens the current generation of a database. If a shard list exists next to
+// the generation, the database is made up of the shards it lists. If a
+// segment list exists, the segments are layered on top of it.
 database_ptr open_database(const bfs::path& blob);
 
+// Opens a database without its segments.
+database_ptr open_blob(const bfs::path& blob);
+
+// A full build or a compaction writes a new generation of the database next
+// to the current one, and then switches to it by replacing the generation
+// file, which names the current generation. Readers keep the generation they
+// opened, so they never wait for a build. Without a generation file, the blob
+// is its own and only generation.
+bfs::path generation_path(const bfs::path& blob);
+bfs::path current_generation(const bfs::path& blob);
+bfs::path next_generation(const bfs::path& blob);
+
+// The generations before the current one that are still on the disk.
+std::vector<bfs::path> old_generations(const bfs::path& blob);
+void publish_generation(const bfs::path& blob, const bfs::path& generation);
+
+// Flushes a file to the disk.
+void sync_file(const bfs::path& path);
+
+// The shard list of a blob is a text file with the path of one shard per line.
+bfs::path shard_list_path(const bfs::path& blob);
+std::vector<bfs::path> read_shard_list(const bfs::path& blob);
+void write_shard_list(const bfs::path& blob,
+                      const std::vector<bfs::path>& shards);
+
+// The segment list of a blob has the path of one segment per line, oldest
+// first. Each segment is a blob of its own.
+bfs::path segment_list_path(const bfs::path& blob);
+std::vector<bfs::path> read_segment_list(const bfs::path& blob);
+void write_segment_list(const bfs::path& blob,
+                        const std::vector<bfs::path>& segments);
+
+// The files deleted by a segment, one name per line.
+bfs::path tombstone_path(const bfs::path& segment);
+std::vector<std::string> read_tombstones(const bfs::path& segment);
+void write_tombstones(const bfs::path& segment,
+                      const std::vector<std::string>& names);
+
+// Orders paths one component at a time, which is the order the builder adds
+// files in. The files below a directory form a contiguous range in this order.
+bool path_less(const std::string& a, const std::string& b);
+
+// The range of chunks [first, second) that may hold files whose path starts
+// with prefix. An empty prefix selects every chunk. The chunks of segments
+// come after the chunks they update, so the range may also span chunks
+// without any such file.
+std::pair<std::size_t, std::size_t> chunk_range(database& db,
+                                                const std::string& prefix);
+
 #endif
@@ -7,13 +7,16 @@
 #include <stdexcept>
 
 file_lock::file_lock(const bfs::path& lock_path)
-    : m_path(lock_path), m_state(unlocked) {}
+    : m_path(lock_path), m_open(false), m_state(unlocked) {}
 
-file_lock::~file_lock() {
+file_lock::~file_lock() { unlock(); }
+
+void file_lock::unlock() {
   if (m_state == shared)
     m_lock.unlock_sharable();
   else if (m_state == exclusive)
     m_lock.unlock();
+  m_state = unlocked;
 }
 
 void file_lock::lock_exclusive() {
@@ -30,7 +33,19 @@ void file_lock::lock_sharable() {
   m_state = shared;
 }
 
+bool file_lock::try_lock_exclusive() {
+  create_lock();
+
+  if (!m_lock.try_lock()) return false;
+  m_state = exclusive;
+  return true;
+}
+
+// The lock file is opened once, and the lock is taken on it again after an
+// unlock.
 void file_lock::create_lock() {
+  if (m_open) return;
+
   // Touch the lockfile
   {
     bfs::ofstream lockfile(m_path);
@@ -41,4 +56,5 @@ void file_lock::create_lock() {
   bip::file_lock lock(m_path.string().c_str());
 
   m_lock.swap(lock);
+  m_open = true;
 }
@@ -17,6 +17,11 @@ class file_lock : public boost::noncopyable {
   void lock_exclusive();
   void lock_sharable();
 
+  // Returns false at once if another process holds the lock.
+  bool try_lock_exclusive();
+
+  void unlock();
+
  private:
   void create_lock();
 
@@ -28,6 +33,7 @@ class file_lock : public boost::noncopyable {
 
   bip::file_lock m_lock;
   bfs::path m_path;
+  bool m_open;
   state m_state;
 };
 
@@ -0,0 +1,78 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_FILE_SET_HPP
+#define CODEDB_FILE_SET_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+// A set of files in a database, identified by chunk index and the index of the
+// file within that chunk. A default constructed file_set contains every file.
+class file_set {
+ public:
+  file_set() : m_everything(true) {}
+
+  static file_set none() {
+    file_set result;
+    result.m_everything = false;
+    return result;
+  }
+
+  bool everything() const { return m_everything; }
+
+  bool empty() const { return !m_everything && m_files.empty(); }
+
+  std::size_t size() const { return m_files.size(); }
+
+  // Files must be added in increasing order.
+  void add(std::size_t chunk, std::size_t file) {
+    m_everything = false;
+    m_files.push_back(key(chunk, file));
+  }
+
+  bool has_chunk(std::size_t chunk) const {
+    if (m_everything) return true;
+
+    auto i = std::lower_bound(m_files.begin(), m_files.end(), key(chunk, 0));
+    return i != m_files.end() && (*i >> 32) == chunk;
+  }
+
+  bool has_file(std::size_t chunk, std::size_t file) const {
+    return m_everything ||
+           std::binary_search(m_files.begin(), m_files.end(), key(chunk, file));
+  }
+
+  // Adds the files of another set with its chunk numbers moved up by offset.
+  // The moved chunks must come after all chunks already in this set.
+  void append(const file_set& other, std::size_t offset) {
+    m_everything = false;
+    for (auto i = other.m_files.begin(); i != other.m_files.end(); ++i)
+      m_files.push_back(*i + key(offset, 0));
+  }
+
+  void intersect(const file_set& other) {
+    if (other.m_everything) return;
+    if (m_everything) {
+      *this = other;
+      return;
+    }
+
+    std::vector<std::uint64_t> result;
+    std::set_intersection(m_files.begin(), m_files.end(),
+                          other.m_files.begin(), other.m_files.end(),
+                          std::back_inserter(result));
+    m_files.swap(result);
+  }
+
+ private:
+  static std::uint64_t key(std::size_t chunk, std::size_t file) {
+    return static_cast<std::uint64_t>(chunk) << 32 | file;
+  }
+
+  bool m_everything;
+  std::vector<std::uint64_t> m_files;
+};
+
+#endif
@@ -4,11 +4,11 @@
 #include "regex.hpp"
 #include "config.hpp"
 #include "options.hpp"
-#include "compress.hpp"
-#include "file_lock.hpp"
 #include "database.hpp"
 #include "profiler.hpp"
 #include "search.hpp"
+#include "regex_analysis.hpp"
+#include "token_index.hpp"
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
@@ -46,9 +46,15 @@ class string_receiver : public match_receiver {
 
 class mt_search {
  public:
-  mt_search(database& db, bool trim, std::size_t prefix_size,
+  mt_search(database& db, const trigram_query& query, bool trim,
+            const std::string& prefix, std::size_t prefix_size,
             std::size_t buffer_count)
       : m_db(db),
+        m_query(query),
+        m_files(db.select_files(query)),
+        m_aliases(db),
+        m_chunks(selected_chunks(m_files, m_aliases, chunk_range(db, prefix))),
+        m_chunk_index(0),
         m_head(0),
         m_tail(0),
         m_free(0),
@@ -63,17 +69,17 @@ class mt_search {
   }
 
   void search_db(regex_ptr re, regex_ptr file_re) {
-    std::string uncompressed;
+    chunk_storage storage;
 
     // The worker thread loop consists of repeatedly asking for a
     // compressed chunk of data, uncompressing it and reporting the
     // reuslts. We do this until all chunks have been processed.
     while (thread_data* td = next_chunk()) {
-      snappy_uncompress(td->m_input.first, td->m_input.second, uncompressed);
-      db_chunk chunk(uncompressed);
+      db_chunk chunk(td->m_input, storage);
 
       string_receiver receiver(td->m_output, m_trim);
-      search_chunk(chunk, *re, *file_re, m_prefix_size, receiver);
+      search_chunk(chunk, td->m_chunkid, *re, *file_re, m_files, m_aliases,
+                   m_prefix_size, receiver);
 
       report(td);
     }
@@ -82,19 +88,23 @@ class mt_search {
  private:
   struct thread_data {
     bool m_ready;
-    std::pair<const char*, const char*> m_input;
+    compressed_chunk m_input;
     std::string m_output;
     thread_data* m_next;
-    int m_chunkid;
+    std::size_t m_chunkid;
   };
 
   thread_data* next_chunk() {
     boost::mutex::scoped_lock lock(m_mutex);
 
     // First we grab a compressed chunk from the database, if there are
-    // no chunks left then we're done.
-    std::pair<const char*, const char*> compressed;
-    if (!m_db.next_chunk(compressed)) return 0;
+    // no chunks left then we're done. Chunks that can't contain a match are
+    // skipped before they are decompressed.
+    compressed_chunk compressed;
+    do {
+      if (m_chunk_index == m_chunks.size()) return 0;
+      m_db.get_chunk(m_chunks[m_chunk_index++], compressed);
+    } while (!compressed.m_filter.may_match(m_query));
 
     // Wait until there's a free chunk_data.
     while (m_free == 0) m_honk.wait(lock);
@@ -112,6 +122,7 @@ class mt_search {
     td->m_output.clear();
     td->m_next = 0;
     td->m_input = compressed;
+    td->m_chunkid = m_chunks[m_chunk_index - 1];
     td->m_ready = false;
 
     return td;
@@ -152,6 +163,11 @@ class mt_search {
   }
 
   database& m_db;
+  const trigram_query& m_query;
+  file_set m_files;
+  alias_map m_aliases;
+  std::vector<std::size_t> m_chunks;
+  std::size_t m_chunk_index;
   thread_data* m_head;
   thread_data* m_tail;
   thread_data* m_free;
@@ -187,23 +203,21 @@ void find(const bfs::path& cdb_path, const options& opt) {
   const bfs::path search_root = bfs::initial_path();
 
   std::size_t prefix_size = 0;
+  std::string prefix;
   std::string file_match;
   if (opt.m_options.count("-a") == 0 && search_root != cdb_root) {
-    file_match = "^" + escape_regex(search_root.generic_string().substr(
-                                        cdb_root.string().size() + 1) +
-                                    "/") +
-                 ".*";
+    prefix = search_root.generic_string().substr(cdb_root.string().size() + 1) +
+             "/";
+    file_match = "^" + escape_regex(prefix) + ".*";
     prefix_size = search_root.string().size() - cdb_root.string().size();
   }
 
-  file_lock lock(cdb_path / "lock");
-  lock.lock_sharable();
-
   const char* find_regex_options = opt.m_options.count("-i") ? "i" : "";
   const char* file_regex_options =
       cfg.get_value("nocase-file-match") == "on" ? "i" : "";
 
   bool trim = cfg.get_value("find-trim-ws") == "on";
+  bool whole_word = opt.m_options.count("-w") != 0;
   unsigned thread_count = get_thread_count(cfg);
   unsigned buffer_count = get_buffer_count(thread_count);
 
@@ -213,7 +227,41 @@ void find(const bfs::path& cdb_path, const options& opt) {
     std::string pattern = opt.m_args[i];
     if (opt.m_options.count("-v")) pattern = escape_regex(pattern);
 
-    mt_search mts(*db, trim, prefix_size, buffer_count);
+    // Whole identifiers are looked up in the token index, other whole word
+    // searches are done with word boundaries around the pattern.
+    if (whole_word) {
+      if (!*find_regex_options && db->has_token_index() && is_token(pattern)) {
+        std::vector<token_hit> hits;
+        db->find_token(pattern, true, hits);
+
+        std::string output;
+        string_receiver receiver(output, trim);
+        search_hits(*db, hits, pattern,
+                    *compile_regex(file_match, 0, file_regex_options),
+                    prefix_size, receiver);
+        std::cout << output;
+        continue;
+      }
+
+      pattern = "\\b(?:" + pattern + ")\\b";
+    }
+
+    // Plain strings are looked up in the suffix array, if there is one.
+    std::string literal;
+    if (!*find_regex_options && db->has_suffix_array() &&
+        literal_regex(pattern, literal)) {
+      std::string output;
+      string_receiver receiver(output, trim);
+      db->search_literal(literal,
+                         *compile_regex(file_match, 0, file_regex_options),
+                         prefix_size, receiver);
+      std::cout << output;
+      continue;
+    }
+
+    trigram_query query = regex_trigram_query(pattern);
+
+    mt_search mts(*db, query, trim, prefix, prefix_size, buffer_count);
 
     auto worker = [&] {
       mts.search_db(compile_regex(pattern, 0, find_regex_options),
@@ -0,0 +1,166 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "git_index.hpp"
+
+#include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#include <iterator>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+// [signature][version][entry-count]
+const std::size_t header_size = 12;
+
+// The SHA-1 of everything before it ends the index.
+const std::size_t checksum_size = 20;
+
+// An entry starts with the stat data, the object id and the flags:
+// [ctime, mtime, dev, ino, mode, uid, gid, size][sha-1][flags]
+const std::size_t mode_offset = 24;
+const std::size_t flags_offset = 60;
+const std::size_t name_offset = 62;
+
+const unsigned extended_flag = 0x4000;
+const unsigned stage_mask = 0x3000;
+const unsigned name_mask = 0xfff;
+const unsigned skip_worktree_flag = 0x4000;
+
+const unsigned type_regular = 010;
+const unsigned type_link = 012;
+
+std::uint32_t read_be32(const char* p) {
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+  return std::uint32_t(u[0]) << 24 | std::uint32_t(u[1]) << 16 |
+         std::uint32_t(u[2]) << 8 | u[3];
+}
+
+unsigned read_be16(const char* p) {
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+  return unsigned(u[0]) << 8 | u[1];
+}
+
+// Finds the git directory of a checkout. Worktrees and submodules have a file
+// in its place that points to it.
+bfs::path git_dir(const bfs::path& root) {
+  const bfs::path dot_git = root / ".git";
+  if (bfs::is_directory(dot_git)) return dot_git;
+  if (!bfs::is_regular_file(dot_git)) return bfs::path();
+
+  bfs::ifstream in(dot_git);
+  std::string line;
+  if (!std::getline(in, line) || line.compare(0, 8, "gitdir: ") != 0)
+    return bfs::path();
+
+  if (!line.empty() && line[line.size() - 1] == '\r')
+    line.erase(line.size() - 1);
+  return bfs::absolute(line.substr(8), root);
+}
+}
+
+bool read_git_index(const bfs::path& root, std::vector<std::string>& result) {
+  const bfs::path dir = git_dir(root);
+  if (dir.empty()) return false;
+
+  const bfs::path path = dir / "index";
+  bfs::ifstream in(path, bfs::ifstream::binary);
+  if (!in.is_open()) return false;
+
+  const std::string data((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+  const std::runtime_error invalid("Git index " + path.string() +
+                                   " is not valid");
+
+  if (data.size() < header_size + checksum_size ||
+      data.compare(0, 4, "DIRC") != 0)
+    throw invalid;
+
+  const std::uint32_t version = read_be32(data.c_str() + 4);
+  const std::uint32_t count = read_be32(data.c_str() + 8);
+  if (version < 2 || version > 4) throw invalid;
+
+  const char* p = data.c_str() + header_size;
+  const char* const end = data.c_str() + data.size() - checksum_size;
+
+  std::string name;
+  for (std::uint32_t i = 0; i != count; ++i) {
+    if (end - p < std::ptrdiff_t(name_offset)) throw invalid;
+
+    const unsigned type = read_be32(p + mode_offset) >> 12;
+    const unsigned flags = read_be16(p + flags_offset);
+
+    std::size_t offset = name_offset;
+    unsigned extended = 0;
+    if (flags & extended_flag) {
+      if (version < 3 || end - p < std::ptrdiff_t(offset + 2)) throw invalid;
+      extended = read_be16(p + offset);
+      offset += 2;
+    }
+
+    const char* n = p + offset;
+    if (version == 4) {
+      // The name is what's left of the previous one, after dropping as many
+      // bytes as a varint says, followed by the rest of the name.
+      auto next = [&]() -> unsigned char {
+        if (n == end) throw invalid;
+        return static_cast<unsigned char>(*n++);
+      };
+
+      unsigned char c = next();
+      std::size_t drop = c & 0x7f;
+      while (c & 0x80) {
+        c = next();
+        drop = ((drop + 1) << 7) + (c & 0x7f);
+      }
+
+      const char* terminator =
+          static_cast<const char*>(std::memchr(n, '\0', end - n));
+      if (!terminator || drop > name.size()) throw invalid;
+
+      name.erase(name.size() - drop);
+      name.append(n, terminator);
+      p = terminator + 1;
+    } else {
+      // Long names don't fit the length in the flags and are only terminated.
+      // Entries are padded with at least one NUL to a multiple of 8 bytes.
+      std::size_t length = flags & name_mask;
+      if (length == name_mask) {
+        const char* terminator =
+            static_cast<const char*>(std::memchr(n, '\0', end - n));
+        if (!terminator) throw invalid;
+        length = terminator - n;
+      }
+
+      const std::size_t size = (offset + length + 8) & ~std::size_t(7);
+      if (std::size_t(end - p) < size) throw invalid;
+
+      name.assign(n, length);
+      p += size;
+    }
+
+    // A conflicted file has an entry for every side, but is listed once.
+    if ((flags & stage_mask) && !result.empty() && result.back() == name)
+      continue;
+
+    if (extended & skip_worktree_flag) continue;
+    if (type != type_regular && type != type_link) continue;
+
+    result.push_back(name);
+  }
+
+  // A split index only has the changes to a shared index, which is not read.
+  while (end - p >= 8) {
+    if (std::memcmp(p, "link", 4) == 0) {
+      result.clear();
+      return false;
+    }
+
+    const std::uint32_t size = read_be32(p + 4);
+    if (std::uint32_t(end - p - 8) < size) throw invalid;
+    p += 8 + size;
+  }
+
+  return true;
+}
@@ -0,0 +1,21 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_GIT_INDEX_HPP
+#define CODEDB_GIT_INDEX_HPP
+
+#include "nsalias.hpp"
+
+#include <boost/filesystem/path.hpp>
+
+#include <string>
+#include <vector>
+
+// Reads the names of the files that git tracks from the index of the checkout
+// at root, without running git. The names are relative to root and in the
+// order of the index. Links are listed with the regular files, but files
+// left out of a sparse checkout and submodules are not. Returns false if
+// root isn't the top of a checkout or its index only records the changes to
+// a shared index. Throws if the index is not valid.
+bool read_git_index(const bfs::path& root, std::vector<std::string>& result);
+
+#endif
@@ -10,10 +10,14 @@ void help(const options& opt) {
     std::cout << "usage: cdb [--help] COMMAND [ARGS]\n\n"
               << "The available cdb commands are:\n"
               << "  build    Create the code db index\n"
+              << "  compact  Merge the updates into the code db index\n"
               << "  config   Get and set db options\n"
               << "  find     Search the code db\n"
               << "  init     Create an empty db\n"
-              << "  serve    Starts a local HTTP server\n\n"
+              << "  serve    Starts a local HTTP server\n"
+              << "  show     Print a file from the code db\n"
+              << "  stats    Describe what the code db index contains\n"
+              << "  watch    Keep the code db up to date as files change\n\n"
               << "See 'cdb help COMMAND' for more information on a specific "
                  "command.\n";
     return;
@@ -27,10 +31,31 @@ void help(const options& opt) {
            "match\n"
         << "the regular expression specified by the 'file-include' "
            "configuration.\n"
-        << "Directories that match the 'dir-exclude' regex are ignored.\n\n"
+        << "Directories that match the 'dir-exclude' regex are ignored.\n"
+        << "With 'build-source' set to 'git', the files are listed from the "
+           "index of\n"
+        << "the git checkout instead. 'build-read-rate', 'build-cpu-share' "
+           "and\n"
+        << "'build-yield-to-serve' hold the build back on a host that also "
+           "serves.\n"
+        << "Binary, oversized and minified files are left out and listed in "
+           "the\n"
+        << "'.excluded' report next to the index.\n\n"
         << "usage: cdb build\n\n"
         << "Valid options:\n"
-        << "  -v : Verbose\n";
+        << "  -v : Verbose, also reports the throughput of every stage and "
+           "the sizes\n"
+        << "       of the chunks\n"
+        << "  -u : Only index the changes, as a segment on top of the index. "
+           "Sharded\n"
+        << "       indexes, and those built with other limits, are built "
+           "again instead\n";
+  } else if (topic == "compact") {
+    std::cout << "compact: Merge the segments added by 'build -u' into the "
+                 "code db index.\n\n"
+              << "usage: cdb compact\n\n"
+              << "Valid options:\n"
+              << "  -v : Verbose\n";
   } else if (topic == "find") {
     std::cout << "find: Search the code db. Only files found in and below the "
                  "current\n"
@@ -39,6 +64,9 @@ void help(const options& opt) {
               << "Valid options:\n"
               << "  -v : Treat patterns as verbatim strings\n"
               << "  -i : Case insensitive search\n"
+              << "  -w : Only match whole words, from the token index if "
+                 "'build-token-index'\n"
+              << "       is on\n"
               << "  -a : Search the entire code db\n";
   } else if (topic == "init") {
     std::cout << "init: Initialize a code db in the current directory.\n\n"
@@ -48,6 +76,28 @@ void help(const options& opt) {
               << "usage: cdb config             : show all config keys\n"
               << "usage: cdb config KEY         : show configuration for KEY\n"
               << "usage: cdb config KEY VALUE   : update KEY to a new VALUE\n";
+  } else if (topic == "show") {
+    std::cout << "show: Print the contents of a file as stored in the code "
+                 "db.\n\n"
+              << "usage: cdb show PATH\n\n";
+  } else if (topic == "stats") {
+    std::cout << "stats: Describe the code db index: the number of files and "
+                 "lines, their\n"
+              << "size before and after compression, the sizes of the "
+                 "chunks, the largest\n"
+              << "files and the space taken by every top level directory.\n\n"
+              << "usage: cdb stats\n";
+  } else if (topic == "watch") {
+    std::cout << "watch: Watch the indexed directories and update the code db "
+                 "index\n"
+              << "as files change. Changes are collected for 'watch-delay' "
+                 "milliseconds\n"
+              << "and added with 'build -u'. Once there are 'watch-compact' "
+                 "segments,\n"
+              << "they are compacted. Only available on Linux.\n\n"
+              << "usage: cdb watch\n\n"
+              << "Valid options:\n"
+              << "  -v : Verbose\n";
   } else if (topic == "serve") {
     std::cout << "serve: Starts a local HTTP server that allows searching and "
                  "browsing\n"
@@ -0,0 +1,57 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "line_index.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+std::size_t line_index::find_line(const char* file_start, const char* pos,
+                                  const char*& line_start) const {
+  // Find the number of samples at or before pos. Sample i is the start of
+  // line 1 + (i + 1) * interval.
+  const db_uint offset = static_cast<db_uint>(pos - file_start);
+  db_uint lo = 0, hi = m_sample_count;
+  while (lo < hi) {
+    db_uint mid = lo + (hi - lo) / 2;
+    if (sample(mid) <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  std::size_t line = 1 + std::size_t(lo) * m_interval;
+  const char* p = lo ? file_start + sample(lo - 1) : file_start;
+
+  line_start = p;
+  while ((p = static_cast<const char*>(std::memchr(p, char(10), pos - p)))) {
+    line_start = ++p;
+    ++line;
+  }
+
+  return line;
+}
+
+const char* line_index::find_start(const char* file_start,
+                                   const char* file_end,
+                                   std::size_t line) const {
+  // Start from the closest sample before the line.
+  std::size_t current = 1;
+  const char* p = file_start;
+  if (m_interval != 0 && line > m_interval) {
+    db_uint index = static_cast<db_uint>(
+        std::min<std::size_t>((line - 1) / m_interval, m_sample_count));
+    if (index != 0) {
+      current = 1 + std::size_t(index) * m_interval;
+      p = file_start + sample(index - 1);
+    }
+  }
+
+  while (current != line && p != file_end) {
+    p = static_cast<const char*>(std::memchr(p, char(10), file_end - p));
+    if (!p) return file_end;
+    ++p;
+    ++current;
+  }
+
+  return p;
+}
@@ -0,0 +1,51 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_LINE_INDEX_HPP
+#define CODEDB_LINE_INDEX_HPP
+
+#include "serialization.hpp"
+
+#include <cstddef>
+
+// The line starts of a file, sampled every interval lines. Finding the line
+// of a position only counts the newlines after the closest sample. A default
+// constructed index has no samples, and everything is counted from the start
+// of the file.
+class line_index {
+ public:
+  line_index()
+      : m_interval(0), m_line_count(0), m_sample_count(0), m_samples(0) {}
+
+  line_index(db_uint interval, db_uint line_count, db_uint sample_count,
+             const char* samples)
+      : m_interval(interval),
+        m_line_count(line_count),
+        m_sample_count(sample_count),
+        m_samples(samples) {}
+
+  bool empty() const { return m_interval == 0; }
+
+  std::size_t line_count() const { return m_line_count; }
+
+  // Returns the number of the line that contains pos, counting from one, and
+  // stores the start of that line in line_start.
+  std::size_t find_line(const char* file_start, const char* pos,
+                        const char*& line_start) const;
+
+  // Returns the start of a line, counting from one, or file_end if the file
+  // has fewer lines.
+  const char* find_start(const char* file_start, const char* file_end,
+                         std::size_t line) const;
+
+ private:
+  db_uint sample(db_uint index) const {
+    return read_binary(m_samples + index * sizeof(db_uint));
+  }
+
+  db_uint m_interval;
+  db_uint m_line_count;
+  db_uint m_sample_count;
+  const char* m_samples;
+};
+
+#endif
@@ -0,0 +1,121 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "manifest.hpp"
+#include "serialization.hpp"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <iterator>
+#include <stdexcept>
+
+bfs::path manifest_path(const bfs::path& blob) {
+  return blob.string() + ".files";
+}
+
+namespace {
+bool read_string(const char*& p, const char* end, std::string& result) {
+  std::uint64_t size = read_varint(p);
+  if (p > end || size > std::uint64_t(end - p)) return false;
+
+  result.assign(p, static_cast<std::size_t>(size));
+  p += size;
+  return true;
+}
+
+bool read_entry(const char*& p, const char* end, manifest_entry& result) {
+  if (!read_string(p, end, result.m_name)) return false;
+
+  result.m_size = read_varint(p);
+  result.m_mtime = static_cast<std::int64_t>(read_varint(p));
+  if (p > end || end - p < 8) return false;
+
+  result.m_hash = read_binary64(p);
+  p += 8;
+  return true;
+}
+
+void write_string(std::string& data, const std::string& str) {
+  write_varint(data, str.size());
+  data += str;
+}
+
+void write_entry(std::string& data, const manifest_entry& entry) {
+  write_string(data, entry.m_name);
+  write_varint(data, entry.m_size);
+  write_varint(data, static_cast<std::uint64_t>(entry.m_mtime));
+  data.append(reinterpret_cast<const char*>(&entry.m_hash), 8);
+}
+}
+
+bool read_manifest(const bfs::path& blob, manifest& result) {
+  bfs::ifstream in(manifest_path(blob), bfs::ifstream::binary);
+  if (!in.is_open()) return false;
+
+  std::string data((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+  if (data.size() < 4 || data.compare(0, 4, "FIL1") != 0) return false;
+
+  // Padding, so that a truncated varint can't be read past the end.
+  const std::size_t size = data.size();
+  data.append(16, '\0');
+
+  const char* p = data.c_str() + 4;
+  const char* end = data.c_str() + size;
+
+  result.m_trimmed = read_varint(p) != 0;
+  result.m_created = static_cast<std::int64_t>(read_varint(p));
+  result.m_chunks.resize(static_cast<std::size_t>(read_varint(p)));
+
+  for (auto i = result.m_chunks.begin(); i != result.m_chunks.end(); ++i) {
+    if (p >= end) return false;
+    i->resize(static_cast<std::size_t>(read_varint(p)));
+
+    for (auto j = i->begin(); j != i->end(); ++j)
+      if (!read_entry(p, end, *j)) return false;
+  }
+
+  // Manifests written before files were excluded end here.
+  result.m_limits.clear();
+  result.m_excluded.clear();
+  if (p == end) return true;
+
+  if (!read_string(p, end, result.m_limits) || p >= end) return false;
+  result.m_excluded.resize(static_cast<std::size_t>(read_varint(p)));
+
+  for (auto i = result.m_excluded.begin(); i != result.m_excluded.end(); ++i)
+    if (p >= end || !read_entry(p, end, i->m_entry) ||
+        !read_string(p, end, i->m_reason))
+      return false;
+
+  return p == end;
+}
+
+void write_manifest(const bfs::path& blob, const manifest& m) {
+  // "FIL1"[trimmed][created][chunk-count]
+  // [{file-count, {name-size, name, size, mtime, hash}}]
+  // [limits-size, limits][excluded-count]
+  // [{name-size, name, size, mtime, hash, reason-size, reason}]
+  std::string data = "FIL1";
+  write_varint(data, m.m_trimmed ? 1 : 0);
+  write_varint(data, static_cast<std::uint64_t>(m.m_created));
+  write_varint(data, m.m_chunks.size());
+
+  for (auto i = m.m_chunks.begin(); i != m.m_chunks.end(); ++i) {
+    write_varint(data, i->size());
+    for (auto j = i->begin(); j != i->end(); ++j) write_entry(data, *j);
+  }
+
+  write_string(data, m.m_limits);
+  write_varint(data, m.m_excluded.size());
+  for (auto i = m.m_excluded.begin(); i != m.m_excluded.end(); ++i) {
+    write_entry(data, i->m_entry);
+    write_string(data, i->m_reason);
+  }
+
+  bfs::ofstream out(manifest_path(blob), bfs::ofstream::binary);
+  if (!out.is_open())
+    throw std::runtime_error("Unable to open " + manifest_path(blob).string() +
+                             " for writing");
+
+  out.write(data.c_str(), data.size());
+}
@@ -0,0 +1,60 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_MANIFEST_HPP
+#define CODEDB_MANIFEST_HPP
+
+#include "nsalias.hpp"
+
+#include <boost/filesystem/path.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A file as it was when it was indexed. The hash is of the file contents
+// before any whitespace was trimmed.
+struct manifest_entry {
+  std::string m_name;
+  std::uint64_t m_size;
+  std::int64_t m_mtime;
+  std::uint64_t m_hash;
+};
+
+// A file that the build left out of the database, and why.
+struct excluded_file {
+  manifest_entry m_entry;
+  std::string m_reason;
+};
+
+// The files of a database, chunk by chunk, which lets the next build find the
+// chunks that haven't changed. Modification times are in whole seconds, so
+// files changed in the second the manifest was created are not to be trusted.
+// The limits describe the other settings that decide which files are indexed
+// and how they are stored, builds with other limits can't reuse anything.
+struct manifest {
+  bool m_trimmed;
+  std::string m_limits;
+  std::int64_t m_created;
+  std::vector<std::vector<manifest_entry>> m_chunks;
+  std::vector<excluded_file> m_excluded;
+};
+
+bfs::path manifest_path(const bfs::path& blob);
+
+// Returns false if there is no valid manifest.
+bool read_manifest(const bfs::path& blob, manifest& result);
+void write_manifest(const bfs::path& blob, const manifest& m);
+
+// Continues a 64 bit FNV-1a hash with the bytes in [begin, end).
+inline std::uint64_t hash_bytes(std::uint64_t hash, const char* begin,
+                                const char* end) {
+  for (; begin != end; ++begin) {
+    hash ^= static_cast<unsigned char>(*begin);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+const std::uint64_t hash_seed = 0xcbf29ce484222325ull;
+
+#endif
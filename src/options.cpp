@@ -30,6 +30,26 @@ options parse_cmdline(int argc, char** argv) {
   } else if (args[0] == "build") {
     result.m_mode = options::build;
     auto i = args.begin() + 1;
+    for (; i != args.end() && i->at(0) == '-'; ++i) {
+      if (*i == "-v" || *i == "-u")
+        add_single(result.m_options, *i);
+      else
+        throw std::runtime_error("Invalid argument");
+    }
+    if (i != args.end()) throw std::runtime_error("Invalid argument");
+  } else if (args[0] == "compact") {
+    result.m_mode = options::compact;
+    auto i = args.begin() + 1;
+    for (; i != args.end() && i->at(0) == '-'; ++i) {
+      if (*i == "-v")
+        add_single(result.m_options, "-v");
+      else
+        throw std::runtime_error("Invalid argument");
+    }
+    if (i != args.end()) throw std::runtime_error("Invalid argument");
+  } else if (args[0] == "watch") {
+    result.m_mode = options::watch;
+    auto i = args.begin() + 1;
     for (; i != args.end() && i->at(0) == '-'; ++i) {
       if (*i == "-v")
         add_single(result.m_options, "-v");
@@ -50,7 +70,7 @@ options parse_cmdline(int argc, char** argv) {
         break;
       }
 
-      if (*i == "-a" || *i == "-i" || *i == "-v")
+      if (*i == "-a" || *i == "-i" || *i == "-v" || *i == "-w")
         add_single(result.m_options, *i);
       if (*i == "-f") {
         if (++i == args.end())
@@ -67,6 +87,13 @@ options parse_cmdline(int argc, char** argv) {
     result.m_args.insert(result.m_args.end(), i, args.end());
     if (result.m_args.empty())
       throw std::runtime_error("find requires a query");
+  } else if (args[0] == "show") {
+    result.m_mode = options::show;
+    if (args.size() != 2) throw std::runtime_error("show requires a path");
+    result.m_args.push_back(args[1]);
+  } else if (args[0] == "stats") {
+    result.m_mode = options::stats;
+    if (args.size() > 1) throw std::runtime_error("Invalid argument");
   } else if (args[0] == "serve") {
     result.m_mode = options::serve;
     if (args.size() > 3) throw std::runtime_error("Invalid argument");
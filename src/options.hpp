@@ -14,8 +14,12 @@ struct options {
     init,
     config,
     build,
+    compact,
     find,
-    serve
+    show,
+    stats,
+    serve,
+    watch
   };
 
   mode m_mode;
@@ -0,0 +1,139 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "path_table.hpp"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+// Number of names in a front coded block.
+const std::size_t block_size = 16;
+
+// Decodes the next entry of a block. The name shares a prefix with the name
+// before it, which is already stored in 'name'.
+void read_entry(const char*& p, std::string& name, path_location& location) {
+  std::size_t shared = static_cast<std::size_t>(read_varint(p));
+  std::size_t suffix = static_cast<std::size_t>(read_varint(p));
+
+  name.resize(shared);
+  name.append(p, suffix);
+  p += suffix;
+
+  location.m_chunk = static_cast<db_uint>(read_varint(p));
+  location.m_file = static_cast<db_uint>(read_varint(p));
+}
+}
+
+path_table_writer::path_table_writer() : m_chunk_count(0), m_file_count(0) {}
+
+void path_table_writer::add_file(const std::string& name) {
+  entry e;
+  e.m_name = name;
+  e.m_location.m_chunk = m_chunk_count;
+  e.m_location.m_file = m_file_count++;
+  m_entries.push_back(e);
+}
+
+void path_table_writer::skip_file() { m_file_count++; }
+
+void path_table_writer::end_chunk() {
+  m_chunk_count++;
+  m_file_count = 0;
+}
+
+void path_table_writer::write(const bfs::path& path) {
+  bfs::ofstream out(path, bfs::ofstream::binary);
+  if (!out.is_open())
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for writing");
+
+  std::sort(m_entries.begin(), m_entries.end(),
+            [](const entry& a, const entry& b) { return a.m_name < b.m_name; });
+
+  // [{shared-prefix, suffix-size, suffix, chunk, file}]
+  std::string blocks;
+  std::vector<db_uint> offsets;
+  for (std::size_t i = 0; i != m_entries.size(); ++i) {
+    const std::string& name = m_entries[i].m_name;
+
+    std::size_t shared = 0;
+    if (i % block_size == 0) {
+      offsets.push_back(static_cast<db_uint>(blocks.size()));
+    } else {
+      const std::string& prev = m_entries[i - 1].m_name;
+      while (shared != prev.size() && shared != name.size() &&
+             prev[shared] == name[shared])
+        ++shared;
+    }
+
+    write_varint(blocks, shared);
+    write_varint(blocks, name.size() - shared);
+    blocks.append(name, shared, std::string::npos);
+    write_varint(blocks, m_entries[i].m_location.m_chunk);
+    write_varint(blocks, m_entries[i].m_location.m_file);
+  }
+
+  out.write("PTH1", 4);
+  write_binary(out, m_chunk_count);
+  write_binary(out, static_cast<db_uint>(offsets.size()));
+  for (auto i = offsets.begin(); i != offsets.end(); ++i) write_binary(out, *i);
+  out.write(blocks.c_str(), blocks.size());
+}
+
+path_table::path_table(const bfs::path& path)
+    : m_mapping(path.string().c_str(), bip::read_only),
+      m_region(m_mapping, bip::read_only),
+      m_data(static_cast<const char*>(m_region.get_address())) {
+  const std::size_t size = m_region.get_size();
+  const std::size_t header_size = 4 + sizeof(db_uint) * 2;
+
+  if (size < header_size || std::memcmp(m_data, "PTH1", 4) != 0)
+    throw std::runtime_error("Path table " + path.string() + " is not valid");
+
+  m_chunk_count = read_binary(m_data + 4);
+  m_block_count = read_binary(m_data + 4 + sizeof(db_uint));
+  m_offsets = m_data + header_size;
+  m_blocks = m_offsets + m_block_count * sizeof(db_uint);
+
+  if (m_blocks > m_data + size)
+    throw std::runtime_error("Path table " + path.string() + " is not valid");
+}
+
+bool path_table::find(const std::string& name, path_location& result) const {
+  std::string current;
+
+  // Find the last block that starts with a name not greater than 'name'.
+  db_uint lo = 0, hi = m_block_count;
+  while (lo < hi) {
+    db_uint mid = lo + (hi - lo) / 2;
+    const char* p = block(mid);
+    read_entry(p, current, result);
+
+    if (current <= name)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == 0) return false;
+
+  const char* p = block(lo - 1);
+  const char* end =
+      lo == m_block_count ? m_data + m_region.get_size() : block(lo);
+  current.clear();
+  while (p != end) {
+    read_entry(p, current, result);
+
+    int cmp = current.compare(name);
+    if (cmp == 0) return true;
+    if (cmp > 0) break;
+  }
+
+  return false;
+}
+
+const char* path_table::block(db_uint index) const {
+  return m_blocks + read_binary(m_offsets + index * sizeof(db_uint));
+}
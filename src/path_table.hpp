@@ -0,0 +1,71 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_PATH_TABLE_HPP
+#define CODEDB_PATH_TABLE_HPP
+
+#include "nsalias.hpp"
+#include "serialization.hpp"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <string>
+#include <vector>
+
+// Where a file is stored: the chunk and the index of the file in that chunk.
+struct path_location {
+  db_uint m_chunk;
+  db_uint m_file;
+};
+
+// Collects the file names of a database. Files must be added in database order
+// and end_chunk called after the last file of each chunk.
+class path_table_writer {
+ public:
+  path_table_writer();
+
+  void add_file(const std::string& name);
+  void end_chunk();
+
+  // Counts a file without listing it. The later parts of a split file are
+  // found through the first one.
+  void skip_file();
+
+  void write(const bfs::path& path);
+
+ private:
+  struct entry {
+    std::string m_name;
+    path_location m_location;
+  };
+
+  std::vector<entry> m_entries;
+  db_uint m_chunk_count;
+  db_uint m_file_count;
+};
+
+// A sorted table of every file name in a database. Names are front coded in
+// blocks, the first name of each block is stored in full so that a lookup can
+// binary search the blocks and then scan a single one.
+class path_table {
+ public:
+  path_table(const bfs::path& path);
+
+  std::size_t chunk_count() const { return m_chunk_count; }
+
+  bool find(const std::string& name, path_location& result) const;
+
+ private:
+  const char* block(db_uint index) const;
+
+  bip::file_mapping m_mapping;
+  bip::mapped_region m_region;
+  const char* m_data;
+  db_uint m_chunk_count;
+  db_uint m_block_count;
+  const char* m_offsets;
+  const char* m_blocks;
+};
+
+#endif
@@ -1,14 +1,24 @@
 // CodeDB - public domain - 2010 Daniel Andersson
 #include "profiler.hpp"
 
+#include <boost/thread/mutex.hpp>
+
 #include <iostream>
 #include <iomanip>
 #include <cstdlib>
+#include <cstring>
 
 profiler s_profilers[20];
 unsigned s_profcount = 0;
+boost::mutex s_profmutex;
 
 profiler& make_profiler(const char* name) {
+  boost::mutex::scoped_lock lock(s_profmutex);
+
+  // Profilers with the same name share counters.
+  for (unsigned i = 0; i != s_profcount; ++i)
+    if (!std::strcmp(s_profilers[i].m_name, name)) return s_profilers[i];
+
   auto& p = s_profilers[s_profcount++];
   p.m_name = name;
 
@@ -3,37 +3,41 @@
 
 #include "ticks.hpp"
 
+#include <atomic>
 #include <cstdint>
 
+// Profilers with the same name share their counters, which threads add to at
+// once. Only the start of profile_start is kept in the profiler itself.
 struct profiler {
   const char* m_name;
-  std::uint32_t m_count;
+  std::atomic<std::uint32_t> m_count;
   std::uint64_t m_start;
-  std::uint64_t m_total;
+  std::atomic<std::uint64_t> m_total;
 };
 
-inline void profile_start(profiler& p) { p.m_start = getticks(); }
-
-inline void profile_stop(profiler& p) {
-  auto now = getticks();
-  p.m_total += (now - p.m_start);
+inline void profile_add(profiler& p, std::uint64_t start) {
+  p.m_total += getticks() - start;
   ++p.m_count;
 }
 
+inline void profile_start(profiler& p) { p.m_start = getticks(); }
+
+inline void profile_stop(profiler& p) { profile_add(p, p.m_start); }
+
 profiler& make_profiler(const char* name);
 
 void profiler_report();
 
 class profile_scope {
  public:
-  profile_scope(profiler& p) : m_p(p) { profile_start(m_p); }
+  profile_scope(profiler& p) : m_p(p), m_start(getticks()) {}
 
-  profile_scope(const char* name) : m_p(make_profiler(name)) {
-    profile_start(m_p);
-  }
+  profile_scope(const char* name)
+      : m_p(make_profiler(name)), m_start(getticks()) {}
 
-  ~profile_scope() { profile_stop(m_p); }
+  ~profile_scope() { profile_add(m_p, m_start); }
 
  private:
   profiler& m_p;
+  std::uint64_t m_start;
 };
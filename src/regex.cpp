@@ -1,9 +1,12 @@
 // CodeDB - public domain - 2010 Daniel Andersson
 
 #include "regex.hpp"
+#include "regex_analysis.hpp"
 #include "nsalias.hpp"
 
+#include <algorithm>
 #include <cstring>
+#include <cctype>
 
 regex::~regex() {}
 
@@ -58,7 +61,9 @@ regex_ptr compile_regex_re2(const std::string& expr, int caps,
 #error No regex engine selected.
 #endif
 
-regex_ptr compile_regex(const std::string& expr, int caps, const char* flags) {
+namespace {
+regex_ptr compile_selected_regex(const std::string& expr, int caps,
+                                 const char* flags) {
   if (const char* selected = std::getenv("CDB_REGEX")) {
 #ifdef CDB_USE_REGEX_RE2
     if (!std::strcmp(selected, "re2")) {
@@ -86,6 +91,25 @@ regex_ptr compile_regex(const std::string& expr, int caps, const char* flags) {
 
   return CDB_SELECTED_REGEX(expr, caps, flags);
 }
+}
+
+regex_ptr compile_regex(const std::string& expr, int caps, const char* flags) {
+  regex_ptr re = compile_selected_regex(expr, caps, flags);
+
+  re->m_literal_nocase = std::strchr(flags, 'i') != 0;
+
+  // A case insensitive literal is scanned for by one of its other characters,
+  // so it needs at least one that isn't a letter.
+  std::string literal = required_literal(expr, re->m_literal_nocase,
+                                         re->dot_matches_newline());
+  if (!re->m_literal_nocase ||
+      std::find_if(literal.begin(), literal.end(), [](char c) {
+        return !std::isalpha(static_cast<unsigned char>(c));
+      }) != literal.end())
+    re->m_literal = literal;
+
+  return re;
+}
 
 std::string escape_regex(const std::string& text) {
   std::string res;
@@ -35,8 +35,13 @@ class regex_error : public std::runtime_error {
   std::string m_expr;
 };
 
+class regex;
+
+typedef std::unique_ptr<regex> regex_ptr;
+
 class regex {
  public:
+  regex() : m_literal_nocase(false) {}
   virtual ~regex();
 
   bool match(const std::string& str);
@@ -47,12 +52,26 @@ class regex {
 
   virtual match_range what(int n) = 0;
 
+  // A literal that every match contains, confined to a single line. Searches
+  // can skip to the lines where it occurs. Empty if there is no such literal.
+  const std::string& literal() const { return m_literal; }
+
+  // Whether the literal should be compared without regard to case, in which
+  // case it is stored in lower case.
+  bool literal_nocase() const { return m_literal_nocase; }
+
  private:
+  friend regex_ptr compile_regex(const std::string& expr, int caps,
+                                 const char* flags);
+
   virtual bool do_match(const char* begin, const char* end) = 0;
   virtual bool do_search(const char* begin, const char* end) = 0;
-};
 
-typedef std::unique_ptr<regex> regex_ptr;
+  virtual bool dot_matches_newline() const { return false; }
+
+  std::string m_literal;
+  bool m_literal_nocase;
+};
 
 regex_ptr compile_regex(const std::string& expr, int caps = 0,
                         const char* flags = "");
@@ -0,0 +1,752 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "regex_analysis.hpp"
+
+#include <stdexcept>
+#include <cstring>
+#include <cctype>
+#include <set>
+
+namespace {
+// Character classes larger than this are treated as 'any'.
+const std::size_t max_class_chars = 16;
+
+class regex_parser {
+ public:
+  regex_parser(const std::string& expr, bool dot_newline)
+      : m_pos(expr.c_str()),
+        m_end(m_pos + expr.size()),
+        m_dot_newline(dot_newline) {}
+
+  regex_node parse() {
+    regex_node root = parse_alternate();
+    if (m_pos != m_end) fail();
+    return root;
+  }
+
+ private:
+  [[noreturn]] static void fail() {
+    throw std::runtime_error("Unsupported regex construct");
+  }
+
+  bool at(char c) const { return m_pos != m_end && *m_pos == c; }
+
+  regex_node parse_alternate() {
+    regex_node first = parse_concat();
+    if (!at('|')) return first;
+
+    regex_node alt(regex_node::alternate);
+    alt.m_children.push_back(std::move(first));
+    while (at('|')) {
+      ++m_pos;
+      alt.m_children.push_back(parse_concat());
+    }
+
+    return alt;
+  }
+
+  regex_node parse_concat() {
+    regex_node seq(regex_node::concat);
+    while (m_pos != m_end && *m_pos != '|' && *m_pos != ')') {
+      regex_node atom = parse_atom();
+      parse_quantifiers(atom);
+      seq.m_children.push_back(std::move(atom));
+    }
+
+    return seq;
+  }
+
+  void parse_quantifiers(regex_node& atom) {
+    while (m_pos != m_end) {
+      unsigned min = 0, max = regex_node::unbounded;
+
+      if (*m_pos == '*') {
+        ++m_pos;
+      } else if (*m_pos == '+') {
+        min = 1;
+        ++m_pos;
+      } else if (*m_pos == '?') {
+        max = 1;
+        ++m_pos;
+      } else if (*m_pos != '{' || !parse_bounds(min, max)) {
+        return;
+      }
+
+      // Lazy and possessive modifiers don't change what can match.
+      if (at('?') || at('+')) ++m_pos;
+
+      regex_node rep(regex_node::repeat);
+      rep.m_min = min;
+      rep.m_max = max;
+      rep.m_children.push_back(std::move(atom));
+      atom = std::move(rep);
+    }
+  }
+
+  bool parse_number(unsigned& n) {
+    const char* start = m_pos;
+    n = 0;
+    while (m_pos != m_end && std::isdigit(static_cast<unsigned char>(*m_pos)))
+      n = n * 10 + (*m_pos++ - '0');
+    return m_pos != start;
+  }
+
+  // Parses {n}, {n,} and {n,m}. A brace that doesn't start a valid bound is a
+  // literal.
+  bool parse_bounds(unsigned& min, unsigned& max) {
+    const char* start = m_pos++;
+
+    if (parse_number(min)) {
+      max = min;
+      if (at(',')) {
+        ++m_pos;
+        if (!parse_number(max)) max = regex_node::unbounded;
+      }
+      if (at('}')) {
+        ++m_pos;
+        return true;
+      }
+    }
+
+    m_pos = start;
+    return false;
+  }
+
+  regex_node parse_atom() {
+    char c = *m_pos++;
+    switch (c) {
+      case '.':
+        return any_node(m_dot_newline);
+      case '^':
+      case '$':
+        return assertion_node(c);
+      case '(':
+        return parse_group();
+      case '[':
+        return parse_class();
+      case '\\':
+        return parse_escape();
+      case '*':
+      case '+':
+      case '?':
+        fail();
+      default:
+        return char_node(c);
+    }
+  }
+
+  regex_node parse_group() {
+    bool lookaround = false;
+
+    if (at('?')) {
+      ++m_pos;
+      if (at(':')) {
+        ++m_pos;
+      } else if (at('=') || at('!')) {
+        ++m_pos;
+        lookaround = true;
+      } else if (at('<') && m_pos + 1 != m_end &&
+                 (m_pos[1] == '=' || m_pos[1] == '!')) {
+        m_pos += 2;
+        lookaround = true;
+      } else if (at('<') || at('P') || at('\'')) {
+        // Named group
+        while (m_pos != m_end && *m_pos != '>' && *m_pos != '\'') ++m_pos;
+        if (m_pos == m_end) fail();
+        ++m_pos;
+      } else {
+        // Flags, such as (?i) or (?i:...). Any flag that is set changes what
+        // the rest matches, case or newlines, in ways that aren't modelled.
+        while (m_pos != m_end && (std::isalpha(static_cast<unsigned char>(
+                                      *m_pos)) || *m_pos == '-')) {
+          if (*m_pos != '-') fail();
+          ++m_pos;
+        }
+        if (at(')')) {
+          ++m_pos;
+          return assertion_node('?');
+        }
+        if (!at(':')) fail();
+        ++m_pos;
+      }
+    }
+
+    regex_node inner = parse_alternate();
+    if (!at(')')) fail();
+    ++m_pos;
+
+    // Lookarounds don't consume anything.
+    return lookaround ? assertion_node('?') : inner;
+  }
+
+  unsigned parse_hex(int digits) {
+    unsigned value = 0;
+    for (int i = 0; i != digits; ++i, ++m_pos) {
+      if (m_pos == m_end || !std::isxdigit(static_cast<unsigned char>(*m_pos)))
+        fail();
+      char c = *m_pos;
+      value = value * 16 +
+              (std::isdigit(static_cast<unsigned char>(c))
+                   ? c - '0'
+                   : std::tolower(static_cast<unsigned char>(c)) - 'a' + 10);
+    }
+    return value;
+  }
+
+  // Parses the escaped character after a backslash. Returns false if the
+  // escape denotes a class of characters rather than a single one, in which
+  // case c is set to the class letter.
+  bool parse_escaped_char(char& c, bool in_class) {
+    if (m_pos == m_end) fail();
+
+    c = *m_pos++;
+    switch (c) {
+      case 'd':
+      case 'D':
+      case 'w':
+      case 'W':
+      case 's':
+      case 'S':
+        return false;
+      case 'n':
+        c = '\n';
+        return true;
+      case 't':
+        c = '\t';
+        return true;
+      case 'r':
+        c = '\r';
+        return true;
+      case 'f':
+        c = '\f';
+        return true;
+      case 'v':
+        c = '\v';
+        return true;
+      case '0':
+        c = '\0';
+        return true;
+      case 'x':
+        c = static_cast<char>(parse_hex(2));
+        return true;
+      case 'u': {
+        unsigned u = parse_hex(4);
+        c = static_cast<char>(u);
+        return u < 0x80;
+      }
+      case 'b':
+        if (in_class) {
+          c = '\b';
+          return true;
+        }
+        fail();
+      case '<':
+      case '>':
+      case '`':
+      case '\'':
+        // Word and buffer boundaries in boost.regex and xpressive.
+        fail();
+      default:
+        // Unknown letter and digit escapes mean different things to
+        // different engines.
+        if (std::isalnum(static_cast<unsigned char>(c))) fail();
+        return true;
+    }
+  }
+
+  regex_node parse_escape() {
+    if (at('b') || at('B')) return assertion_node(*m_pos++);
+
+    if (m_pos != m_end && *m_pos >= '1' && *m_pos <= '9') {
+      // A backreference can match any string.
+      while (m_pos != m_end && std::isdigit(static_cast<unsigned char>(*m_pos)))
+        ++m_pos;
+      regex_node rep(regex_node::repeat);
+      rep.m_max = regex_node::unbounded;
+      rep.m_children.push_back(any_node(true));
+      return rep;
+    }
+
+    char c;
+    if (!parse_escaped_char(c, false))
+      return any_node(!class_excludes_newline(c));
+    return char_node(c);
+  }
+
+  // Whether a class escape such as \d is certain not to match a newline.
+  static bool class_excludes_newline(char c) { return c == 'd' || c == 'w'; }
+
+  regex_node parse_class() {
+    bool negate = at('^');
+    if (negate) ++m_pos;
+
+    // A leading ']' is a literal in some engines and an empty class in others.
+    if (at(']')) fail();
+
+    std::set<unsigned char> chars;
+    bool wide = false;
+    bool newline = false;
+
+    for (;;) {
+      if (m_pos == m_end) fail();
+
+      char c = *m_pos++;
+      if (c == ']') break;
+
+      if (c == '[' && m_pos != m_end && std::strchr(":=.", *m_pos)) fail();
+
+      if (c == '\\' && !parse_escaped_char(c, true)) {
+        wide = true;
+        newline = newline || !class_excludes_newline(c);
+        continue;
+      }
+
+      unsigned char lo = static_cast<unsigned char>(c), hi = lo;
+      if (at('-') && m_pos + 1 != m_end && m_pos[1] != ']') {
+        ++m_pos;
+        char h = *m_pos++;
+        if (h == '\\' && !parse_escaped_char(h, true)) fail();
+        hi = static_cast<unsigned char>(h);
+        if (hi < lo) fail();
+      }
+
+      if (static_cast<std::size_t>(hi - lo) >= max_class_chars) {
+        wide = true;
+        newline = newline || (lo <= '\n' && hi >= '\n');
+        continue;
+      }
+
+      for (unsigned i = lo; i <= hi; ++i) chars.insert(i);
+    }
+
+    if (negate) return any_node(true);
+
+    if (wide || chars.size() > max_class_chars)
+      return any_node(newline || chars.count('\n'));
+
+    regex_node n(regex_node::chars);
+    n.m_chars.assign(chars.begin(), chars.end());
+    return n;
+  }
+
+  static regex_node any_node(bool newline) {
+    regex_node n(regex_node::any);
+    n.m_newline = newline;
+    return n;
+  }
+
+  static regex_node assertion_node(char c) {
+    regex_node n(regex_node::assertion);
+    n.m_chars = c;
+    return n;
+  }
+
+  static regex_node char_node(char c) {
+    regex_node n(regex_node::chars);
+    n.m_chars = c;
+    return n;
+  }
+
+  const char* m_pos;
+  const char* m_end;
+  bool m_dot_newline;
+};
+
+// The trigram analysis follows Russ Cox's "Regular Expression Matching with a
+// Trigram Index". For every node we track whether it can match the empty
+// string, the exact set of strings it matches (when small), sets of strings
+// that every match starts or ends with, and a query that every match
+// satisfies.
+
+typedef std::set<std::string> string_set;
+
+// Sets larger than this are simplified, trading precision for speed.
+const std::size_t max_set = 16;
+
+struct regex_info {
+  regex_info() : m_emptyable(false), m_exact_known(false) {}
+
+  bool m_emptyable;
+  bool m_exact_known;
+  string_set m_exact;
+  string_set m_prefix;
+  string_set m_suffix;
+  trigram_query m_match;
+};
+
+trigram_query query_for(const string_set& strings) {
+  return trigram_query::from_strings(
+      std::vector<std::string>(strings.begin(), strings.end()));
+}
+
+string_set cross(const string_set& a, const string_set& b) {
+  string_set result;
+  for (auto i = a.begin(); i != a.end(); ++i)
+    for (auto j = b.begin(); j != b.end(); ++j) result.insert(*i + *j);
+  return result;
+}
+
+string_set set_union(string_set a, const string_set& b) {
+  a.insert(b.begin(), b.end());
+  return a;
+}
+
+regex_info empty_info() {
+  regex_info info;
+  info.m_emptyable = true;
+  info.m_exact_known = true;
+  info.m_exact.insert(std::string());
+  return info;
+}
+
+regex_info any_info(bool emptyable) {
+  regex_info info;
+  info.m_emptyable = emptyable;
+  info.m_prefix.insert(std::string());
+  info.m_suffix.insert(std::string());
+  return info;
+}
+
+// Stop tracking the exact set, keeping what it tells us in the query and in
+// the prefix and suffix sets.
+void drop_exact(regex_info& info) {
+  if (!info.m_exact_known) return;
+
+  info.m_match = std::move(info.m_match) && query_for(info.m_exact);
+  info.m_prefix = info.m_exact;
+  info.m_suffix = info.m_exact;
+  info.m_exact.clear();
+  info.m_exact_known = false;
+}
+
+void simplify_set(regex_info& info, string_set& set, bool suffix) {
+  if (set.size() <= max_set) return;
+
+  info.m_match = std::move(info.m_match) && query_for(set);
+
+  for (std::size_t len = 2; set.size() > max_set && len != std::size_t(-1);
+       --len) {
+    string_set shorter;
+    for (auto i = set.begin(); i != set.end(); ++i) {
+      if (i->size() <= len)
+        shorter.insert(*i);
+      else if (suffix)
+        shorter.insert(i->substr(i->size() - len));
+      else
+        shorter.insert(i->substr(0, len));
+    }
+    set.swap(shorter);
+  }
+}
+
+void simplify(regex_info& info) {
+  if (info.m_exact_known && info.m_exact.size() > max_set) drop_exact(info);
+
+  simplify_set(info, info.m_prefix, false);
+  simplify_set(info, info.m_suffix, true);
+}
+
+regex_info concat_info(regex_info x, regex_info y) {
+  regex_info r;
+  r.m_emptyable = x.m_emptyable && y.m_emptyable;
+  r.m_match = std::move(x.m_match) && std::move(y.m_match);
+
+  if (x.m_exact_known && y.m_exact_known &&
+      x.m_exact.size() * y.m_exact.size() <= max_set) {
+    r.m_exact_known = true;
+    r.m_exact = cross(x.m_exact, y.m_exact);
+    simplify(r);
+    return r;
+  }
+
+  const string_set& xs = x.m_exact_known ? x.m_exact : x.m_suffix;
+  const string_set& yp = y.m_exact_known ? y.m_exact : y.m_prefix;
+
+  // Trigrams that straddle the boundary between x and y.
+  if (xs.size() * yp.size() <= max_set) {
+    string_set boundary;
+    for (auto i = xs.begin(); i != xs.end(); ++i) {
+      std::string tail = i->size() > 2 ? i->substr(i->size() - 2) : *i;
+      for (auto j = yp.begin(); j != yp.end(); ++j)
+        boundary.insert(tail + j->substr(0, 2));
+    }
+    r.m_match = std::move(r.m_match) && query_for(boundary);
+  }
+
+  if (x.m_exact_known)
+    r.m_prefix = x.m_exact.size() * yp.size() <= max_set ? cross(x.m_exact, yp)
+                                                          : x.m_exact;
+  else
+    r.m_prefix = x.m_prefix;
+
+  if (y.m_exact_known)
+    r.m_suffix = xs.size() * y.m_exact.size() <= max_set ? cross(xs, y.m_exact)
+                                                          : y.m_exact;
+  else
+    r.m_suffix = y.m_suffix;
+
+  simplify(r);
+  return r;
+}
+
+regex_info alternate_info(regex_info x, regex_info y) {
+  regex_info r;
+  r.m_emptyable = x.m_emptyable || y.m_emptyable;
+
+  if (x.m_exact_known && y.m_exact_known) {
+    r.m_exact_known = true;
+    r.m_exact = set_union(x.m_exact, y.m_exact);
+  } else {
+    drop_exact(x);
+    drop_exact(y);
+    r.m_prefix = set_union(x.m_prefix, y.m_prefix);
+    r.m_suffix = set_union(x.m_suffix, y.m_suffix);
+  }
+
+  r.m_match = std::move(x.m_match) || std::move(y.m_match);
+
+  simplify(r);
+  return r;
+}
+
+regex_info analyze(const regex_node& node) {
+  switch (node.m_kind) {
+    case regex_node::empty:
+    case regex_node::assertion:
+      return empty_info();
+    case regex_node::any:
+      return any_info(false);
+    case regex_node::chars: {
+      regex_info info;
+      info.m_exact_known = true;
+      for (auto i = node.m_chars.begin(); i != node.m_chars.end(); ++i)
+        info.m_exact.insert(std::string(1, fold_case(*i)));
+      return info;
+    }
+    case regex_node::concat: {
+      regex_info info = empty_info();
+      for (auto i = node.m_children.begin(); i != node.m_children.end(); ++i)
+        info = concat_info(std::move(info), analyze(*i));
+      return info;
+    }
+    case regex_node::alternate: {
+      regex_info info = analyze(node.m_children.front());
+      for (auto i = node.m_children.begin() + 1; i != node.m_children.end();
+           ++i)
+        info = alternate_info(std::move(info), analyze(*i));
+      return info;
+    }
+    case regex_node::repeat: {
+      if (node.m_max == 0) return empty_info();
+
+      regex_info info = analyze(node.m_children.front());
+      if (node.m_min == 0 && node.m_max == 1)
+        return alternate_info(std::move(info), empty_info());
+      if (node.m_min == 0) return any_info(true);
+      if (node.m_min == 1 && node.m_max == 1) return info;
+
+      // One or more repetitions start and end with a match of the child.
+      drop_exact(info);
+      return info;
+    }
+  }
+
+  return any_info(true);
+}
+
+// Literal extraction tracks single strings instead of sets: the exact string
+// a node matches (if there is only one), a prefix and a suffix of every match,
+// and the longest string found inside every match.
+struct literal_info {
+  literal_info() : m_exact_known(false) {}
+
+  bool m_exact_known;
+  std::string m_exact;
+  std::string m_prefix;
+  std::string m_suffix;
+  std::string m_best;
+};
+
+const std::string& longest(const std::string& a, const std::string& b) {
+  return b.size() > a.size() ? b : a;
+}
+
+literal_info exact_literal(const std::string& s) {
+  literal_info info;
+  info.m_exact_known = true;
+  info.m_exact = s;
+  info.m_prefix = s;
+  info.m_suffix = s;
+  info.m_best = s;
+  return info;
+}
+
+literal_info inexact_literal(const literal_info& x) {
+  literal_info info = x;
+  info.m_exact_known = false;
+  info.m_exact.clear();
+  return info;
+}
+
+literal_info concat_literal(const literal_info& x, const literal_info& y) {
+  if (x.m_exact_known && y.m_exact_known)
+    return exact_literal(x.m_exact + y.m_exact);
+
+  literal_info info;
+  info.m_prefix = x.m_exact_known ? x.m_exact + y.m_prefix : x.m_prefix;
+  info.m_suffix = y.m_exact_known ? x.m_suffix + y.m_exact : y.m_suffix;
+  info.m_best = longest(longest(x.m_best, y.m_best), x.m_suffix + y.m_prefix);
+  info.m_best = longest(info.m_best, longest(info.m_prefix, info.m_suffix));
+  return info;
+}
+
+literal_info alternate_literal(const literal_info& x, const literal_info& y) {
+  if (x.m_exact_known && y.m_exact_known && x.m_exact == y.m_exact) return x;
+
+  literal_info info;
+
+  std::size_t n = 0;
+  while (n < x.m_prefix.size() && n < y.m_prefix.size() &&
+         x.m_prefix[n] == y.m_prefix[n])
+    ++n;
+  info.m_prefix = x.m_prefix.substr(0, n);
+
+  n = 0;
+  while (n < x.m_suffix.size() && n < y.m_suffix.size() &&
+         x.m_suffix[x.m_suffix.size() - n - 1] ==
+             y.m_suffix[y.m_suffix.size() - n - 1])
+    ++n;
+  info.m_suffix = x.m_suffix.substr(x.m_suffix.size() - n);
+
+  info.m_best = longest(info.m_prefix, info.m_suffix);
+  return info;
+}
+
+literal_info analyze_literal(const regex_node& node, bool nocase) {
+  switch (node.m_kind) {
+    case regex_node::empty:
+    case regex_node::assertion:
+      return exact_literal(std::string());
+    case regex_node::chars: {
+      std::string folded;
+      for (auto i = node.m_chars.begin(); i != node.m_chars.end(); ++i) {
+        char c = nocase ? fold_case(*i) : *i;
+        if (folded.find(c) == std::string::npos) folded += c;
+      }
+      return folded.size() == 1 ? exact_literal(folded) : literal_info();
+    }
+    case regex_node::any:
+      return literal_info();
+    case regex_node::concat: {
+      literal_info info = exact_literal(std::string());
+      for (auto i = node.m_children.begin(); i != node.m_children.end(); ++i)
+        info = concat_literal(info, analyze_literal(*i, nocase));
+      return info;
+    }
+    case regex_node::alternate: {
+      literal_info info = analyze_literal(node.m_children.front(), nocase);
+      for (auto i = node.m_children.begin() + 1; i != node.m_children.end();
+           ++i)
+        info = alternate_literal(info, analyze_literal(*i, nocase));
+      return info;
+    }
+    case regex_node::repeat: {
+      if (node.m_max == 0) return exact_literal(std::string());
+      if (node.m_min == 0) return literal_info();
+
+      literal_info info = analyze_literal(node.m_children.front(), nocase);
+      return node.m_min == 1 && node.m_max == 1 ? info : inexact_literal(info);
+    }
+  }
+
+  return literal_info();
+}
+
+// Whether every match of the node is confined to a single line, and matches
+// the same way when the line is searched on its own.
+bool single_line(const regex_node& node) {
+  switch (node.m_kind) {
+    case regex_node::assertion:
+      // Line anchors and lookarounds could behave differently.
+      return node.m_chars == "b" || node.m_chars == "B";
+    case regex_node::chars:
+      return node.m_chars.find('\n') == std::string::npos;
+    case regex_node::any:
+      return !node.m_newline;
+    default:
+      for (auto i = node.m_children.begin(); i != node.m_children.end(); ++i)
+        if (!single_line(*i)) return false;
+      return true;
+  }
+}
+
+// Appends the one string that the node matches to result. Fails if the node
+// can match more than one string or contains an assertion.
+bool exact_string(const regex_node& node, std::string& result) {
+  switch (node.m_kind) {
+    case regex_node::empty:
+      return true;
+    case regex_node::chars:
+      if (node.m_chars.size() != 1) return false;
+      result += node.m_chars;
+      return true;
+    case regex_node::concat:
+      for (auto i = node.m_children.begin(); i != node.m_children.end(); ++i)
+        if (!exact_string(*i, result)) return false;
+      return true;
+    case regex_node::alternate:
+      return node.m_children.size() == 1 &&
+             exact_string(node.m_children[0], result);
+    case regex_node::repeat:
+      for (unsigned i = 0; i != node.m_min; ++i)
+        if (!exact_string(node.m_children[0], result)) return false;
+      return node.m_min == node.m_max;
+    default:
+      return false;
+  }
+}
+}
+
+regex_node parse_regex(const std::string& expr, bool dot_newline) {
+  return regex_parser(expr, dot_newline).parse();
+}
+
+trigram_query regex_trigram_query(const std::string& expr) {
+  regex_info info;
+  try {
+    info = analyze(parse_regex(expr));
+  }
+  catch (const std::runtime_error&) {
+    return trigram_query(trigram_query::all);
+  }
+
+  if (info.m_exact_known)
+    return std::move(info.m_match) && query_for(info.m_exact);
+
+  return std::move(info.m_match) && query_for(info.m_prefix) &&
+         query_for(info.m_suffix);
+}
+
+std::string required_literal(const std::string& expr, bool nocase,
+                             bool dot_newline) {
+  try {
+    regex_node root = parse_regex(expr, dot_newline);
+    if (!single_line(root)) return std::string();
+
+    return analyze_literal(root, nocase).m_best;
+  }
+  catch (const std::runtime_error&) {
+    return std::string();
+  }
+}
+
+bool literal_regex(const std::string& expr, std::string& literal) {
+  literal.clear();
+  try {
+    return exact_string(parse_regex(expr), literal) && !literal.empty() &&
+           literal.find('\n') == std::string::npos;
+  }
+  catch (const std::runtime_error&) {
+    return false;
+  }
+}
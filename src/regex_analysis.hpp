@@ -0,0 +1,58 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_REGEX_ANALYSIS_HPP
+#define CODEDB_REGEX_ANALYSIS_HPP
+
+#include "trigram.hpp"
+
+#include <string>
+#include <vector>
+
+// A simplified syntax tree for a regex. Only the parts that matter for
+// deciding which strings a match must contain are kept; anything that can't be
+// represented exactly is widened to 'any'.
+struct regex_node {
+  enum kind {
+    empty,      // Matches the empty string
+    assertion,  // Anchors, word boundaries and lookarounds, see m_chars
+    chars,      // Matches one of m_chars
+    any,        // Matches any single character, maybe a newline
+    concat,     // All of m_children in sequence
+    alternate,  // One of m_children
+    repeat      // m_children[0], between m_min and m_max times
+  };
+
+  static const unsigned unbounded = ~0u;
+
+  regex_node(kind k = empty)
+      : m_kind(k), m_newline(true), m_min(0), m_max(0) {}
+
+  kind m_kind;
+  bool m_newline;
+  std::string m_chars;
+  std::vector<regex_node> m_children;
+  unsigned m_min;
+  unsigned m_max;
+};
+
+// Parses an ECMAScript style regex. Throws std::runtime_error when the
+// expression uses a construct that the analysis doesn't understand. Whether '.'
+// matches a newline depends on the regex engine.
+regex_node parse_regex(const std::string& expr, bool dot_newline = true);
+
+// The trigram query that every file containing a match must satisfy. Falls back
+// to a query that matches everything when the regex can't be analyzed.
+trigram_query regex_trigram_query(const std::string& expr);
+
+// A literal string that every match of the regex contains, and that lets a
+// search jump straight to candidate lines. Returns an empty string if there is
+// no such literal or if a match isn't confined to a single line. For case
+// insensitive regexes the literal is folded to lower case.
+std::string required_literal(const std::string& expr, bool nocase,
+                             bool dot_newline);
+
+// Whether the regex matches exactly one non-empty string, within a single
+// line, and nothing else. The string is stored in literal.
+bool literal_regex(const std::string& expr, std::string& literal);
+
+#endif
@@ -42,6 +42,8 @@ class boost_regex : public regex {
     return boost::regex_search(begin, end, m_what, m_regex);
   }
 
+  bool dot_matches_newline() const { return true; }
+
   boost::regex m_regex;
   boost::cmatch m_what;
 };
@@ -2,12 +2,20 @@
 
 #include "search.hpp"
 #include "database.hpp"
-#include "compress.hpp"
+#include "file_set.hpp"
+#include "trigram.hpp"
+#include "token_index.hpp"
 
+#include <algorithm>
 #include <stdexcept>
 #include <cstring>
+#include <cctype>
 
 namespace {
+// Lines that are further apart than this many bytes are located with the line
+// index rather than by counting the newlines in between.
+const std::ptrdiff_t line_index_distance = 4096;
+
 std::size_t count_lines(const char* begin, const char* end,
                         const char*& last_line) {
   std::size_t count = 0;
@@ -26,12 +34,185 @@ std::size_t count_lines(const char* begin, const char* end,
 
   return count;
 }
+
+std::size_t count_newlines(const char* begin, const char* end) {
+  std::size_t count = 0;
+  while ((begin = static_cast<const char*>(
+              std::memchr(begin, char(10), end - begin)))) {
+    ++count;
+    ++begin;
+  }
+  return count;
+}
+
+// A rough guess at how uncommon a character is in source code.
+int rarity(unsigned char c) {
+  if (c == ' ' || c == '\t') return 0;
+  if (c >= 'a' && c <= 'z') return std::strchr("etaoinsr", c) ? 1 : 2;
+  if (std::isdigit(c) || (c && std::strchr("_();,.*", c))) return 3;
+  if (c >= 'A' && c <= 'Z') return 4;
+  return 5;
+}
+
+// Finds a literal by scanning for its rarest character with memchr, which the
+// C libraries implement with vector instructions, and comparing the rest of
+// the literal around each hit.
+class literal_scanner {
+ public:
+  literal_scanner(const std::string& literal, bool nocase)
+      : m_literal(literal), m_nocase(nocase), m_anchor(0) {
+    int best = -1;
+    for (std::size_t i = 0; i != m_literal.size(); ++i) {
+      unsigned char c = m_literal[i];
+      if (m_nocase && std::isalpha(c)) continue;
+      if (rarity(c) > best) {
+        best = rarity(c);
+        m_anchor = i;
+      }
+    }
+  }
+
+  const char* find(const char* begin, const char* end) const {
+    const std::size_t size = m_literal.size();
+    if (std::size_t(end - begin) < size) return 0;
+
+    const char* p = begin + m_anchor;
+    const char* last = end - size + m_anchor;
+
+    while (p <= last) {
+      p = static_cast<const char*>(
+          std::memchr(p, m_literal[m_anchor], last - p + 1));
+      if (!p) return 0;
+
+      const char* candidate = p - m_anchor;
+      if (equal(candidate)) return candidate;
+
+      ++p;
+    }
+
+    return 0;
+  }
+
+ private:
+  bool equal(const char* p) const {
+    if (!m_nocase)
+      return std::memcmp(p, m_literal.c_str(), m_literal.size()) == 0;
+
+    for (std::size_t i = 0; i != m_literal.size(); ++i)
+      if (fold_case(p[i]) != static_cast<unsigned char>(m_literal[i]))
+        return false;
+    return true;
+  }
+
+  const std::string& m_literal;
+  bool m_nocase;
+  std::size_t m_anchor;
+};
+
+// Like search, but only runs the regex on the lines that contain its literal.
+void search_lines(const char* begin, const char* end, regex& re,
+                  match_info& minfo, match_receiver& receiver) {
+  literal_scanner scanner(re.literal(), re.literal_nocase());
+
+  // minfo.m_line is the number of the line that starts at 'counted'.
+  minfo.m_line = 1;
+  const char* counted = begin;
+  const char* search_pos = begin;
+
+  while (const char* hit = scanner.find(search_pos, end)) {
+    const char* line_start = hit;
+    while (line_start != search_pos && line_start[-1] != char(10)) --line_start;
+
+    const char* line_end =
+        static_cast<const char*>(std::memchr(hit, char(10), end - hit));
+    if (!line_end) line_end = end;
+
+    const char* next_line = line_end == end ? end : line_end + 1;
+
+    if (re.search(line_start, line_end)) {
+      if (line_start - counted > line_index_distance && !minfo.m_lines.empty())
+        minfo.m_line = minfo.m_lines.find_line(minfo.m_file_start, line_start,
+                                               minfo.m_line_start);
+      else
+        minfo.m_line += count_newlines(counted, line_start);
+
+      minfo.m_line_start = line_start;
+      minfo.m_line_end = next_line;
+      minfo.m_position = re.what(0).begin();
+
+      search_pos = receiver.on_match(minfo);
+      minfo.m_line++;
+      counted = next_line;
+    } else {
+      search_pos = next_line;
+    }
+
+    if (search_pos >= end) break;
+  }
+}
+
+// Keeps the matches of a file, so that they can be reported more than once.
+class match_buffer : public match_receiver {
+ public:
+  std::vector<match_info> m_matches;
+
+ private:
+  const char* on_match(const match_info& match) {
+    m_matches.push_back(match);
+    return match.m_line_end;
+  }
+};
+
+// Numbers the lines of a later part of a split file as lines of the whole
+// file.
+class line_offset_receiver : public match_receiver {
+ public:
+  line_offset_receiver(std::size_t offset, match_receiver& receiver)
+      : m_offset(offset), m_receiver(receiver) {}
+
+ private:
+  const char* on_match(const match_info& match) {
+    match_info m = match;
+    m.m_line += m_offset;
+    return m_receiver.on_match(m);
+  }
+
+  std::size_t m_offset;
+  match_receiver& m_receiver;
+};
+
+// Whether a file is searched for itself. Aliases are searched through the
+// file that has their contents.
+bool selected_file(const file_set& files, const alias_map& aliases,
+                   regex& file_re, std::size_t chunk, std::size_t index,
+                   const db_file& file) {
+  return files.has_file(chunk, index) && !aliases.find(chunk, index) &&
+         file_re.search(file.m_name_start, file.m_name_end);
+}
+
+// Collects the names of the selected aliases of a file.
+void selected_aliases(const file_set& files, const alias_map& aliases,
+                      regex& file_re, std::size_t chunk, std::size_t index,
+                      std::vector<const char*>& names) {
+  names.clear();
+
+  auto range = aliases.aliases_of(chunk, index);
+  for (const file_alias* i = range.first; i != range.second; ++i)
+    if (files.has_file(i->m_alias.m_chunk, i->m_alias.m_file) &&
+        file_re.search(i->m_name, i->m_name + std::strlen(i->m_name)))
+      names.push_back(i->m_name);
+}
 }
 
 void search(const char* begin, const char* end, regex& re, match_info& minfo,
             match_receiver& receiver) {
   if (begin == end) return;
 
+  if (!re.literal().empty()) {
+    search_lines(begin, end, re, minfo, receiver);
+    return;
+  }
+
   minfo.m_line = 1;
 
   const char* search_pos = begin;
@@ -43,7 +224,13 @@ void search(const char* begin, const char* end, regex& re, match_info& minfo,
 
     if (begin + offset == end) break;
 
-    minfo.m_line += count_lines(search_pos, begin + offset, minfo.m_line_start);
+    if (begin + offset - search_pos > line_index_distance &&
+        !minfo.m_lines.empty())
+      minfo.m_line = minfo.m_lines.find_line(minfo.m_file_start, begin + offset,
+                                             minfo.m_line_start);
+    else
+      minfo.m_line +=
+          count_lines(search_pos, begin + offset, minfo.m_line_start);
     minfo.m_line_end = std::strchr(minfo.m_line_start, 10) + 1;
     minfo.m_position = begin + offset;
 
@@ -54,36 +241,187 @@ void search(const char* begin, const char* end, regex& re, match_info& minfo,
   }
 }
 
-void search_db(database& db, regex& re, regex& file_re, std::size_t prefix_size,
+void search_db(database& db, regex& re, regex& file_re,
+               const trigram_query& query, std::size_t prefix_size,
                match_receiver& receiver) {
-  std::pair<const char*, const char*> compressed;
-  std::string uncompressed;
+  compressed_chunk compressed;
+  chunk_storage storage;
+
+  file_set files = db.select_files(query);
+  alias_map aliases(db);
+
+  std::vector<std::size_t> chunks = selected_chunks(
+      files, aliases, std::make_pair(std::size_t(0), db.chunk_count()));
 
-  db.rewind();
+  for (auto i = chunks.begin(); i != chunks.end(); ++i) {
+    db.get_chunk(*i, compressed);
+    if (!compressed.m_filter.may_match(query)) continue;
 
-  while (db.next_chunk(compressed)) {
-    snappy_uncompress(compressed.first, compressed.second, uncompressed);
+    db_chunk chunk(compressed, storage);
 
-    db_chunk chunk(uncompressed);
+    search_chunk(chunk, *i, re, file_re, files, aliases, prefix_size,
+                 receiver);
+  }
+}
+
+std::vector<std::size_t> selected_chunks(
+    const file_set& files, const alias_map& aliases,
+    std::pair<std::size_t, std::size_t> range) {
+  std::vector<std::size_t> chunks;
+  for (std::size_t i = range.first; i < range.second; ++i)
+    if (files.has_chunk(i)) chunks.push_back(i);
 
-    search_chunk(chunk, re, file_re, prefix_size, receiver);
+  // The contents of an alias may be in a chunk outside the range.
+  const std::vector<file_alias>& all = aliases.aliases();
+  const std::size_t count = chunks.size();
+  for (auto i = all.begin(); i != all.end(); ++i)
+    if (i->m_alias.m_chunk >= range.first &&
+        i->m_alias.m_chunk < range.second &&
+        files.has_file(i->m_alias.m_chunk, i->m_alias.m_file))
+      chunks.push_back(i->m_target.m_chunk);
+
+  if (chunks.size() != count) {
+    std::sort(chunks.begin(), chunks.end());
+    chunks.erase(std::unique(chunks.begin(), chunks.end()), chunks.end());
   }
+
+  return chunks;
 }
 
-void search_chunk(db_chunk& chunk, regex& re, regex& file_re,
-                  std::size_t prefix_size, match_receiver& receiver) {
+void search_chunk(db_chunk& chunk, std::size_t chunk_index, regex& re,
+                  regex& file_re, const file_set& files,
+                  const alias_map& aliases, std::size_t prefix_size,
+                  match_receiver& receiver) {
   match_info minfo;
 
   db_file file;
+  std::vector<const char*> names;
+
+  // Look at the file names first, the file contents are only decompressed if
+  // some file in the chunk is selected.
+  bool selected = false;
+  for (std::size_t index = 0; !selected && chunk.next_file(file); ++index) {
+    selected_aliases(files, aliases, file_re, chunk_index, index, names);
+    selected = !names.empty() || selected_file(files, aliases, file_re,
+                                               chunk_index, index, file);
+  }
+
+  if (!selected) return;
+
+  chunk.load_contents();
+  chunk.rewind();
+
+  match_buffer buffer;
+  for (std::size_t index = 0; chunk.next_file(file); ++index) {
+    const bool own =
+        selected_file(files, aliases, file_re, chunk_index, index, file);
+    selected_aliases(files, aliases, file_re, chunk_index, index, names);
+    if (!own && names.empty()) continue;
+
+    minfo.m_full_file = file.m_name_start;
+    minfo.m_file = minfo.m_full_file + prefix_size;
+    minfo.m_file_start = file.m_start;
+    minfo.m_file_end = file.m_end;
+    minfo.m_lines = file.m_lines;
 
-  while (chunk.next_file(file)) {
-    if (file_re.search(file.m_name_start, file.m_name_end)) {
-      minfo.m_full_file = file.m_name_start;
-      minfo.m_file = minfo.m_full_file + prefix_size;
-      minfo.m_file_start = file.m_start;
-      minfo.m_file_end = file.m_end;
+    if (file.m_first_line != 1) {
+      line_offset_receiver offset(file.m_first_line - 1, receiver);
+      search(file.m_start, file.m_end, re, minfo, offset);
+      continue;
+    }
 
+    if (names.empty()) {
       search(file.m_start, file.m_end, re, minfo, receiver);
+      continue;
+    }
+
+    buffer.m_matches.clear();
+    search(file.m_start, file.m_end, re, minfo, buffer);
+
+    if (own)
+      for (auto m = buffer.m_matches.begin(); m != buffer.m_matches.end(); ++m)
+        receiver.on_match(*m);
+
+    for (auto n = names.begin(); n != names.end(); ++n) {
+      for (auto m = buffer.m_matches.begin(); m != buffer.m_matches.end();
+           ++m) {
+        match_info match = *m;
+        match.m_full_file = *n;
+        match.m_file = *n + prefix_size;
+        receiver.on_match(match);
+      }
+    }
+  }
+}
+
+void search_hits(database& db, const std::vector<token_hit>& hits,
+                 const std::string& token, regex& file_re,
+                 std::size_t prefix_size, match_receiver& receiver) {
+  compressed_chunk compressed;
+  chunk_storage storage, target_storage;
+  match_info minfo;
+  db_file file, target;
+  std::vector<char> selected;
+  alias_map aliases(db);
+
+  for (auto first = hits.begin(); first != hits.end();) {
+    auto last = first;
+    while (last != hits.end() && last->m_chunk == first->m_chunk) ++last;
+
+    db.get_chunk(first->m_chunk, compressed);
+    db_chunk chunk(compressed, storage);
+
+    // Check the file names of the hits before decompressing the contents.
+    selected.clear();
+    bool any = false;
+    auto hit = first;
+    for (std::size_t index = 0; chunk.next_file(file); ++index) {
+      while (hit != last && hit->m_file < index) ++hit;
+      selected.push_back(hit != last && hit->m_file == index &&
+                         file_re.search(file.m_name_start, file.m_name_end));
+      any = any || selected.back();
     }
+
+    if (any) {
+      chunk.load_contents();
+      chunk.rewind();
+
+      auto i = first;
+      for (std::size_t index = 0; i != last && chunk.next_file(file); ++index) {
+        // The lines of an alias are in the file that has its contents.
+        const db_file* body = &file;
+        const file_alias* alias = aliases.find(first->m_chunk, index);
+        if (alias && selected[index] && i->m_file == index &&
+            read_file(db, alias->m_target, target_storage, target))
+          body = &target;
+
+        minfo.m_full_file = file.m_name_start;
+        minfo.m_file = minfo.m_full_file + prefix_size;
+        minfo.m_file_start = body->m_start;
+        minfo.m_file_end = body->m_end;
+        minfo.m_lines = body->m_lines;
+
+        for (; i != last && i->m_file == index; ++i) {
+          if (!selected[index]) continue;
+
+          // Token lines count from the start of the whole file.
+          const char* line_start = body->m_lines.find_start(
+              body->m_start, body->m_end, i->m_line - body->m_first_line + 1);
+          if (line_start == body->m_end) continue;
+
+          const char* eol = static_cast<const char*>(
+              std::memchr(line_start, '\n', body->m_end - line_start));
+          minfo.m_line_start = line_start;
+          minfo.m_line_end = eol ? eol + 1 : body->m_end;
+          minfo.m_line = i->m_line;
+          minfo.m_position = std::search(line_start, minfo.m_line_end,
+                                         token.begin(), token.end());
+
+          receiver.on_match(minfo);
+        }
+      }
+    }
+
+    first = last;
   }
 }
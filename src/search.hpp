@@ -5,9 +5,18 @@
 
 #include "nsalias.hpp"
 #include "regex.hpp"
+#include "line_index.hpp"
 
+#include <string>
+#include <utility>
+#include <vector>
+
+class alias_map;
 class database;
 class db_chunk;
+class file_set;
+class trigram_query;
+struct token_hit;
 
 struct match_info {
   const char* m_file;
@@ -18,6 +27,7 @@ struct match_info {
   const char* m_line_end;
   const char* m_position;
   std::size_t m_line;
+  line_index m_lines;
 };
 
 class match_receiver {
@@ -32,12 +42,32 @@ class match_receiver {
 void search(const char* begin, const char* end, regex& re, match_info& minfo,
             match_receiver& receiver);
 
-// Search an entire db. Only files that match the file_re will be considered.
-void search_db(database& db, regex& re, regex& file_re, std::size_t prefix_size,
+// Search an entire db. Only files that may satisfy the trigram query of the
+// regex and match the file_re will be considered.
+void search_db(database& db, regex& re, regex& file_re,
+               const trigram_query& query, std::size_t prefix_size,
                match_receiver& receiver);
 
-// Search all files in a database chunk
-void search_chunk(db_chunk& chunk, regex& re, regex& file_re,
-                  std::size_t prefix_size, match_receiver& receiver);
+// The chunks in [range.first, range.second) with files in the set, and the
+// chunks with the contents of aliases in the set, in order.
+std::vector<std::size_t> selected_chunks(
+    const file_set& files, const alias_map& aliases,
+    std::pair<std::size_t, std::size_t> range);
+
+// Search all files in a database chunk. The chunk index is used to look up the
+// chunk's files in the file set. A file with aliases is searched once, and its
+// matches are reported for the file and then for each selected alias.
+void search_chunk(db_chunk& chunk, std::size_t chunk_index, regex& re,
+                  regex& file_re, const file_set& files,
+                  const alias_map& aliases, std::size_t prefix_size,
+                  match_receiver& receiver);
+
+// Reports the lines of token index hits, which must be in database order. Only
+// the chunks with hits in files that match the file_re are decompressed, and
+// the lines are found without running a regex. The match position is the
+// first occurrence of the token on the line.
+void search_hits(database& db, const std::vector<token_hit>& hits,
+                 const std::string& token, regex& file_re,
+                 std::size_t prefix_size, match_receiver& receiver);
 
 #endif
@@ -14,10 +14,26 @@ inline db_uint read_binary(const std::string& src, std::size_t index) {
   return result;
 }
 
+inline db_uint read_binary(const char* src) {
+  db_uint result;
+  std::memcpy(&result, src, sizeof(result));
+  return result;
+}
+
+inline std::uint64_t read_binary64(const char* src) {
+  std::uint64_t result;
+  std::memcpy(&result, src, sizeof(result));
+  return result;
+}
+
 inline void write_binary(std::ostream& dest, db_uint value) {
   dest.write(reinterpret_cast<const char*>(&value), sizeof(value));
 }
 
+inline void write_binary64(std::ostream& dest, std::uint64_t value) {
+  dest.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
 inline void write_binary(std::string& dest, db_uint value) {
   const char* ptr = reinterpret_cast<const char*>(&value);
   dest.append(ptr, ptr + sizeof(value));
@@ -27,3 +43,20 @@ inline void write_binary_at(std::string& dest, std::size_t index,
                             db_uint value) {
   std::memcpy(&dest[index], &value, sizeof(value));
 }
+
+inline void write_varint(std::string& dest, std::uint64_t value) {
+  while (value >= 0x80) {
+    dest += static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  dest += static_cast<char>(value);
+}
+
+inline std::uint64_t read_varint(const char*& src) {
+  std::uint64_t result = 0;
+  for (int shift = 0;; shift += 7) {
+    unsigned char byte = static_cast<unsigned char>(*src++);
+    result |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) return result;
+  }
+}
@@ -3,13 +3,14 @@
 #include "serve.hpp"
 #include "serve_init.hpp"
 #include "serve_util.hpp"
-#include "compress.hpp"
 #include "config.hpp"
 #include "regex.hpp"
-#include "file_lock.hpp"
 #include "database.hpp"
+#include "file_lock.hpp"
 #include "search.hpp"
 #include "httpd.hpp"
+#include "regex_analysis.hpp"
+#include "token_index.hpp"
 
 #include <boost/algorithm/string/case_conv.hpp>
 
@@ -37,27 +38,6 @@ std::string header(const std::string& search_string) {
 
 std::string footer() { return "</div>"; }
 
-bool find_by_name(database& db, db_file& result, const std::string& file_name,
-                  std::string& storage) {
-  std::pair<const char*, const char*> compressed;
-
-  db.rewind();
-  while (db.next_chunk(compressed)) {
-    snappy_uncompress(compressed.first, compressed.second, storage);
-    db_chunk chunk(storage);
-
-    db_file file;
-    while (chunk.next_file(file)) {
-      if (file_name == file.m_name_start) {
-        result = file;
-        return true;
-      }
-    }
-  }
-
-  return false;
-}
-
 class collecting_receiver : public match_receiver {
  public:
   struct file {
@@ -92,8 +72,8 @@ std::vector<std::string> handle_view(database& db, const http_query& q) {
   std::string file_name = get_arg(q, "f");
 
   db_file f;
-  std::string file_storage;
-  if (!find_by_name(db, f, file_name, file_storage))
+  chunk_storage file_storage;
+  if (!db.find_file(file_name, file_storage, f))
     throw std::runtime_error("File <b>" + html_escape(file_name) +
                              "</b> not found");
 
@@ -101,6 +81,7 @@ std::vector<std::string> handle_view(database& db, const http_query& q) {
 
   match_info minfo;
   minfo.m_file_start = f.m_start;
+  minfo.m_lines = f.m_lines;
 
   line_receiver lines;
 
@@ -114,7 +95,9 @@ std::vector<std::string> handle_view(database& db, const http_query& q) {
      << "</caption>"
         "<tr><td class=\"lines\"><pre>";
 
-  std::size_t linecount = std::count(f.m_start, f.m_end, char(10));
+  std::size_t linecount = f.m_lines.empty()
+                              ? std::count(f.m_start, f.m_end, char(10))
+                              : f.m_lines.line_count();
   for (std::size_t i = 1; i <= linecount; ++i) os << i << '\n';
 
   os << "</pre></td><td class=\"text\"><pre>";
@@ -145,10 +128,22 @@ std::vector<std::string> handle_search(database& db, const http_query& q) {
 
   std::string search_string = get_arg(q, "q");
 
-  regex_ptr re = compile_regex(search_string);
   regex_ptr file_re = compile_regex("");
 
-  search_db(db, *re, *file_re, 0, recevier);
+  // An identifier is found on the lines of every token that contains it, so
+  // the token index gives the same hits as searching the contents.
+  std::string literal;
+  if (db.has_token_index() && is_token(search_string)) {
+    std::vector<token_hit> hits;
+    db.find_token(search_string, false, hits);
+    search_hits(db, hits, search_string, *file_re, 0, recevier);
+  } else if (db.has_suffix_array() && literal_regex(search_string, literal)) {
+    db.search_literal(literal, *file_re, 0, recevier);
+  } else {
+    regex_ptr re = compile_regex(search_string);
+    search_db(db, *re, *file_re, regex_trigram_query(search_string), 0,
+              recevier);
+  }
 
   std::ostringstream os;
 
@@ -204,6 +199,21 @@ std::vector<std::string> handler(database& db, const bfs::path& doc_root,
     return serve_page(os.str());
   }
 }
+
+// Names what open_database would open now. It changes when a build switches
+// to a new generation of the database or adds a segment to it.
+std::string database_version(const bfs::path& blob) {
+  const bfs::path generation = current_generation(blob);
+
+  std::string version = generation.string();
+  if (bfs::exists(segment_list_path(generation))) {
+    std::vector<bfs::path> segments = read_segment_list(generation);
+    for (auto i = segments.begin(); i != segments.end(); ++i)
+      version += "\n" + i->string();
+  }
+
+  return version;
+}
 }
 
 void serve(const bfs::path& cdb_path, const options& opt) {
@@ -211,17 +221,36 @@ void serve(const bfs::path& cdb_path, const options& opt) {
 
   serve_init(cdb_path / "www");
 
-  file_lock lock(cdb_path / "lock");
-  lock.lock_sharable();
-
-  database_ptr db = open_database(cdb_path / "db");
+  const bfs::path blob = cdb_path / "db";
+  std::string version = database_version(blob);
+  database_ptr db = open_database(blob);
 
   bas::io_service iosvc;
 
   bfs::path docroot = cdb_path / "www";
   httpd server(
       iosvc, "0.0.0.0", cfg.get_value("serve-port"),
-      [&](const http_request& req) { return handler(*db, docroot, req); });
+      [&](const http_request& req) {
+        // Builds that yield to serve wait while the lock is held.
+        file_lock busy(cdb_path / "serve.lock");
+        busy.lock_sharable();
+
+        // Requests are served from the database that was current when they
+        // came in. If it can't be opened, the previous one is used until the
+        // next request.
+        try {
+          std::string latest = database_version(blob);
+          if (latest != version) {
+            db = open_database(blob);
+            version = latest;
+          }
+        }
+        catch (const std::exception& e) {
+          std::cerr << "Error: " << e.what() << std::endl;
+        }
+
+        return handler(*db, docroot, req);
+      });
 
   std::cout << "CodeDB serving" << std::endl;
   iosvc.run();
@@ -0,0 +1,31 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "show.hpp"
+#include "options.hpp"
+#include "database.hpp"
+
+#include <iostream>
+
+void show(const bfs::path& cdb_path, const options& opt) {
+  const bfs::path cdb_root = cdb_path.parent_path();
+
+  // Paths are given relative to the working directory but stored relative to
+  // the root of the code db.
+  std::string root = cdb_root.generic_string() + "/";
+  std::string name = bfs::absolute(opt.m_args[0], bfs::initial_path())
+                         .lexically_normal()
+                         .generic_string();
+
+  if (name.compare(0, root.size(), root) != 0)
+    throw std::runtime_error(opt.m_args[0] + " is outside of the code db");
+  name.erase(0, root.size());
+
+  database_ptr db = open_database(cdb_path / "db");
+
+  chunk_storage storage;
+  db_file file;
+  if (!db->find_file(name, storage, file))
+    throw std::runtime_error(name + " not found");
+
+  std::cout.write(file.m_start, file.m_end - file.m_start);
+}
@@ -0,0 +1,14 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_SHOW_HPP
+#define CODEDB_SHOW_HPP
+
+#include "nsalias.hpp"
+
+#include <boost/filesystem.hpp>
+
+struct options;
+
+void show(const bfs::path& cdb_path, const options& opt);
+
+#endif
@@ -0,0 +1,238 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "stats.hpp"
+#include "options.hpp"
+#include "database.hpp"
+#include "trigram.hpp"
+
+#include <boost/filesystem/operations.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+const std::size_t largest_file_count = 10;
+const std::size_t largest_dir_count = 20;
+
+struct stored_file {
+  std::uint64_t m_size;
+  std::string m_name;
+};
+
+typedef std::pair<std::size_t, std::size_t> location;
+
+struct file_total {
+  file_total() : m_size(0), m_lines(0) {}
+
+  std::uint64_t m_size;
+  std::uint64_t m_lines;
+};
+
+struct dir_footprint {
+  dir_footprint() : m_files(0), m_size(0) {}
+
+  std::size_t m_files;
+  std::uint64_t m_size;
+};
+
+std::string format_size(std::uint64_t bytes) {
+  const char* const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+
+  double size = static_cast<double>(bytes);
+  std::size_t unit = 0;
+  while (size >= 1024 && unit != 4) {
+    size /= 1024;
+    ++unit;
+  }
+
+  std::ostringstream result;
+  result << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << size << ' '
+         << units[unit];
+  return result.str();
+}
+
+// The directory below the root that a file is in, or "." for the files in
+// the root itself.
+std::string top_dir(const std::string& name) {
+  const std::size_t slash = name.find('/');
+  return slash == std::string::npos ? "." : name.substr(0, slash);
+}
+}
+
+void print_chunk_sizes(database& db) {
+  std::vector<std::uint64_t> sizes;
+  for (std::size_t c = 0; c != db.chunk_count(); ++c)
+    sizes.push_back(db.get_chunk_info(c).m_uncompressed_size);
+  if (sizes.empty()) return;
+
+  std::sort(sizes.begin(), sizes.end());
+  std::cout << sizes.size() << " chunks, median "
+            << sizes[sizes.size() / 2] / 1024 << " KiB, largest "
+            << sizes.back() / 1024 << " KiB\n";
+
+  std::uint64_t limit = 1024;
+  for (auto i = sizes.begin(); i != sizes.end(); limit *= 2) {
+    std::size_t count = 0;
+    for (; i != sizes.end() && *i <= limit; ++i) ++count;
+    if (count)
+      std::cout << "  up to " << limit / 1024 << " KiB: " << count << '\n';
+  }
+}
+
+void stats(const bfs::path& cdb_path, const options&) {
+  const bfs::path blob = cdb_path / "db";
+  const bfs::path generation = current_generation(blob);
+  database_ptr db = open_database(blob);
+
+  // Files that a later segment replaced or deleted are left out, as they are
+  // from searches.
+  const file_set visible = db->select_files(trigram_query());
+
+  // An alias has no contents of its own and counts with the size and lines of
+  // its target. A later segment may have hidden the target, then the first
+  // alias of it counts as the stored copy, as it is once the segments are
+  // compacted.
+  std::vector<file_alias> all_aliases;
+  db->get_aliases(all_aliases);
+  std::map<location, location> alias_targets;
+  std::map<location, file_total> targets;
+  for (auto i = all_aliases.begin(); i != all_aliases.end(); ++i) {
+    if (!visible.has_file(i->m_alias.m_chunk, i->m_alias.m_file)) continue;
+
+    const location target(i->m_target.m_chunk, i->m_target.m_file);
+    alias_targets[location(i->m_alias.m_chunk, i->m_alias.m_file)] = target;
+    targets[target] = file_total();
+  }
+
+  // The contents are decompressed for the sizes of the files. The later parts
+  // of a split file are added to the first one.
+  std::vector<stored_file> files;
+  std::vector<std::pair<std::size_t, location>> alias_files;
+  std::uint64_t stored = 0, compressed = 0, lines = 0;
+  std::size_t parts = 0;
+
+  chunk_storage storage;
+  compressed_chunk data;
+  db_file file;
+  file_total* target = 0;
+  for (std::size_t c = 0; c != db->chunk_count(); ++c) {
+    const bool shown = visible.has_chunk(c);
+    auto next_target = targets.lower_bound(location(c, 0));
+    if (!shown && !target &&
+        (next_target == targets.end() || next_target->first.first != c))
+      continue;
+
+    db->get_chunk(c, data);
+    if (shown)
+      compressed += (data.m_meta_end - data.m_meta_start) +
+                    (data.m_end - data.m_start) + data.m_filter.size();
+
+    db_chunk chunk(data, storage);
+    chunk.load_contents();
+    for (std::size_t f = 0; chunk.next_file(file); ++f) {
+      const std::uint64_t size = file.m_end - file.m_start;
+
+      if (file.m_first_line == 1) {
+        auto t = targets.find(location(c, f));
+        target = t == targets.end() ? 0 : &t->second;
+      }
+      if (target) {
+        target->m_size += size;
+        target->m_lines += file.m_lines.line_count();
+      }
+
+      if (!visible.has_file(c, f)) continue;
+
+      if (file.m_first_line != 1 && !files.empty()) {
+        stored += size;
+        lines += file.m_lines.line_count();
+        files.back().m_size += size;
+        ++parts;
+        continue;
+      }
+
+      stored_file sf = {size, std::string(file.m_name_start, file.m_name_end)};
+      auto alias = alias_targets.find(location(c, f));
+      if (alias != alias_targets.end()) {
+        alias_files.push_back(std::make_pair(files.size(), alias->second));
+      } else {
+        stored += size;
+        lines += file.m_lines.line_count();
+      }
+      files.push_back(sf);
+    }
+  }
+
+  std::size_t aliases = 0;
+  std::set<location> promoted;
+  for (auto i = alias_files.begin(); i != alias_files.end(); ++i) {
+    const file_total& total = targets[i->second];
+    files[i->first].m_size = total.m_size;
+    lines += total.m_lines;
+
+    if (!visible.has_file(i->second.first, i->second.second) &&
+        promoted.insert(i->second).second)
+      stored += total.m_size;
+    else
+      ++aliases;
+  }
+
+  std::size_t segments = 0;
+  if (bfs::exists(segment_list_path(generation)))
+    segments = read_segment_list(generation).size();
+
+  std::cout << "generation   " << generation.filename().string() << '\n'
+            << "segments     " << segments << '\n'
+            << "files        " << files.size() << " (" << aliases
+            << " aliases, " << parts << " extra parts of split files)\n"
+            << "lines        " << lines << '\n'
+            << "stored       " << format_size(stored) << '\n'
+            << "compressed   " << format_size(compressed);
+  if (stored != 0)
+    std::cout << " (" << std::fixed << std::setprecision(1)
+              << 100.0 * compressed / stored << "%)";
+  std::cout << "\n\n";
+
+  print_chunk_sizes(*db);
+
+  std::map<std::string, dir_footprint> dirs;
+  for (auto i = files.begin(); i != files.end(); ++i) {
+    dir_footprint& dir = dirs[top_dir(i->m_name)];
+    dir.m_files++;
+    dir.m_size += i->m_size;
+  }
+
+  const std::size_t largest = std::min(largest_file_count, files.size());
+  std::partial_sort(files.begin(), files.begin() + largest, files.end(),
+                    [](const stored_file& a, const stored_file& b) {
+    return a.m_size > b.m_size;
+  });
+
+  std::cout << "\nlargest files\n";
+  for (std::size_t i = 0; i != largest; ++i)
+    std::cout << std::setw(12) << format_size(files[i].m_size) << "  "
+              << files[i].m_name << '\n';
+
+  std::vector<std::pair<std::string, dir_footprint>> by_size(dirs.begin(),
+                                                             dirs.end());
+  std::sort(by_size.begin(), by_size.end(),
+            [](const std::pair<std::string, dir_footprint>& a,
+               const std::pair<std::string, dir_footprint>& b) {
+    return a.second.m_size > b.second.m_size;
+  });
+
+  std::cout << "\ndirectories\n";
+  for (std::size_t i = 0; i != by_size.size() && i != largest_dir_count; ++i)
+    std::cout << std::setw(12) << format_size(by_size[i].second.m_size)
+              << std::setw(9) << by_size[i].second.m_files << " files  "
+              << by_size[i].first << '\n';
+  if (by_size.size() > largest_dir_count)
+    std::cout << "  and " << by_size.size() - largest_dir_count
+              << " more\n";
+}
@@ -0,0 +1,18 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_STATS_HPP
+#define CODEDB_STATS_HPP
+
+#include "nsalias.hpp"
+
+#include <boost/filesystem.hpp>
+
+struct options;
+class database;
+
+void stats(const bfs::path& cdb_path, const options& opt);
+
+// Prints how large the chunks are before compression, in powers of two.
+void print_chunk_sizes(database& db);
+
+#endif
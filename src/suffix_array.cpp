@@ -0,0 +1,255 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "suffix_array.hpp"
+#include "line_index.hpp"
+#include "search.hpp"
+#include "regex.hpp"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+
+namespace {
+const db_uint line_sample_interval = 64;
+const std::size_t header_size = 4 + sizeof(db_uint) * 5;
+
+void write_array(std::ostream& out, const std::vector<db_uint>& values) {
+  out.write(reinterpret_cast<const char*>(values.data()),
+            values.size() * sizeof(db_uint));
+}
+
+// Sorts the suffixes of text by prefix doubling. After each round the
+// suffixes are sorted by their first 2k characters, using a radix sort on the
+// ranks from the round before.
+void sort_suffixes(const std::string& text, std::vector<db_uint>& suffixes) {
+  const db_uint size = static_cast<db_uint>(text.size());
+  suffixes.resize(size);
+  if (size == 0) return;
+
+  std::vector<db_uint> rank(size), next(size), counts(256);
+  for (db_uint i = 0; i != size; ++i)
+    counts[static_cast<unsigned char>(text[i])]++;
+  for (db_uint c = 0, sum = 0; c != 256; ++c) {
+    db_uint count = counts[c];
+    counts[c] = sum;
+    sum += count;
+  }
+  for (db_uint i = 0; i != size; ++i)
+    suffixes[counts[static_cast<unsigned char>(text[i])]++] = i;
+
+  db_uint classes = 0;
+  for (db_uint i = 0; i != size; ++i) {
+    if (i != 0 && text[suffixes[i]] != text[suffixes[i - 1]]) ++classes;
+    rank[suffixes[i]] = classes;
+  }
+  ++classes;
+
+  for (db_uint k = 1; classes != size && k < size; k *= 2) {
+    // Order by the rank k characters in. Suffixes that end within k
+    // characters come first.
+    db_uint n = 0;
+    for (db_uint i = size - k; i != size; ++i) next[n++] = i;
+    for (db_uint i = 0; i != size; ++i)
+      if (suffixes[i] >= k) next[n++] = suffixes[i] - k;
+
+    // Then stable sort by the rank of the first k characters.
+    counts.assign(classes + 1, 0);
+    for (db_uint i = 0; i != size; ++i) counts[rank[i] + 1]++;
+    for (db_uint c = 1; c <= classes; ++c) counts[c] += counts[c - 1];
+    for (db_uint i = 0; i != size; ++i)
+      suffixes[counts[rank[next[i]]]++] = next[i];
+
+    auto second = [&](db_uint i) { return i + k < size ? rank[i + k] + 1 : 0; };
+
+    classes = 0;
+    next[suffixes[0]] = 0;
+    for (db_uint i = 1; i != size; ++i) {
+      db_uint a = suffixes[i - 1], b = suffixes[i];
+      if (rank[a] != rank[b] || second(a) != second(b)) ++classes;
+      next[b] = classes;
+    }
+    ++classes;
+
+    rank.swap(next);
+  }
+}
+}
+
+suffix_array_writer::suffix_array_writer() : m_lines(0), m_chunk_count(0) {
+  m_file_starts.push_back(0);
+}
+
+void suffix_array_writer::add_file(const std::string& name, const char* begin,
+                                   const char* end) {
+  m_file_starts.push_back(0);
+  m_name_offsets.push_back(static_cast<db_uint>(m_names.size()));
+  m_names += name;
+  m_names += '\0';
+
+  extend_file(begin, end);
+}
+
+void suffix_array_writer::extend_file(const char* begin, const char* end) {
+  const std::size_t start = m_text.size();
+  m_text.append(begin, end);
+
+  for (std::size_t i = start; i != m_text.size(); ++i) {
+    if (m_text[i] == '\n' && ++m_lines % line_sample_interval == 0)
+      m_line_samples.push_back(static_cast<db_uint>(i + 1));
+  }
+
+  m_file_starts.back() = static_cast<db_uint>(m_text.size());
+}
+
+void suffix_array_writer::end_chunk() { m_chunk_count++; }
+
+bool suffix_array_writer::write(const bfs::path& path) const {
+  if (m_text.size() >= 0xffffffffu) return false;
+
+  std::vector<db_uint> suffixes;
+  sort_suffixes(m_text, suffixes);
+
+  bfs::ofstream out(path, bfs::ofstream::binary);
+  if (!out.is_open())
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for writing");
+
+  out.write("SFX1", 4);
+  write_binary(out, m_chunk_count);
+  write_binary(out, static_cast<db_uint>(m_name_offsets.size()));
+  write_binary(out, static_cast<db_uint>(m_text.size()));
+  write_binary(out, static_cast<db_uint>(m_line_samples.size()));
+  write_binary(out, static_cast<db_uint>(m_names.size()));
+
+  write_array(out, m_file_starts);
+  write_array(out, m_name_offsets);
+  write_array(out, m_line_samples);
+  out.write(m_names.c_str(), m_names.size());
+  out.write(m_text.c_str(), m_text.size());
+  write_array(out, suffixes);
+
+  return true;
+}
+
+suffix_array::suffix_array(const bfs::path& path)
+    : m_mapping(path.string().c_str(), bip::read_only),
+      m_region(m_mapping, bip::read_only),
+      m_data(static_cast<const char*>(m_region.get_address())) {
+  const std::size_t size = m_region.get_size();
+
+  if (size < header_size || std::memcmp(m_data, "SFX1", 4) != 0)
+    throw std::runtime_error("Suffix array " + path.string() +
+                             " is not valid");
+
+  const char* p = m_data + 4;
+  m_chunk_count = read_binary(p);
+  m_file_count = read_binary(p + sizeof(db_uint));
+  m_text_size = read_binary(p + sizeof(db_uint) * 2);
+  m_sample_count = read_binary(p + sizeof(db_uint) * 3);
+  db_uint names_size = read_binary(p + sizeof(db_uint) * 4);
+
+  m_file_starts = m_data + header_size;
+  m_name_offsets = m_file_starts + (m_file_count + 1) * sizeof(db_uint);
+  m_line_samples = m_name_offsets + m_file_count * sizeof(db_uint);
+  m_names = m_line_samples + m_sample_count * sizeof(db_uint);
+  m_text = m_names + names_size;
+  m_suffixes = m_text + m_text_size;
+
+  if (std::size_t(m_suffixes - m_data) + std::size_t(m_text_size) * 4 > size)
+    throw std::runtime_error("Suffix array " + path.string() +
+                             " is not valid");
+}
+
+void suffix_array::search(const std::string& literal, regex& file_re,
+                          std::size_t prefix_size,
+                          match_receiver& receiver) const {
+  // The suffixes that start with the literal form a contiguous range.
+  db_uint lo = 0, hi = m_text_size;
+  while (lo < hi) {
+    db_uint mid = lo + (hi - lo) / 2;
+    if (compare(mid, literal) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  const db_uint first = lo;
+  hi = m_text_size;
+  while (lo < hi) {
+    db_uint mid = lo + (hi - lo) / 2;
+    if (compare(mid, literal) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  std::vector<db_uint> positions;
+  positions.reserve(lo - first);
+  for (db_uint i = first; i != lo; ++i) positions.push_back(suffix(i));
+  std::sort(positions.begin(), positions.end());
+
+  // Line numbers are counted over the whole text, and made relative to the
+  // first line of each file.
+  line_index lines(line_sample_interval, 0, m_sample_count, m_line_samples);
+
+  match_info minfo;
+  db_uint file = m_file_count;
+  bool selected = false;
+  std::size_t first_line = 0;
+  const char* resume = m_text;
+
+  for (auto i = positions.begin(); i != positions.end(); ++i) {
+    const char* pos = m_text + *i;
+    if (pos < resume) continue;
+
+    if (file == m_file_count || *i >= file_start(file + 1)) {
+      db_uint flo = 0, fhi = m_file_count;
+      while (flo < fhi) {
+        db_uint mid = flo + (fhi - flo) / 2;
+        if (file_start(mid + 1) <= *i)
+          flo = mid + 1;
+        else
+          fhi = mid;
+      }
+      file = flo;
+
+      const char* name =
+          m_names + read_binary(m_name_offsets + file * sizeof(db_uint));
+      selected = file_re.search(name, name + std::strlen(name));
+
+      minfo.m_full_file = name;
+      minfo.m_file = name + prefix_size;
+      minfo.m_file_start = m_text + file_start(file);
+      minfo.m_file_end = m_text + file_start(file + 1);
+
+      const char* line_start;
+      first_line = lines.find_line(m_text, minfo.m_file_start, line_start);
+    }
+
+    // Occurrences that run into the next file aren't matches.
+    if (!selected || literal.size() > std::size_t(minfo.m_file_end - pos))
+      continue;
+
+    minfo.m_line =
+        lines.find_line(m_text, pos, minfo.m_line_start) - first_line + 1;
+
+    const char* eol = static_cast<const char*>(
+        std::memchr(pos, '\n', minfo.m_file_end - pos));
+    minfo.m_line_end = eol ? eol + 1 : minfo.m_file_end;
+    minfo.m_position = pos;
+
+    resume = receiver.on_match(minfo);
+  }
+}
+
+int suffix_array::compare(db_uint index, const std::string& literal) const {
+  db_uint pos = suffix(index);
+  std::size_t size = std::min<std::size_t>(literal.size(), m_text_size - pos);
+
+  int result = std::memcmp(m_text + pos, literal.c_str(), size);
+  if (result != 0) return result;
+
+  return size < literal.size() ? -1 : 0;
+}
@@ -0,0 +1,86 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_SUFFIX_ARRAY_HPP
+#define CODEDB_SUFFIX_ARRAY_HPP
+
+#include "nsalias.hpp"
+#include "serialization.hpp"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <string>
+#include <vector>
+
+class regex;
+class match_receiver;
+
+// Collects the contents of a database for a suffix array. Files must be added
+// in database order and end_chunk called after the last file of each chunk.
+class suffix_array_writer {
+ public:
+  suffix_array_writer();
+
+  void add_file(const std::string& name, const char* begin, const char* end);
+  void end_chunk();
+
+  // Appends to the last file, which makes the parts of a split file one file
+  // here.
+  void extend_file(const char* begin, const char* end);
+
+  // Sorts the suffixes and writes the index. Returns false, without writing
+  // anything, if there is too much text to index with 32 bit positions.
+  bool write(const bfs::path& path) const;
+
+ private:
+  std::string m_text;
+  std::string m_names;
+  std::vector<db_uint> m_file_starts;
+  std::vector<db_uint> m_name_offsets;
+  std::vector<db_uint> m_line_samples;
+  db_uint m_lines;
+  db_uint m_chunk_count;
+};
+
+// A suffix array over the concatenated contents of every file in a database,
+// stored together with the text itself. All occurrences of a string are found
+// with a binary search, without decompressing anything.
+class suffix_array {
+ public:
+  suffix_array(const bfs::path& path);
+
+  std::size_t chunk_count() const { return m_chunk_count; }
+
+  // Reports every line that contains the literal, in database order, for the
+  // files whose names match file_re.
+  void search(const std::string& literal, regex& file_re,
+              std::size_t prefix_size, match_receiver& receiver) const;
+
+ private:
+  db_uint suffix(db_uint index) const {
+    return read_binary(m_suffixes + index * sizeof(db_uint));
+  }
+
+  db_uint file_start(db_uint index) const {
+    return read_binary(m_file_starts + index * sizeof(db_uint));
+  }
+
+  int compare(db_uint index, const std::string& literal) const;
+
+  bip::file_mapping m_mapping;
+  bip::mapped_region m_region;
+  const char* m_data;
+  db_uint m_chunk_count;
+  db_uint m_file_count;
+  db_uint m_text_size;
+  db_uint m_sample_count;
+  const char* m_file_starts;
+  const char* m_name_offsets;
+  const char* m_names;
+  const char* m_line_samples;
+  const char* m_text;
+  const char* m_suffixes;
+};
+
+#endif
@@ -0,0 +1,198 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "token_index.hpp"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+
+namespace {
+const std::size_t table_entry_size = sizeof(db_uint) * 3;
+}
+
+bool is_token(const std::string& str) {
+  return !str.empty() && std::all_of(str.begin(), str.end(), is_token_char);
+}
+
+token_index_writer::token_index_writer() : m_file_count(0) {
+  m_chunk_starts.push_back(0);
+}
+
+void token_index_writer::add_file(const char* begin, const char* end,
+                                  db_uint first_line) {
+  const db_uint file = m_file_count++;
+
+  db_uint line = first_line;
+  std::string token;
+  for (const char* p = begin; p != end;) {
+    if (*p == '\n') {
+      ++line;
+      ++p;
+      continue;
+    }
+
+    if (!is_token_char(*p)) {
+      ++p;
+      continue;
+    }
+
+    const char* start = p;
+    while (p != end && is_token_char(*p)) ++p;
+    token.assign(start, p);
+
+    // A line is only listed once, however many times the token occurs on it.
+    // The line number is delta coded within a file.
+    posting_list& pl = m_postings[token];
+    if (pl.m_count != 0 && pl.m_file == file && pl.m_line == line) continue;
+
+    if (pl.m_count == 0 || pl.m_file != file) {
+      write_varint(pl.m_data, file - pl.m_file);
+      write_varint(pl.m_data, line);
+    } else {
+      write_varint(pl.m_data, 0);
+      write_varint(pl.m_data, line - pl.m_line);
+    }
+
+    pl.m_file = file;
+    pl.m_line = line;
+    pl.m_count++;
+  }
+}
+
+void token_index_writer::end_chunk() { m_chunk_starts.push_back(m_file_count); }
+
+void token_index_writer::write(const bfs::path& path) const {
+  bfs::ofstream out(path, bfs::ofstream::binary);
+  if (!out.is_open())
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for writing");
+
+  std::vector<const std::string*> tokens;
+  tokens.reserve(m_postings.size());
+  for (auto i = m_postings.begin(); i != m_postings.end(); ++i)
+    tokens.push_back(&i->first);
+  std::sort(tokens.begin(), tokens.end(),
+            [](const std::string* a, const std::string* b) { return *a < *b; });
+
+  out.write("TOK1", 4);
+  write_binary(out, static_cast<db_uint>(m_chunk_starts.size() - 1));
+  write_binary(out, m_file_count);
+  for (auto i = m_chunk_starts.begin(); i != m_chunk_starts.end(); ++i)
+    write_binary(out, *i);
+
+  // [{name-offset, postings-offset, postings-count}]
+  write_binary(out, static_cast<db_uint>(tokens.size()));
+  db_uint name_offset = 0, offset = 0;
+  for (auto i = tokens.begin(); i != tokens.end(); ++i) {
+    const posting_list& p = m_postings.find(**i)->second;
+    write_binary(out, name_offset);
+    write_binary(out, offset);
+    write_binary(out, p.m_count);
+    name_offset += static_cast<db_uint>((*i)->size() + 1);
+    offset += static_cast<db_uint>(p.m_data.size());
+  }
+
+  // [names-size][names\0][{file-delta, line}]
+  write_binary(out, name_offset);
+  for (auto i = tokens.begin(); i != tokens.end(); ++i)
+    out.write((*i)->c_str(), (*i)->size() + 1);
+
+  for (auto i = tokens.begin(); i != tokens.end(); ++i) {
+    const std::string& data = m_postings.find(**i)->second.m_data;
+    out.write(data.c_str(), data.size());
+  }
+}
+
+token_index::token_index(const bfs::path& path)
+    : m_mapping(path.string().c_str(), bip::read_only),
+      m_region(m_mapping, bip::read_only),
+      m_data(static_cast<const char*>(m_region.get_address())) {
+  const std::size_t size = m_region.get_size();
+  const std::size_t header_size = 4 + sizeof(db_uint) * 2;
+
+  if (size < header_size || std::memcmp(m_data, "TOK1", 4) != 0)
+    throw std::runtime_error("Token index " + path.string() + " is not valid");
+
+  m_chunk_count = read_binary(m_data + 4);
+  m_file_count = read_binary(m_data + 4 + sizeof(db_uint));
+  m_chunk_starts = m_data + header_size;
+
+  const char* p = m_chunk_starts + (m_chunk_count + 1) * sizeof(db_uint);
+  if (p + sizeof(db_uint) > m_data + size)
+    throw std::runtime_error("Token index " + path.string() + " is not valid");
+
+  m_token_count = read_binary(p);
+  m_table = p + sizeof(db_uint);
+
+  p = m_table + m_token_count * table_entry_size;
+  if (p + sizeof(db_uint) > m_data + size)
+    throw std::runtime_error("Token index " + path.string() + " is not valid");
+
+  m_names = p + sizeof(db_uint);
+  m_postings = m_names + read_binary(p);
+
+  if (m_postings > m_data + size)
+    throw std::runtime_error("Token index " + path.string() + " is not valid");
+}
+
+void token_index::find(const std::string& token, bool whole_word,
+                       std::vector<token_hit>& hits) const {
+  std::vector<std::pair<db_uint, db_uint>> lines;
+
+  if (whole_word) {
+    db_uint lo = 0, hi = m_token_count;
+    while (lo < hi) {
+      db_uint mid = lo + (hi - lo) / 2;
+      if (std::strcmp(this->token(mid), token.c_str()) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    if (lo != m_token_count && token == this->token(lo)) postings(lo, lines);
+  } else {
+    // The token names are few compared to the text, so they are simply
+    // scanned.
+    for (db_uint i = 0; i != m_token_count; ++i)
+      if (std::strstr(this->token(i), token.c_str())) postings(i, lines);
+
+    std::sort(lines.begin(), lines.end());
+    lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+  }
+
+  db_uint chunk = 0;
+  for (auto i = lines.begin(); i != lines.end(); ++i) {
+    while (read_binary(m_chunk_starts + (chunk + 1) * sizeof(db_uint)) <=
+           i->first)
+      ++chunk;
+
+    token_hit hit;
+    hit.m_chunk = chunk;
+    hit.m_file =
+        i->first - read_binary(m_chunk_starts + chunk * sizeof(db_uint));
+    hit.m_line = i->second;
+    hits.push_back(hit);
+  }
+}
+
+const char* token_index::token(db_uint index) const {
+  return m_names + read_binary(m_table + index * table_entry_size);
+}
+
+void token_index::postings(
+    db_uint index, std::vector<std::pair<db_uint, db_uint>>& lines) const {
+  const char* entry = m_table + index * table_entry_size;
+  const char* p = m_postings + read_binary(entry + sizeof(db_uint));
+  db_uint count = read_binary(entry + sizeof(db_uint) * 2);
+
+  db_uint file = 0, line = 0;
+  for (db_uint i = 0; i != count; ++i) {
+    db_uint delta = static_cast<db_uint>(read_varint(p));
+    if (delta != 0) line = 0;
+    file += delta;
+    line += static_cast<db_uint>(read_varint(p));
+    lines.push_back(std::make_pair(file, line));
+  }
+}
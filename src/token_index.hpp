@@ -0,0 +1,95 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_TOKEN_INDEX_HPP
+#define CODEDB_TOKEN_INDEX_HPP
+
+#include "nsalias.hpp"
+#include "serialization.hpp"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <unordered_map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Tokens are the longest runs of letters, digits and underscores, which is
+// what a whole word search matches.
+inline bool is_token_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+// Whether str is a single, non-empty, token.
+bool is_token(const std::string& str);
+
+// A line that contains a token. The file is numbered within its chunk and the
+// line counts from one.
+struct token_hit {
+  db_uint m_chunk;
+  db_uint m_file;
+  db_uint m_line;
+};
+
+// Builds the posting lists of (file, line) for every token in a database.
+// Files must be added in database order and end_chunk called after the last
+// file of each chunk.
+class token_index_writer {
+ public:
+  token_index_writer();
+
+  // The later parts of a split file start at a later line.
+  void add_file(const char* begin, const char* end, db_uint first_line = 1);
+  void end_chunk();
+
+  void write(const bfs::path& path) const;
+
+ private:
+  struct posting_list {
+    posting_list() : m_file(0), m_line(0), m_count(0) {}
+
+    std::string m_data;
+    db_uint m_file;
+    db_uint m_line;
+    db_uint m_count;
+  };
+
+  std::unordered_map<std::string, posting_list> m_postings;
+  std::vector<db_uint> m_chunk_starts;
+  db_uint m_file_count;
+};
+
+class token_index {
+ public:
+  token_index(const bfs::path& path);
+
+  std::size_t chunk_count() const { return m_chunk_count; }
+
+  // Finds the lines that contain the token, or with whole_word false, any
+  // token that contains it. The hits are in database order.
+  void find(const std::string& token, bool whole_word,
+            std::vector<token_hit>& hits) const;
+
+ private:
+  const char* token(db_uint index) const;
+
+  // Appends the (file, line) pairs of a token, with files numbered over the
+  // whole database.
+  void postings(db_uint index,
+                std::vector<std::pair<db_uint, db_uint>>& lines) const;
+
+  bip::file_mapping m_mapping;
+  bip::mapped_region m_region;
+  const char* m_data;
+  db_uint m_chunk_count;
+  db_uint m_file_count;
+  db_uint m_token_count;
+  const char* m_chunk_starts;
+  const char* m_table;
+  const char* m_names;
+  const char* m_postings;
+};
+
+#endif
@@ -0,0 +1,366 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "trigram.hpp"
+
+#include <boost/filesystem/fstream.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+#include <iterator>
+
+namespace {
+const std::size_t table_entry_size = sizeof(db_uint) * 3;
+
+// Chunk filters get one bit per this many bytes of data, within limits.
+const std::size_t filter_bytes_per_bit = 8;
+const std::size_t min_filter_bits = 1 << 10;
+const std::size_t max_filter_bits = 1 << 20;
+
+// The distinct trigrams of a file are found with a bit for every possible
+// trigram. Two smaller levels above it mark the words that are in use, so the
+// trigrams come out in order and only those words are cleared for the next
+// file. Every thread keeps its own.
+class trigram_set {
+ public:
+  trigram_set() : m_bits(1 << 18), m_words(1 << 12), m_groups(1 << 6) {}
+
+  // Returns true if t wasn't in the set.
+  bool insert(trigram t) {
+    std::uint64_t& word = m_bits[t >> 6];
+    const std::uint64_t bit = std::uint64_t(1) << (t & 63);
+    if (word & bit) return false;
+
+    if (!word) {
+      m_words[t >> 12] |= std::uint64_t(1) << (t >> 6 & 63);
+      m_groups[t >> 18] |= std::uint64_t(1) << (t >> 12 & 63);
+    }
+    word |= bit;
+    return true;
+  }
+
+  // Writes the trigrams to out in order and empties the set.
+  void take(trigram* out) {
+    for (std::size_t g = 0; g != m_groups.size(); ++g) {
+      for (std::uint64_t groups = m_groups[g]; groups; groups &= groups - 1) {
+        const std::size_t w = g << 6 | lowest_bit(groups);
+        for (std::uint64_t words = m_words[w]; words; words &= words - 1) {
+          const std::size_t b = w << 6 | lowest_bit(words);
+          for (std::uint64_t bits = m_bits[b]; bits; bits &= bits - 1)
+            *out++ = trigram(b << 6 | lowest_bit(bits));
+          m_bits[b] = 0;
+        }
+        m_words[w] = 0;
+      }
+      m_groups[g] = 0;
+    }
+  }
+
+ private:
+  static unsigned lowest_bit(std::uint64_t x) {
+    static const unsigned char positions[64] = {
+        0,  1,  48, 2,  57, 49, 28, 3,  61, 58, 50, 42, 38, 29, 17, 4,
+        62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+        63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+        46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9,  13, 8,  7,  6};
+    return positions[((x & (0 - x)) * 0x03f79d71b4cb0a89ull) >> 58];
+  }
+
+  std::vector<std::uint64_t> m_bits;
+  std::vector<std::uint64_t> m_words;
+  std::vector<std::uint64_t> m_groups;
+};
+
+void flatten(trigram_query::op o, trigram_query& q,
+             std::vector<trigram_query>& subs) {
+  if (q.m_op == o) {
+    for (auto i = q.m_subs.begin(); i != q.m_subs.end(); ++i)
+      subs.push_back(std::move(*i));
+  } else {
+    subs.push_back(std::move(q));
+  }
+}
+}
+
+void extract_trigrams(const char* begin, const char* end,
+                      std::vector<trigram>& result) {
+  result.clear();
+  if (end - begin < 3) return;
+
+  static thread_local trigram_set set;
+
+  std::size_t count = 0;
+  for (const char* p = begin; p + 3 <= end; ++p)
+    if (set.insert(make_trigram(p))) ++count;
+
+  result.resize(count);
+  set.take(result.data());
+}
+
+trigram_query trigram_query::from_strings(
+    const std::vector<std::string>& strings) {
+  if (strings.empty()) return trigram_query(all);
+
+  trigram_query result(none);
+  for (auto i = strings.begin(); i != strings.end(); ++i) {
+    // A string shorter than a trigram can be anywhere.
+    if (i->size() < 3) return trigram_query(all);
+
+    trigram_query q(all);
+    for (std::size_t j = 0; j + 3 <= i->size(); ++j)
+      q = std::move(q) && from_trigram(make_trigram(i->c_str() + j));
+
+    result = std::move(result) || std::move(q);
+  }
+
+  return result;
+}
+
+trigram_query operator&&(trigram_query a, trigram_query b) {
+  if (a.m_op == trigram_query::none || b.m_op == trigram_query::all) return a;
+  if (b.m_op == trigram_query::none || a.m_op == trigram_query::all) return b;
+
+  trigram_query result(trigram_query::and_op);
+  flatten(trigram_query::and_op, a, result.m_subs);
+  flatten(trigram_query::and_op, b, result.m_subs);
+  return result;
+}
+
+trigram_query operator||(trigram_query a, trigram_query b) {
+  if (a.m_op == trigram_query::all || b.m_op == trigram_query::none) return a;
+  if (b.m_op == trigram_query::all || a.m_op == trigram_query::none) return b;
+
+  trigram_query result(trigram_query::or_op);
+  flatten(trigram_query::or_op, a, result.m_subs);
+  flatten(trigram_query::or_op, b, result.m_subs);
+  return result;
+}
+
+void chunk_filter::build(const char* begin, const char* end,
+                         std::string& filter) {
+  std::size_t bits = min_filter_bits;
+  while (bits < max_filter_bits &&
+         bits * filter_bytes_per_bit < std::size_t(end - begin))
+    bits *= 2;
+
+  filter.assign(bits / 8, 0);
+
+  chunk_filter f(filter.c_str(), filter.size());
+  unsigned char* out = reinterpret_cast<unsigned char*>(&filter[0]);
+  for (const char* p = begin; p + 3 <= end; ++p) {
+    db_uint bit = hash(make_trigram(p)) & f.m_mask;
+    out[bit >> 3] |= 1 << (bit & 7);
+  }
+}
+
+bool chunk_filter::may_match(const trigram_query& query) const {
+  switch (query.m_op) {
+    case trigram_query::all:
+      return true;
+    case trigram_query::none:
+      return false;
+    case trigram_query::tri:
+      return may_contain(query.m_trigram);
+    case trigram_query::and_op:
+      for (auto i = query.m_subs.begin(); i != query.m_subs.end(); ++i)
+        if (!may_match(*i)) return false;
+      return true;
+    case trigram_query::or_op:
+      for (auto i = query.m_subs.begin(); i != query.m_subs.end(); ++i)
+        if (may_match(*i)) return true;
+      return false;
+  }
+
+  return true;
+}
+
+trigram_index_writer::trigram_index_writer() : m_file_count(0) {
+  m_chunk_starts.push_back(0);
+}
+
+void trigram_index_writer::add_file(const char* begin, const char* end) {
+  extract_trigrams(begin, end, m_file_trigrams);
+  add_file(m_file_trigrams);
+}
+
+void trigram_index_writer::add_file(const std::vector<trigram>& trigrams) {
+  for (auto i = trigrams.begin(); i != trigrams.end(); ++i) {
+    posting_list& p = m_postings[*i];
+    write_varint(p.m_data, m_file_count - p.m_last);
+    p.m_last = m_file_count;
+    p.m_count++;
+  }
+
+  m_file_count++;
+}
+
+void trigram_index_writer::end_chunk() {
+  m_chunk_starts.push_back(m_file_count);
+}
+
+void trigram_index_writer::write(const bfs::path& path) const {
+  bfs::ofstream out(path, bfs::ofstream::binary);
+  if (!out.is_open())
+    throw std::runtime_error("Unable to open " + path.string() +
+                             " for writing");
+
+  std::vector<trigram> trigrams;
+  trigrams.reserve(m_postings.size());
+  for (auto i = m_postings.begin(); i != m_postings.end(); ++i)
+    trigrams.push_back(i->first);
+  std::sort(trigrams.begin(), trigrams.end());
+
+  out.write("TRI1", 4);
+  write_binary(out, static_cast<db_uint>(m_chunk_starts.size() - 1));
+  write_binary(out, m_file_count);
+  for (auto i = m_chunk_starts.begin(); i != m_chunk_starts.end(); ++i)
+    write_binary(out, *i);
+
+  // [{trigram, postings-offset, postings-count}]
+  write_binary(out, static_cast<db_uint>(trigrams.size()));
+  db_uint offset = 0;
+  for (auto i = trigrams.begin(); i != trigrams.end(); ++i) {
+    const posting_list& p = m_postings.find(*i)->second;
+    write_binary(out, *i);
+    write_binary(out, offset);
+    write_binary(out, p.m_count);
+    offset += static_cast<db_uint>(p.m_data.size());
+  }
+
+  // Delta encoded file numbers
+  for (auto i = trigrams.begin(); i != trigrams.end(); ++i) {
+    const std::string& data = m_postings.find(*i)->second.m_data;
+    out.write(data.c_str(), data.size());
+  }
+}
+
+trigram_index::trigram_index(const bfs::path& path)
+    : m_mapping(path.string().c_str(), bip::read_only),
+      m_region(m_mapping, bip::read_only),
+      m_data(static_cast<const char*>(m_region.get_address())) {
+  const std::size_t size = m_region.get_size();
+  const std::size_t header_size = 4 + sizeof(db_uint) * 2;
+
+  if (size < header_size || std::memcmp(m_data, "TRI1", 4) != 0)
+    throw std::runtime_error("Trigram index " + path.string() +
+                             " is not valid");
+
+  m_chunk_count = read_binary(m_data + 4);
+  m_file_count = read_binary(m_data + 4 + sizeof(db_uint));
+  m_chunk_starts = m_data + header_size;
+
+  const char* p = m_chunk_starts + (m_chunk_count + 1) * sizeof(db_uint);
+  m_trigram_count = read_binary(p);
+  m_table = p + sizeof(db_uint);
+  m_postings = m_table + m_trigram_count * table_entry_size;
+
+  if (m_postings > m_data + size)
+    throw std::runtime_error("Trigram index " + path.string() +
+                             " is not valid");
+}
+
+file_set trigram_index::select_files(const trigram_query& query) const {
+  result r = evaluate(query);
+  if (r.m_everything) return file_set();
+
+  file_set files = file_set::none();
+  db_uint chunk = 0;
+  for (auto i = r.m_files.begin(); i != r.m_files.end(); ++i) {
+    while (read_binary(m_chunk_starts + (chunk + 1) * sizeof(db_uint)) <= *i)
+      ++chunk;
+    files.add(chunk, *i - read_binary(m_chunk_starts + chunk * sizeof(db_uint)));
+  }
+
+  return files;
+}
+
+trigram_index::result trigram_index::evaluate(
+    const trigram_query& query) const {
+  result r;
+  r.m_everything = false;
+
+  switch (query.m_op) {
+    case trigram_query::all:
+      r.m_everything = true;
+      break;
+    case trigram_query::none:
+      break;
+    case trigram_query::tri:
+      postings(query.m_trigram, r.m_files);
+      break;
+    case trigram_query::and_op:
+      r.m_everything = true;
+      for (auto i = query.m_subs.begin(); i != query.m_subs.end(); ++i) {
+        result sub = evaluate(*i);
+        if (sub.m_everything) continue;
+
+        if (r.m_everything) {
+          r = std::move(sub);
+        } else {
+          std::vector<db_uint> both;
+          std::set_intersection(r.m_files.begin(), r.m_files.end(),
+                                sub.m_files.begin(), sub.m_files.end(),
+                                std::back_inserter(both));
+          r.m_files.swap(both);
+        }
+
+        if (r.m_files.empty()) break;
+      }
+      break;
+    case trigram_query::or_op:
+      for (auto i = query.m_subs.begin(); i != query.m_subs.end(); ++i) {
+        result sub = evaluate(*i);
+        if (sub.m_everything) return sub;
+
+        std::vector<db_uint> either;
+        std::set_union(r.m_files.begin(), r.m_files.end(), sub.m_files.begin(),
+                       sub.m_files.end(), std::back_inserter(either));
+        r.m_files.swap(either);
+      }
+      break;
+  }
+
+  return r;
+}
+
+void trigram_index::file_trigrams(
+    std::vector<std::vector<trigram>>& files) const {
+  files.assign(m_file_count, std::vector<trigram>());
+
+  for (db_uint i = 0; i != m_trigram_count; ++i) {
+    const char* entry = m_table + i * table_entry_size;
+    const trigram t = read_binary(entry);
+    const char* p = m_postings + read_binary(entry + sizeof(db_uint));
+    const db_uint count = read_binary(entry + sizeof(db_uint) * 2);
+
+    db_uint file = 0;
+    for (db_uint j = 0; j != count; ++j) {
+      file += static_cast<db_uint>(read_varint(p));
+      if (file < m_file_count) files[file].push_back(t);
+    }
+  }
+}
+
+void trigram_index::postings(trigram t, std::vector<db_uint>& files) const {
+  // Binary search the table for the trigram.
+  db_uint lo = 0, hi = m_trigram_count;
+  while (lo < hi) {
+    db_uint mid = lo + (hi - lo) / 2;
+    if (read_binary(m_table + mid * table_entry_size) < t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  const char* entry = m_table + lo * table_entry_size;
+  if (lo == m_trigram_count || read_binary(entry) != t) return;
+
+  const char* p = m_postings + read_binary(entry + sizeof(db_uint));
+  db_uint count = read_binary(entry + sizeof(db_uint) * 2);
+
+  files.reserve(count);
+  db_uint file = 0;
+  for (db_uint i = 0; i != count; ++i) {
+    file += static_cast<db_uint>(read_varint(p));
+    files.push_back(file);
+  }
+}
@@ -0,0 +1,167 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_TRIGRAM_HPP
+#define CODEDB_TRIGRAM_HPP
+
+#include "nsalias.hpp"
+#include "file_set.hpp"
+#include "serialization.hpp"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <unordered_map>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Trigrams are three consecutive bytes, with ASCII letters folded to lower
+// case so that one index serves both case sensitive and insensitive queries.
+typedef std::uint32_t trigram;
+
+inline unsigned char fold_case(unsigned char c) {
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+inline trigram make_trigram(const char* p) {
+  return fold_case(p[0]) << 16 | fold_case(p[1]) << 8 | fold_case(p[2]);
+}
+
+// Collects the distinct trigrams in [begin, end), sorted.
+void extract_trigrams(const char* begin, const char* end,
+                      std::vector<trigram>& result);
+
+// A boolean query over trigrams. Every file that can contain a match for the
+// query's regex satisfies the query, but not the other way around.
+class trigram_query {
+ public:
+  enum op {
+    all,
+    none,
+    and_op,
+    or_op,
+    tri
+  };
+
+  trigram_query(op o = all) : m_op(o), m_trigram(0) {}
+
+  static trigram_query from_trigram(trigram t) {
+    trigram_query q(tri);
+    q.m_trigram = t;
+    return q;
+  }
+
+  // Trigrams that every match of a string from the set contains.
+  static trigram_query from_strings(const std::vector<std::string>& strings);
+
+  friend trigram_query operator&&(trigram_query a, trigram_query b);
+  friend trigram_query operator||(trigram_query a, trigram_query b);
+
+  op m_op;
+  trigram m_trigram;
+  std::vector<trigram_query> m_subs;
+};
+
+// A bitmap of hashed trigrams stored with each chunk. It can tell for certain
+// that a chunk doesn't contain a trigram, which lets a search skip the chunk
+// without decompressing it. A default constructed filter contains everything.
+class chunk_filter {
+ public:
+  chunk_filter() : m_bits(0), m_mask(0) {}
+
+  chunk_filter(const char* bits, std::size_t size)
+      : m_bits(reinterpret_cast<const unsigned char*>(bits)),
+        m_mask(size ? static_cast<db_uint>(size * 8 - 1) : 0) {}
+
+  // Creates a filter of the trigrams in [begin, end). The filter size is a
+  // power of two that grows with the amount of data.
+  static void build(const char* begin, const char* end, std::string& filter);
+
+  bool may_contain(trigram t) const {
+    if (!m_bits) return true;
+    db_uint bit = hash(t) & m_mask;
+    return (m_bits[bit >> 3] & (1 << (bit & 7))) != 0;
+  }
+
+  bool may_match(const trigram_query& query) const;
+
+  // The bits as they are stored in the database.
+  const char* data() const { return reinterpret_cast<const char*>(m_bits); }
+  std::size_t size() const { return m_bits ? (m_mask + 1) / 8 : 0; }
+
+ private:
+  static db_uint hash(trigram t) { return (t * 0x9e3779b1u) >> 12; }
+
+  const unsigned char* m_bits;
+  db_uint m_mask;
+};
+
+// Builds the trigram posting lists for a database. Files must be added in
+// database order and end_chunk called after the last file of each chunk.
+class trigram_index_writer {
+ public:
+  trigram_index_writer();
+
+  void add_file(const char* begin, const char* end);
+
+  // Adds a file by its distinct trigrams, sorted as by extract_trigrams.
+  void add_file(const std::vector<trigram>& trigrams);
+
+  void end_chunk();
+
+  void write(const bfs::path& path) const;
+
+ private:
+  struct posting_list {
+    posting_list() : m_last(0), m_count(0) {}
+
+    std::string m_data;
+    db_uint m_last;
+    db_uint m_count;
+  };
+
+  std::unordered_map<trigram, posting_list> m_postings;
+  std::vector<db_uint> m_chunk_starts;
+  std::vector<trigram> m_file_trigrams;
+  db_uint m_file_count;
+};
+
+class trigram_index {
+ public:
+  trigram_index(const bfs::path& path);
+
+  std::size_t chunk_count() const { return m_chunk_count; }
+
+  // Finds the files that may contain a match for the query.
+  file_set select_files(const trigram_query& query) const;
+
+  // The number of the first file of a chunk, counting over every chunk.
+  db_uint first_file(std::size_t chunk) const {
+    return read_binary(m_chunk_starts + chunk * sizeof(db_uint));
+  }
+
+  // Lists the distinct trigrams of every file, sorted, as the writer got them.
+  void file_trigrams(std::vector<std::vector<trigram>>& files) const;
+
+ private:
+  struct result {
+    bool m_everything;
+    std::vector<db_uint> m_files;
+  };
+
+  result evaluate(const trigram_query& query) const;
+  void postings(trigram t, std::vector<db_uint>& files) const;
+
+  bip::file_mapping m_mapping;
+  bip::mapped_region m_region;
+  const char* m_data;
+  db_uint m_chunk_count;
+  db_uint m_file_count;
+  db_uint m_trigram_count;
+  const char* m_chunk_starts;
+  const char* m_table;
+  const char* m_postings;
+};
+
+#endif
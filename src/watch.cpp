@@ -0,0 +1,249 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "watch.hpp"
+#include "build.hpp"
+#include "config.hpp"
+#include "options.hpp"
+#include "regex.hpp"
+#include "database.hpp"
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <iostream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <set>
+
+namespace {
+const std::uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MODIFY |
+                                 IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO;
+
+// Watches every directory of the tree that the build would look at, and
+// collects the paths of the files it would index that change.
+class watcher {
+ public:
+  watcher(const bfs::path& root, const bfs::path& cdb_path,
+          regex_ptr file_inc_re, regex_ptr dir_excl_re)
+      : m_fd(inotify_init1(IN_CLOEXEC)),
+        m_root(root),
+        m_cdb_path(cdb_path),
+        m_overflow(false),
+        m_file_inc_re(std::move(file_inc_re)),
+        m_dir_excl_re(std::move(dir_excl_re)) {
+    if (m_fd < 0)
+      throw std::runtime_error(std::string("Unable to start inotify: ") +
+                               std::strerror(errno));
+
+    add_tree(root);
+  }
+
+  ~watcher() { close(m_fd); }
+
+  // Waits for a change, and then for as long as the delay to collect the
+  // changes that come with it.
+  void wait(unsigned delay) {
+    while (!read_events(-1)) {
+    }
+
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+    for (;;) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0) break;
+
+      read_events(static_cast<int>(left.count()));
+    }
+  }
+
+  // Adds the paths that changed since the last call, relative to the root, to
+  // paths. Directories that were created, moved or deleted stand for
+  // everything under them. Returns false if events were lost, and anything
+  // may have changed.
+  bool take_changes(std::vector<std::string>& paths) {
+    paths.insert(paths.end(), m_changed.begin(), m_changed.end());
+    m_changed.clear();
+
+    const bool complete = !m_overflow;
+    m_overflow = false;
+    return complete;
+  }
+
+ private:
+  // Like the build, directory links aren't followed.
+  void add_tree(const bfs::path& dir) {
+    if (dir == m_cdb_path) return;
+
+    int wd = inotify_add_watch(m_fd, dir.string().c_str(),
+                               watch_mask | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+      // Directories can be gone before they are watched.
+      if (errno == ENOENT || errno == ENOTDIR) return;
+      throw std::runtime_error("Unable to watch " + dir.string() + ": " +
+                               std::strerror(errno));
+    }
+
+    m_dirs[wd] = dir;
+
+    boost::system::error_code ec;
+    for (bfs::directory_iterator i(dir, ec), end; !ec && i != end;
+         i.increment(ec)) {
+      const bfs::path& p = i->path();
+      if (bfs::is_directory(i->symlink_status()) &&
+          !m_dir_excl_re->match(p.filename().string()))
+        add_tree(p);
+    }
+  }
+
+  // A directory that is moved away keeps its watches, which are dropped
+  // since the paths are no longer right.
+  void remove_tree(const bfs::path& dir) {
+    const std::string prefix = dir.string() + '/';
+    for (auto i = m_dirs.begin(); i != m_dirs.end();) {
+      const std::string path = i->second.string();
+      if (path == dir.string() || path.compare(0, prefix.size(), prefix) == 0) {
+        inotify_rm_watch(m_fd, i->first);
+        m_dirs.erase(i++);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  // Reads the events that arrive within the timeout, in milliseconds or -1 to
+  // wait for ever. Returns true if any of them can change the index.
+  bool read_events(int timeout) {
+    pollfd fd = {m_fd, POLLIN, 0};
+    int ready = poll(&fd, 1, timeout);
+    if (ready < 0 && errno != EINTR)
+      throw std::runtime_error(std::string("Unable to wait for changes: ") +
+                               std::strerror(errno));
+    if (ready <= 0) return false;
+
+    alignas(inotify_event) char buffer[64 * 1024];
+    ssize_t size = read(m_fd, buffer, sizeof(buffer));
+    if (size < 0) {
+      if (errno == EINTR || errno == EAGAIN) return false;
+      throw std::runtime_error(std::string("Unable to read changes: ") +
+                               std::strerror(errno));
+    }
+
+    bool changed = false;
+    for (const char* p = buffer; p < buffer + size;) {
+      const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+      p += sizeof(inotify_event) + event->len;
+
+      // Events were lost, anything may have changed.
+      if (event->mask & IN_Q_OVERFLOW) {
+        m_overflow = true;
+        changed = true;
+        continue;
+      }
+
+      auto dir = m_dirs.find(event->wd);
+      if (dir == m_dirs.end()) continue;
+
+      if (event->mask & IN_IGNORED) {
+        m_dirs.erase(dir);
+        continue;
+      }
+
+      if (event->len == 0) continue;
+
+      const std::string name = event->name;
+      const bfs::path path = dir->second / name;
+      if (event->mask & IN_ISDIR) {
+        if (m_dir_excl_re->match(name) || path == m_cdb_path) continue;
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) add_tree(path);
+        if (event->mask & IN_MOVED_FROM) remove_tree(path);
+      } else if (!m_file_inc_re->match(name)) {
+        continue;
+      }
+
+      m_changed.insert(
+          path.generic_string().substr(m_root.generic_string().size() + 1));
+      changed = true;
+    }
+
+    return changed;
+  }
+
+  int m_fd;
+  bfs::path m_root;
+  bfs::path m_cdb_path;
+  bool m_overflow;
+  std::set<std::string> m_changed;
+  regex_ptr m_file_inc_re;
+  regex_ptr m_dir_excl_re;
+  std::map<int, bfs::path> m_dirs;
+};
+}
+
+void watch(const bfs::path& cdb_path, const options& opt) {
+  config cfg = load_config(cdb_path / "config");
+
+  const unsigned delay =
+      boost::lexical_cast<unsigned>(cfg.get_value("watch-delay"));
+  const unsigned compact_after =
+      boost::lexical_cast<unsigned>(cfg.get_value("watch-compact"));
+
+  // The tree is watched before the first update, so that no change is missed
+  // in between.
+  watcher w(cdb_path.parent_path(), cdb_path,
+            compile_regex(cfg.get_value("file-include")),
+            compile_regex(cfg.get_value("dir-exclude")));
+
+  options update;
+  update.m_mode = options::build;
+  update.m_options = opt.m_options;
+  update.m_options["-u"];
+
+  std::cout << "CodeDB watching " << cdb_path.parent_path().string()
+            << std::endl;
+
+  const bfs::path blob = cdb_path / "db";
+  bool everything = true;
+  std::vector<std::string> changed;
+  for (;;) {
+    // The index is updated like with 'build -u', but only the paths that
+    // changed are looked at, unless events were lost. Readers see the new
+    // segment once it's listed. A failed update, such as a file that is
+    // deleted while it's read, is retried with the next change.
+    try {
+      if (everything)
+        build(cdb_path, update);
+      else
+        update_paths(cdb_path, update, changed);
+
+      everything = false;
+      changed.clear();
+
+      const bfs::path current = current_generation(blob);
+      if (compact_after != 0 && bfs::exists(segment_list_path(current)) &&
+          read_segment_list(current).size() >= compact_after)
+        compact(cdb_path, opt);
+    }
+    catch (const std::exception& e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+    }
+
+    w.wait(delay);
+    if (!w.take_changes(changed)) everything = true;
+  }
+}
+#else
+void watch(const bfs::path&, const options&) {
+  throw std::runtime_error("watch requires inotify, which only Linux has");
+}
+#endif
@@ -0,0 +1,14 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_WATCH_HPP
+#define CODEDB_WATCH_HPP
+
+#include "nsalias.hpp"
+
+#include <boost/filesystem.hpp>
+
+struct options;
+
+void watch(const bfs::path& cdb_path, const options& opt);
+
+#endif
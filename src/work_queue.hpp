@@ -0,0 +1,119 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_WORK_QUEUE_HPP
+#define CODEDB_WORK_QUEUE_HPP
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+#include <deque>
+#include <vector>
+
+// A bounded first in, first out queue between threads. Once closed, put
+// discards its item and get fails when the queue is empty.
+template <class T>
+class work_queue {
+ public:
+  explicit work_queue(std::size_t capacity)
+      : m_capacity(capacity), m_closed(false) {}
+
+  void put(T& item) {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    while (!m_closed && m_items.size() >= m_capacity) m_free.wait(lock);
+    if (m_closed) return;
+
+    m_items.push_back(T());
+    std::swap(m_items.back(), item);
+
+    m_full.notify_one();
+  }
+
+  bool get(T& item) {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    while (!m_closed && m_items.empty()) m_full.wait(lock);
+    if (m_items.empty()) return false;
+
+    std::swap(item, m_items.front());
+    m_items.pop_front();
+
+    m_free.notify_one();
+    return true;
+  }
+
+  void close() {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    m_closed = true;
+    m_free.notify_all();
+    m_full.notify_all();
+  }
+
+ private:
+  std::deque<T> m_items;
+  std::size_t m_capacity;
+  bool m_closed;
+  boost::mutex m_mutex;
+  boost::condition m_free;
+  boost::condition m_full;
+};
+
+// Items that are numbered from zero and put by several threads in any order,
+// but taken in order. Item n can only be put once item n - capacity has been
+// taken, which bounds the number of items that are waiting. Closing the queue
+// wakes up every waiting thread, and get fails once the next item is missing.
+template <class T>
+class ordered_queue {
+ public:
+  explicit ordered_queue(std::size_t capacity)
+      : m_slots(capacity), m_ready(capacity, false), m_next(0),
+        m_closed(false) {}
+
+  void put(std::size_t index, T& item) {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    while (!m_closed && index >= m_next + m_slots.size()) m_free.wait(lock);
+    if (m_closed) return;
+
+    const std::size_t slot = index % m_slots.size();
+    std::swap(m_slots[slot], item);
+    m_ready[slot] = true;
+
+    m_full.notify_all();
+  }
+
+  bool get(T& item) {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    const std::size_t slot = m_next % m_slots.size();
+    while (!m_closed && !m_ready[slot]) m_full.wait(lock);
+    if (!m_ready[slot]) return false;
+
+    std::swap(item, m_slots[slot]);
+    m_ready[slot] = false;
+    ++m_next;
+
+    m_free.notify_all();
+    return true;
+  }
+
+  void close() {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    m_closed = true;
+    m_free.notify_all();
+    m_full.notify_all();
+  }
+
+ private:
+  std::vector<T> m_slots;
+  std::vector<bool> m_ready;
+  std::size_t m_next;
+  bool m_closed;
+  boost::mutex m_mutex;
+  boost::condition m_free;
+  boost::condition m_full;
+};
+
+#endif
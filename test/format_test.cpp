@@ -0,0 +1,96 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "test.hpp"
+#include "database.hpp"
+#include "serialization.hpp"
+
+#include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace {
+const std::uint64_t gib = std::uint64_t(1) << 30;
+
+// Encodes a value and checks that it takes the expected number of bytes and
+// decodes to itself.
+void check_varint(std::uint64_t value, std::size_t size) {
+  std::string data;
+  write_varint(data, value);
+  data += '\x7f';
+
+  const char* p = data.c_str();
+  CHECK(read_varint(p) == value);
+  CHECK(p == data.c_str() + size);
+  CHECK(data.size() == size + 1);
+}
+}
+
+TEST(varint_boundaries) {
+  check_varint(0, 1);
+  check_varint(0x7f, 1);
+  check_varint(0x80, 2);
+  check_varint(0x3fff, 2);
+  check_varint(0x4000, 3);
+  check_varint(0xffffffffu, 5);
+  check_varint(std::uint64_t(1) << 32, 5);
+  check_varint((std::uint64_t(1) << 63) - 1, 9);
+  check_varint(std::uint64_t(1) << 63, 10);
+  check_varint(std::numeric_limits<std::uint64_t>::max(), 10);
+}
+
+// The chunks are left out of a sparse file, only the table of contents that
+// refers to them past 4 GiB is written.
+TEST(toc_offsets_past_4_gib) {
+  if (sizeof(void*) < 8) return;
+
+  const bfs::path dir =
+      bfs::temp_directory_path() / bfs::unique_path("cdb-test-%%%%-%%%%");
+  bfs::create_directories(dir);
+  const bfs::path blob = dir / "db";
+
+  std::vector<chunk_info> chunks(2);
+  chunks[0].m_offset = 4;
+  chunks[0].m_size = 5 * gib - 4 - 8;
+  chunks[0].m_uncompressed_size = 7 * gib;
+  chunks[0].m_file_count = 3;
+  chunks[0].m_first_path = "a/first.cpp";
+  chunks[0].m_last_path = "a/last.cpp";
+  chunks[1].m_offset = 5 * gib;
+  chunks[1].m_size = 16;
+  chunks[1].m_uncompressed_size = 5 * gib + 1;
+  chunks[1].m_file_count = 1;
+  chunks[1].m_first_path = "b.cpp";
+  chunks[1].m_last_path = "b.cpp";
+  const std::uint64_t toc_offset = chunks[1].m_offset + 8 + chunks[1].m_size;
+
+  {
+    bfs::ofstream out(blob, bfs::ofstream::binary);
+    out.write("CDB5", 4);
+    out.seekp(static_cast<std::streamoff>(chunks[1].m_offset));
+    write_binary64(out, chunks[1].m_size);
+    out.write(std::string(chunks[1].m_size, 'x').c_str(), chunks[1].m_size);
+    write_toc(out, chunks, toc_offset);
+    CHECK(out.good());
+  }
+
+  {
+    database_ptr db = open_blob(blob);
+    CHECK(db->chunk_count() == chunks.size());
+    for (std::size_t i = 0; i != chunks.size() && i != db->chunk_count();
+         ++i) {
+      const chunk_info& info = db->get_chunk_info(i);
+      CHECK(info.m_offset == chunks[i].m_offset);
+      CHECK(info.m_size == chunks[i].m_size);
+      CHECK(info.m_uncompressed_size == chunks[i].m_uncompressed_size);
+      CHECK(info.m_file_count == chunks[i].m_file_count);
+      CHECK(info.m_first_path == chunks[i].m_first_path);
+      CHECK(info.m_last_path == chunks[i].m_last_path);
+    }
+  }
+
+  bfs::remove_all(dir);
+}
@@ -0,0 +1,49 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "test.hpp"
+
+#include <exception>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+namespace {
+typedef std::vector<std::pair<const char*, void (*)()>> test_list;
+
+// Tests register themselves before main, in no particular order.
+test_list& tests() {
+  static test_list list;
+  return list;
+}
+
+unsigned s_failures = 0;
+}
+
+test_case::test_case(const char* name, void (*run)()) {
+  tests().push_back(std::make_pair(name, run));
+}
+
+void check_that(bool ok, const char* expr, const char* file, int line) {
+  if (ok) return;
+
+  std::cerr << file << ':' << line << ": check failed: " << expr << '\n';
+  ++s_failures;
+}
+
+int main() {
+  for (auto i = tests().begin(); i != tests().end(); ++i) {
+    const unsigned failures = s_failures;
+    try {
+      i->second();
+    }
+    catch (const std::exception& e) {
+      std::cerr << i->first << ": " << e.what() << '\n';
+      ++s_failures;
+    }
+
+    std::cout << (s_failures == failures ? "ok    " : "FAIL  ") << i->first
+              << '\n';
+  }
+
+  return s_failures == 0 ? 0 : 1;
+}
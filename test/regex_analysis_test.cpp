@@ -0,0 +1,62 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#include "test.hpp"
+#include "regex_analysis.hpp"
+
+#include <stdexcept>
+#include <string>
+
+namespace {
+bool parses(const std::string& expr) {
+  try {
+    parse_regex(expr);
+    return true;
+  }
+  catch (const std::runtime_error&) {
+    return false;
+  }
+}
+}
+
+TEST(required_literal_plain) {
+  CHECK(required_literal("std::vector", false, true) == "std::vector");
+  CHECK(required_literal("(?:std)::vector", false, true) == "std::vector");
+  CHECK(required_literal("STD::vector", true, true) == "std::vector");
+  CHECK(required_literal("\\(size_t\\)", false, true) == "(size_t)");
+}
+
+// Flags change what the rest of the regex matches.
+TEST(flag_groups_are_not_analyzed) {
+  CHECK(!parses("(?i:STD)::vector"));
+  CHECK(!parses("(?i)std::VECTOR"));
+  CHECK(!parses("(?s:a.b)"));
+  CHECK(parses("(?-:abc)"));
+  CHECK(required_literal("(?i:STD)::vector", false, true).empty());
+  CHECK(required_literal("(?i)std::VECTOR", false, true).empty());
+}
+
+// These escapes are assertions in boost.regex and xpressive, not characters.
+TEST(assertion_escapes_are_not_analyzed) {
+  CHECK(!parses("\\<size_t\\>"));
+  CHECK(!parses("\\`abc"));
+  CHECK(!parses("abc\\'"));
+  CHECK(!parses("[\\<]"));
+  CHECK(required_literal("\\<size_t\\>", false, true).empty());
+  CHECK(regex_trigram_query("\\<size_t\\>").m_op == trigram_query::all);
+}
+
+// Only regexes that match one plain string can be looked up in the suffix
+// array, everything else has to be searched as a regex.
+TEST(literal_regex_plain_strings_only) {
+  std::string literal;
+  CHECK(literal_regex("abc", literal) && literal == "abc");
+  CHECK(literal_regex("a\\.b(?:c)", literal) && literal == "a.bc");
+  CHECK(!literal_regex("(?i:abc)", literal));
+  CHECK(!literal_regex("(?i)abc", literal));
+  CHECK(!literal_regex("(?)abc", literal));
+  CHECK(!literal_regex("\\<abc\\>", literal));
+  CHECK(!literal_regex("\\`abc", literal));
+  CHECK(!literal_regex("abc\\'", literal));
+  CHECK(!literal_regex("\\babc\\b", literal));
+  CHECK(!literal_regex("a|b", literal));
+}
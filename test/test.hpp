@@ -0,0 +1,22 @@
+// CodeDB - public domain - 2010 Daniel Andersson
+
+#ifndef CODEDB_TEST_HPP
+#define CODEDB_TEST_HPP
+
+// Tests are functions that register themselves with TEST, and report what
+// doesn't hold with CHECK. A failed check doesn't stop the test.
+#define TEST(name)                                   \
+  static void name();                                \
+  static const test_case name##_case(#name, &name); \
+  static void name()
+
+#define CHECK(expr) check_that((expr), #expr, __FILE__, __LINE__)
+
+class test_case {
+ public:
+  test_case(const char* name, void (*run)());
+};
+
+void check_that(bool ok, const char* expr, const char* file, int line);
+
+#endif